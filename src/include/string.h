@@ -8,6 +8,7 @@ void* memcpy(void *dst, const void *src, size_t n);
 void* memmove(void *dst, const void *src, size_t n);
 void* memset(void *s, int c, size_t n);
 
+int strcmp(const char *s1, const char *s2);
 size_t strlen(const char *s);
 
 
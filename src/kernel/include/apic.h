@@ -0,0 +1,25 @@
+#ifndef APIC_H
+#define APIC_H
+
+
+#include <stdint.h>
+
+#define LAPIC_DEFAULT_BASE  0xFEE00000
+
+// interrupt command register delivery modes
+#define LAPIC_ICR_FIXED     0x00000000
+#define LAPIC_ICR_INIT      0x00000500
+#define LAPIC_ICR_STARTUP   0x00000600
+#define LAPIC_ICR_ASSERT    0x00004000
+
+uint32_t lapic_id();
+void lapic_eoi();
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr);
+void lapic_timer_calibrate();
+void lapic_timer_start();
+void lapic_perf_nmi(int enabled);
+void lapic_init_cpu();
+void lapic_init();
+
+
+#endif // APIC_H
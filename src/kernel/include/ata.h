@@ -0,0 +1,65 @@
+#ifndef ATA_H
+#define ATA_H
+
+
+#include <stdint.h>
+
+/*
+ATA task file of a channel, relative to its base port
+
+    0   data                    4   LBA bits 8-15
+    1   error / features        5   LBA bits 16-23
+    2   sector count            6   drive select, LBA bits 24-27
+    3   LBA bits 0-7            7   status / command
+
+The device control register (nIEN, SRST) and the alternate status are at
+the control port. The bus master registers of a channel are
+
+    0   command (start, read)   4   address of the PRD table
+    2   status (irq, error)
+*/
+
+#define ATA_PRIMARY_BASE    0x1F0
+#define ATA_PRIMARY_CTRL    0x3F6
+#define ATA_SECONDARY_BASE  0x170
+#define ATA_SECONDARY_CTRL  0x376
+
+#define ATA_REG_DATA        0
+#define ATA_REG_ERROR       1
+#define ATA_REG_COUNT       2
+#define ATA_REG_LBA0        3
+#define ATA_REG_LBA1        4
+#define ATA_REG_LBA2        5
+#define ATA_REG_DRIVE       6
+#define ATA_REG_STATUS      7
+#define ATA_REG_COMMAND     7
+
+#define ATA_SR_ERR          0x01
+#define ATA_SR_DRQ          0x08
+#define ATA_SR_DF           0x20
+#define ATA_SR_BSY          0x80
+
+#define ATA_CTRL_NIEN       0x02
+
+#define ATA_CMD_READ_PIO    0x20
+#define ATA_CMD_WRITE_PIO   0x30
+#define ATA_CMD_READ_DMA    0xC8
+#define ATA_CMD_WRITE_DMA   0xCA
+#define ATA_CMD_IDENTIFY    0xEC
+
+#define BM_REG_COMMAND      0
+#define BM_REG_STATUS       2
+#define BM_REG_PRDT         4
+
+#define BM_CMD_START        0x01
+#define BM_CMD_READ         0x08    // device to memory
+#define BM_SR_ERR           0x02
+#define BM_SR_IRQ           0x04
+
+#define ATA_MAX_SECTORS     128     // per request, 64 KiB
+#define ATA_MAX_SEGMENTS    64      // bios per request
+
+void ata_init();
+
+
+#endif // ATA_H
@@ -0,0 +1,77 @@
+#ifndef ATOMIC_H
+#define ATOMIC_H
+
+
+#include <stdint.h>
+
+// Prevents the compiler from moving memory accesses across it. x86 does not
+// reorder stores with other stores or loads with other loads.
+#define barrier() asm volatile("" : : : "memory")
+
+// Full barrier, also orders earlier stores before later loads. A locked
+// instruction works on every cpu, unlike mfence.
+#define mb() asm volatile("lock; addl $0, (%%esp)" : : : "memory", "cc")
+
+// Atomically stores a value and returns the old one.
+static inline uint32_t xchg(volatile uint32_t *ptr, uint32_t value)
+{
+    asm volatile("xchg %0, %1" : "+r" (value), "+m" (*ptr) : : "memory");
+    return value;
+}
+
+// Stores value if *ptr equals old, returns the value *ptr had.
+static inline uint32_t cmpxchg(volatile uint32_t *ptr, uint32_t old, uint32_t value)
+{
+    uint32_t prev;
+    asm volatile("lock cmpxchg %2, %1"
+                 : "=a" (prev), "+m" (*ptr)
+                 : "r" (value), "0" (old)
+                 : "memory");
+    return prev;
+}
+
+// Stores a qword value if *ptr equals old, returns the value *ptr had.
+static inline uint64_t cmpxchg64(volatile uint64_t *ptr, uint64_t old, uint64_t value)
+{
+    uint64_t prev;
+    asm volatile("lock cmpxchg8b %1"
+                 : "=A" (prev), "+m" (*ptr)
+                 : "b" ((uint32_t)value), "c" ((uint32_t)(value >> 32)), "0" (old)
+                 : "memory");
+    return prev;
+}
+
+// Atomically adds a value and returns the old one.
+static inline uint32_t xadd(volatile uint32_t *ptr, uint32_t value)
+{
+    asm volatile("lock xadd %0, %1" : "+r" (value), "+m" (*ptr) : : "memory");
+    return value;
+}
+
+static inline void atomic_inc(volatile uint32_t *ptr)
+{
+    asm volatile("lock incl %0" : "+m" (*ptr) : : "memory");
+}
+
+static inline void atomic_dec(volatile uint32_t *ptr)
+{
+    asm volatile("lock decl %0" : "+m" (*ptr) : : "memory");
+}
+
+static inline void atomic_and(volatile uint32_t *ptr, uint32_t mask)
+{
+    asm volatile("lock andl %1, %0" : "+m" (*ptr) : "r" (mask) : "memory");
+}
+
+static inline void atomic_or(volatile uint32_t *ptr, uint32_t mask)
+{
+    asm volatile("lock orl %1, %0" : "+m" (*ptr) : "r" (mask) : "memory");
+}
+
+static inline void cpu_relax()
+{
+    asm volatile("pause" : : : "memory");
+}
+
+
+#endif // ATOMIC_H
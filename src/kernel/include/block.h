@@ -0,0 +1,107 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+
+#include <stdint.h>
+#include "spinlock.h"
+
+/*
+Block layer
+
+Callers submit bios, each a run of sectors with one buffer, and are told
+about their completion through a callback. Bios are merged into the
+pending requests of the queue if they continue or precede one in the same
+direction, so the driver sees few, large transfers. The pending requests
+are kept sorted by sector and dispatched in one direction (C-LOOK), up to
+the queue depth of the device at a time. The driver is handed a batch of
+requests and kicked once for all of them, it completes every request from
+its interrupt handler, which dispatches the next batch.
+
+Every device is the read-only file dev/<name> as well, its pages are read
+through the page cache with block_read().
+*/
+
+#define BLOCK_SECTOR_SIZE   512
+
+#define BLOCK_EINVAL        -1
+#define BLOCK_ENOMEM        -2
+#define BLOCK_EIO           -3
+
+#define BIO_READ            0
+#define BIO_WRITE           1
+
+struct bio;
+struct block_device;
+struct block_queue;
+struct block_request;
+
+// Called when a bio is done, from interrupt context.
+typedef void (*bio_done_t)(struct bio *bio, int error);
+// Prepares the transfer of a request, the driver calls block_complete() once
+// it is done.
+typedef void (*block_start_t)(struct block_queue *queue, struct block_request *request);
+// Tells the device about the requests prepared since the last kick, may be
+// NULL if start already does.
+typedef void (*block_kick_t)(struct block_queue *queue);
+
+typedef struct bio
+{
+    struct block_device *device;
+    uint32_t sector;
+    uint32_t count;         // sectors
+    void *buffer;           // physically contiguous
+    int write;
+    bio_done_t done;
+    void *private;          // for the owner of the bio
+    struct bio *next;       // next bio of the same request
+} bio_t;
+
+typedef struct block_request
+{
+    struct block_device *device;
+    uint32_t sector;
+    uint32_t count;
+    int write;
+    unsigned segments;      // number of bios
+    bio_t *head;            // bios in sector order
+    bio_t *tail;
+    struct block_request *next;
+} block_request_t;
+
+typedef struct block_queue
+{
+    spinlock_t lock;
+    block_request_t *pending;   // sorted by sector
+    unsigned in_flight;         // requests the device works on
+    unsigned depth;             // limit of in_flight
+    uint32_t position;          // sector after the last dispatched request
+    uint32_t max_sectors;       // limits of a single request
+    unsigned max_segments;
+    block_start_t start;
+    block_kick_t kick;
+    void *private;              // for the driver
+} block_queue_t;
+
+typedef struct block_device
+{
+    const char *name;
+    uint32_t sectors;
+    block_queue_t *queue;       // may be shared by devices on one bus
+    void *private;              // for the driver
+    struct block_device *next;
+} block_device_t;
+
+void block_queue_init(block_queue_t *queue, uint32_t max_sectors, unsigned max_segments, unsigned depth, block_start_t start, block_kick_t kick, void *private);
+void block_register(block_device_t *device);
+block_device_t* block_find(const char *name);
+int block_submit(bio_t *bio);
+void block_complete(block_queue_t *queue, block_request_t *request, int error);
+int block_read(block_device_t *device, uint32_t sector, uint32_t count, void *buffer);
+int block_write(block_device_t *device, uint32_t sector, uint32_t count, const void *buffer);
+
+#ifdef BLOCK_CHECK
+void block_check();
+#endif
+
+
+#endif // BLOCK_H
@@ -0,0 +1,23 @@
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+
+#include "spinlock.h"
+#include "thread.h"
+
+// One-shot event a thread can sleep on until another thread or an
+// interrupt handler signals it.
+typedef struct completion
+{
+    spinlock_t lock;
+    int done;
+    thread_t *waiter;
+} completion_t;
+
+#define COMPLETION_INIT { .lock = SPINLOCK_INIT("completion"), .done = 0, .waiter = NULL }
+
+void wait_for_completion(completion_t *completion);
+void complete(completion_t *completion);
+
+
+#endif // COMPLETION_H
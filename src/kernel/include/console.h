@@ -2,6 +2,9 @@
 #define CONSOLE_H
 
 
+#include "multiboot.h"
+
+void console_init(multiboot_info_t *mb_info);
 void kclear();
 void kprintf(const char *format, ...);
 
@@ -0,0 +1,151 @@
+#ifndef CPU_H
+#define CPU_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_CPUS 8
+
+// cpuid leaf 1 feature flags
+#define CPUID_ECX_MONITOR   (1 << 3)
+#define CPUID_EDX_FPU       (1 << 0)
+#define CPUID_EDX_TSC       (1 << 4)
+#define CPUID_EDX_SEP       (1 << 11)
+#define CPUID_EDX_PAT       (1 << 16)
+#define CPUID_EDX_FXSR      (1 << 24)
+#define CPUID_EDX_SSE       (1 << 25)
+
+// cpuid leaf 0x80000001 feature flags
+#define CPUID_EXTENDED      0x80000000
+#define CPUID_EXT_FEATURES  0x80000001
+#define CPUID_EXT_EDX_NX    (1 << 20)
+
+#define MSR_APIC_BASE       0x1B
+#define MSR_PAT             0x277
+#define MSR_PMC0            0x0C1
+#define MSR_PERFEVTSEL0     0x186
+#define MSR_FIXED_CTR0      0x309
+#define MSR_FIXED_CTR_CTRL  0x38D
+#define MSR_PERF_GLOBAL_CTRL 0x38F
+#define MSR_EFER            0xC0000080
+
+#define EFER_NXE            (1 << 11)   // no execute bit of PAE paging
+
+// cpuid leaf 0xA, architectural performance monitoring
+#define CPUID_PMU           0x0A
+#define CPUID_PMU_VERSION(eax)  ((eax) & 0xFF)
+#define CPUID_PMU_COUNTERS(eax) (((eax) >> 8) & 0xFF)
+#define CPUID_PMU_WIDTH(eax)    (((eax) >> 16) & 0xFF)
+#define CPUID_PMU_EVENTS(eax)   ((eax) >> 24)   // valid bits of ebx
+#define CPUID_PMU_FIXED(edx)    ((edx) & 0x1F)
+#define CPUID_PMU_FIXED_WIDTH(edx) (((edx) >> 5) & 0xFF)
+// ebx, set if an architectural event is missing
+#define CPUID_PMU_NO_CYCLES     (1 << 0)
+#define CPUID_PMU_NO_INSTRUCTIONS (1 << 1)
+#define CPUID_PMU_NO_LLC_MISSES (1 << 4)
+#define CPUID_PMU_NO_BRANCH_MISSES (1 << 6)
+
+// performance event select
+#define PERFEVTSEL_CYCLES   0x0003C     // unhalted core cycles
+#define PERFEVTSEL_INSTRUCTIONS 0x000C0 // instructions retired
+#define PERFEVTSEL_LLC_MISSES 0x0412E   // last level cache misses
+#define PERFEVTSEL_BRANCH_MISSES 0x000C5 // mispredicted branches retired
+#define PERFEVTSEL_DTLB_MISSES 0x00108  // model specific, Intel family 6
+#define PERFEVTSEL_USR      (1 << 16)
+#define PERFEVTSEL_OS       (1 << 17)
+#define PERFEVTSEL_INT      (1 << 20)   // interrupt on overflow
+#define PERFEVTSEL_EN       (1 << 22)
+
+// fixed counters, instructions retired and unhalted core cycles
+#define FIXED_CTR_INSTRUCTIONS  0
+#define FIXED_CTR_CYCLES        1
+#define FIXED_CTR_OS(n)         (1 << ((n) * 4))
+#define FIXED_CTR_USR(n)        (2 << ((n) * 4))
+#define FIXED_CTR_GLOBAL(n)     (1ULL << (32 + (n)))    // in PERF_GLOBAL_CTRL
+
+#define RDPMC_FIXED         (1 << 30)   // rdpmc reads a fixed counter
+
+// Data private to every cpu, reachable through the %gs segment.
+typedef struct percpu
+{
+    struct percpu *self;
+    unsigned id;        // index of the cpu, 0 is the bootstrap processor
+    uint32_t apic_id;
+    uintptr_t stack;    // base of the stack the cpu was started on
+    uint32_t preempt_count; // preemption is disabled while not 0
+} percpu_t;
+
+// Returns the per-cpu data of the executing cpu.
+static inline percpu_t* this_cpu()
+{
+    percpu_t *self;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r" (self) : "i" (offsetof(percpu_t, self)));
+    return self;
+}
+
+// Returns the index of the executing cpu.
+static inline unsigned cpu_id()
+{
+    unsigned id;
+    asm volatile("mov %%gs:%c1, %0"
+                 : "=r" (id) : "i" (offsetof(percpu_t, id)));
+    return id;
+}
+
+// Executes cpuid for a leaf.
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx,
+    uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid"
+                 : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                 : "a" (leaf), "c" (0));
+}
+
+// Reads a model specific register.
+static inline uint64_t rdmsr(uint32_t msr)
+{
+    uint64_t value;
+    asm volatile("rdmsr" : "=A" (value) : "c" (msr));
+    return value;
+}
+
+// Writes a model specific register.
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c" (msr), "A" (value));
+}
+
+// Reads the time stamp counter.
+static inline uint64_t rdtsc()
+{
+    uint64_t tsc;
+    asm volatile("rdtsc" : "=A" (tsc));
+    return tsc;
+}
+
+// Reads a performance counter, RDPMC_FIXED selects a fixed one.
+static inline uint64_t rdpmc(uint32_t counter)
+{
+    uint64_t value;
+    asm volatile("rdpmc" : "=A" (value) : "c" (counter));
+    return value;
+}
+
+// Divides without the libgcc helper, in two steps so that divl cannot
+// overflow.
+static inline uint64_t div64(uint64_t dividend, uint32_t divisor)
+{
+    uint32_t high = dividend >> 32;
+    uint32_t rem = high % divisor;
+    uint32_t low;
+
+    high /= divisor;
+    asm("divl %2" : "=a" (low), "+d" (rem) : "rm" (divisor), "0" ((uint32_t)dividend));
+
+    return ((uint64_t)high << 32) | low;
+}
+
+
+#endif // CPU_H
@@ -0,0 +1,24 @@
+#ifndef CPUSTAT_H
+#define CPUSTAT_H
+
+
+#include <stdint.h>
+
+#define CPU_TIME_IDLE       0   // idle thread
+#define CPU_TIME_IRQ        1   // hardware interrupts
+#define CPU_TIME_SOFTIRQ    2   // exceptions and software interrupts (int n)
+#define CPU_TIME_THREAD     3   // every other thread
+#define CPU_TIME_MAX        4
+
+// Time a cpu spent in each context, in time stamp counter cycles.
+typedef struct cpustat
+{
+    uint64_t time[CPU_TIME_MAX];
+} cpustat_t;
+
+void cpustat_enter();
+void cpustat_leave(unsigned context);
+void cpustat_get(unsigned cpu, cpustat_t *stat);
+
+
+#endif // CPUSTAT_H
@@ -0,0 +1,70 @@
+#ifndef ELF_H
+#define ELF_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+#include "thread.h"
+#include "vfs.h"
+
+#define ELF_MAGIC       0x464C457F  // "\x7FELF"
+#define ELF_CLASS32     1
+#define ELF_DATA2LSB    1
+#define ELF_ET_EXEC     2
+#define ELF_EM_386      3
+
+#define ELF_PT_LOAD     1
+
+#define ELF_PF_X        0x1
+#define ELF_PF_W        0x2
+#define ELF_PF_R        0x4
+
+// Top of the user stack, which grows down from the end of user space.
+#define USER_STACK_TOP  USER_END
+#define USER_STACK_SIZE 0x00100000
+
+#define ELF_EINVAL      -1
+#define ELF_ENOMEM      -2
+
+typedef struct elf_header
+{
+    uint32_t magic;
+    uint8_t class;
+    uint8_t data;
+    uint8_t version;
+    uint8_t pad[9];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t elf_version;
+    uint32_t entry;
+    uint32_t phoff;         // offset of the program headers
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed)) elf_header_t;
+
+typedef struct elf_program_header
+{
+    uint32_t type;
+    uint32_t offset;        // offset of the segment in the file
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;        // bytes in the file, the rest up to memsz is zero
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed)) elf_program_header_t;
+
+int elf_load(vmm_context_t *context, uintptr_t image, size_t size, uintptr_t *entry);
+int elf_load_file(vmm_context_t *context, vfs_file_t *file, uintptr_t *entry);
+thread_t* elf_exec(uintptr_t image, size_t size);
+thread_t* elf_exec_file(vfs_file_t *file);
+
+
+#endif // ELF_H
@@ -0,0 +1,35 @@
+#ifndef FB_H
+#define FB_H
+
+
+#include <stdint.h>
+#include "multiboot.h"
+
+/*
+Linear framebuffer
+
+The boot loader sets a graphics mode if the multiboot header asks for one
+(build with make FRAMEBUFFER=1, GRUB legacy refuses such a kernel) and
+reports it in the multiboot info. Only direct color modes with 32 bits per
+pixel are used, the framebuffer is mapped write combining at its physical
+address.
+
+Text is drawn in cells of FONT_WIDTH x FONT_HEIGHT pixels. Every glyph is
+expanded into 32 bit pixels for the colors it was last drawn with, so a
+cell is copied row by row with whole pixel stores and the framebuffer is
+never read.
+*/
+
+#define FB_DEPTH    32
+
+// Errors returned by fb_init().
+#define FB_ENODEV   -1  // no usable framebuffer
+#define FB_ENOMEM   -2
+
+int fb_init(multiboot_info_t *mb_info);
+unsigned fb_columns();
+unsigned fb_rows();
+void fb_draw(unsigned x, unsigned y, char c, uint8_t color_text, uint8_t color_back);
+
+
+#endif // FB_H
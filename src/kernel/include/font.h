@@ -0,0 +1,18 @@
+#ifndef FONT_H
+#define FONT_H
+
+
+#include <stdint.h>
+
+// 8x8 font of the printable ASCII characters, one byte per row, bit 0 is
+// the leftmost pixel.
+#define FONT_WIDTH  8
+#define FONT_HEIGHT 8
+#define FONT_FIRST  0x20
+#define FONT_LAST   0x7E
+#define FONT_GLYPHS (FONT_LAST - FONT_FIRST + 1)
+
+extern const uint8_t font_8x8[FONT_GLYPHS][FONT_HEIGHT];
+
+
+#endif // FONT_H
@@ -0,0 +1,37 @@
+#ifndef FPU_H
+#define FPU_H
+
+
+#include <stdint.h>
+#include "thread.h"
+
+/*
+Lazy x87/SSE state
+
+Every cpu runs with CR0.TS set, so the first x87, MMX or SSE instruction
+of a thread raises the device not available exception (#NM). The handler
+clears TS, gives the thread a save area on its first use and loads its
+state. The thread keeps the fpu until it is switched out, only then its
+state is saved and TS set again:
+
+    thread A    int  int  fpu (#NM: restore A) fpu fpu | switch: save A, TS
+    thread B    int  int  int                          | nothing to save
+
+Threads that never touch the fpu cost no save and no restore, and a thread
+never leaves its state in the registers of a cpu it may not run on next.
+fxsave is used if the cpu supports it, fnsave otherwise.
+*/
+
+// Memory image of fxsave and fxrstor, which need it 16 byte aligned.
+typedef struct fpu_state
+{
+    uint8_t data[512];
+} __attribute__((aligned(16))) fpu_state_t;
+
+void fpu_switch(thread_t *prev);
+void fpu_release(thread_t *thread);
+void fpu_init_cpu();
+void fpu_init();
+
+
+#endif // FPU_H
@@ -2,6 +2,22 @@
 #define GDT_H
 
 
+#include <stdint.h>
+
+// segment selectors
+#define GDT_KERNEL_CODE 0x08
+#define GDT_KERNEL_DATA 0x10
+#define GDT_USER_CODE   0x18
+#define GDT_USER_DATA   0x20
+#define GDT_TSS_SEL     0x28
+#define GDT_PERCPU      0x30
+
+// requested privilege level of user selectors
+#define GDT_RPL_USER    0x03
+
+void gdt_set_kernel_stack(uint32_t esp0);
+void* gdt_get_entry_stack(unsigned cpu);
+void gdt_init_cpu(unsigned cpu);
 void gdt_init();
 
 
@@ -3,6 +3,7 @@
 
 
 void idt_init();
+void idt_init_cpu();
 
 
 #endif // IDT_H
@@ -0,0 +1,40 @@
+#ifndef INITRD_H
+#define INITRD_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Initial ramdisk image, written by src/tools/mkinitrd.c
+
+    +----------------+-----------------+-------+--------+-----+--------+
+    | initrd_header  | initrd_entry[n] | names | data 0 | ... | data n |
+    +----------------+-----------------+-------+--------+-----+--------+
+
+Names are null terminated paths relative to the root without a leading
+slash. The data of every file starts on a page boundary of the image, so
+files can be mapped straight from the frames of the module.
+*/
+
+#define INITRD_MAGIC    0x44524254  // "TBRD"
+#define INITRD_ALIGN    0x1000
+
+typedef struct initrd_header
+{
+    uint32_t magic;
+    uint32_t count;     // number of entries
+    uint32_t size;      // size of the whole image
+} initrd_header_t;
+
+typedef struct initrd_entry
+{
+    uint32_t name;      // offset of the path
+    uint32_t offset;    // offset of the data
+    uint32_t size;      // size of the data
+} initrd_entry_t;
+
+int initrd_init(uintptr_t start, size_t size);
+
+
+#endif // INITRD_H
@@ -20,6 +20,7 @@
 #define INT_GENERAL_PROTECTION      13
 #define INT_PAGE_FAULT              14
 #define INT_COPROCESSOR_ERROR       16
+#define INT_SIMD_EXCEPTION          19
 
 #define IRQ0 32
 #define IRQ1 33
@@ -38,9 +39,15 @@
 #define IRQ14 46
 #define IRQ15 47
 
+#define INT_SYSCALL         48
+#define INT_YIELD           49
+#define INT_LAPIC_TIMER     50
+#define INT_LAPIC_SPURIOUS  63
+
 typedef struct cpu_state
 {
     uint32_t ds;        // data segment selector
+    uint32_t gs;        // per-cpu segment selector
     uint32_t edi;       // pushed by pusha
     uint32_t esi;
     uint32_t ebp;
@@ -60,10 +67,32 @@ typedef struct cpu_state
     uint32_t ss;
 } cpu_state_t;
 
-typedef void (*interrupt_t)(cpu_state_t);
+// An interrupt handler returns the cpu state to resume, which allows it to
+// switch to another thread by returning a different frame.
+typedef cpu_state_t* (*interrupt_t)(cpu_state_t *cpu);
+
+// Disables interrupts and returns the previous eflags.
+static inline uint32_t irq_save()
+{
+    uint32_t eflags;
+    asm volatile("pushf\n\t"
+                 "pop %0\n\t"
+                 "cli" : "=r" (eflags) : : "memory");
+    return eflags;
+}
+
+// Enables interrupts again if they were enabled in the saved eflags.
+static inline void irq_restore(uint32_t eflags)
+{
+    if (eflags & 0x200)
+    {
+        asm volatile("sti" : : : "memory");
+    }
+}
 
 void init_interrupt_handler();
 void register_interrupt_handler(uint8_t int_no, interrupt_t handler);
+void unregister_interrupt_handler(uint8_t int_no);
 
 
 #endif // INTERRUPT_H
@@ -17,5 +17,8 @@ extern const void kernel_offset;
 
 extern const void kernel_size;
 
+// Defined in loader.S.
+extern const void boot_stack;
+
 
 #endif // KERNEL_H
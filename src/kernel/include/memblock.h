@@ -0,0 +1,47 @@
+#ifndef MEMBLOCK_H
+#define MEMBLOCK_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "multiboot.h"
+
+/*
+Early boot memory
+
+memblock_init() collects the usable memory of the BIOS memory map and
+reserves everything that is already in use before the kernel runs: the
+first frame with the real mode interrupt table, the kernel, the multiboot
+information, the memory map, the modules and every command line, and the
+start up code of the application processors.
+
+Boot data structures are placed with memblock_alloc() before the physical
+memory manager exists, which then starts with the free memory, usable and
+not reserved, in one pass. Both lists are sorted and overlapping or
+adjacent blocks are merged:
+
+    memory      |==============|      |=====================|
+    reserved    |===|    |===|             |=====|
+    free            |====|   |==|      |===|     |===========|
+*/
+
+#define MEMBLOCK_REGIONS    64
+
+// memblock_alloc() looks above 1MB first, below the end of the memory that
+// is mapped during the whole boot.
+#define MEMBLOCK_LOW        0x00100000
+#define MEMBLOCK_HIGH       0x00400000
+
+// Called for every free block by memblock_for_each_free().
+typedef void (*memblock_free_t)(uint64_t base, uint64_t end);
+
+void memblock_add(uint64_t base, uint64_t size);
+void memblock_reserve(uint64_t base, uint64_t size);
+void* memblock_alloc(size_t size, size_t align);
+uint64_t memblock_alloc_phys(size_t size, size_t align, uint64_t max);
+uint64_t memblock_end();
+void memblock_for_each_free(uint64_t start, uint64_t end, memblock_free_t function);
+void memblock_init(multiboot_info_t *mb_info);
+
+
+#endif // MEMBLOCK_H
@@ -50,6 +50,11 @@
 #define MULTIBOOT_INFO_BOOT_LOADER_NAME     0x00000200
 #define MULTIBOOT_INFO_APM_TABLE            0x00000400
 #define MULTIBOOT_INFO_VIDEO_INFO           0x00000800
+#define MULTIBOOT_INFO_FRAMEBUFFER_INFO     0x00001000
+
+#define MULTIBOOT_FRAMEBUFFER_TYPE_INDEXED  0
+#define MULTIBOOT_FRAMEBUFFER_TYPE_RGB      1
+#define MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT 2
 
 struct multiboot_header
 {
@@ -123,6 +128,30 @@ typedef struct multiboot_info
   uint16_t vbe_interface_seg;
   uint16_t vbe_interface_off;
   uint16_t vbe_interface_len;
+
+  uint64_t framebuffer_addr;
+  uint32_t framebuffer_pitch;
+  uint32_t framebuffer_width;
+  uint32_t framebuffer_height;
+  uint8_t framebuffer_bpp;
+  uint8_t framebuffer_type;
+  union __attribute__((packed))
+  {
+    struct __attribute__((packed))
+    {
+      uint32_t framebuffer_palette_addr;
+      uint16_t framebuffer_palette_num_colors;
+    };
+    struct
+    {
+      uint8_t framebuffer_red_field_position;
+      uint8_t framebuffer_red_mask_size;
+      uint8_t framebuffer_green_field_position;
+      uint8_t framebuffer_green_mask_size;
+      uint8_t framebuffer_blue_field_position;
+      uint8_t framebuffer_blue_mask_size;
+    };
+  };
 } multiboot_info_t;
 
 struct multiboot_mmap_entry
@@ -0,0 +1,36 @@
+#ifndef PAGECACHE_H
+#define PAGECACHE_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CACHE_BORROWED      0x01    // frame is part of the file, never freed
+#define CACHE_REFERENCED    0x02    // used since the last reclaim scan
+#define CACHE_ACTIVE        0x04    // on the active list
+
+#define CACHE_RA_MIN    4           // pages of the first readahead
+#define CACHE_RA_MAX    32          // largest readahead window in pages
+
+struct vfs_file;
+
+// A page of a file in memory, found by the radix tree of its file.
+typedef struct cache_page
+{
+    struct vfs_file *file;
+    uint32_t index;         // offset in the file in pages
+    uintptr_t frame;        // kernel address of the data
+    uint32_t flags;
+    uint32_t pins;          // users that rely on the page to stay
+    struct cache_page *prev;
+    struct cache_page *next;
+} cache_page_t;
+
+cache_page_t* pagecache_get(struct vfs_file *file, uint32_t index);
+void pagecache_put(cache_page_t *page);
+void pagecache_release(struct vfs_file *file, uint32_t index);
+size_t pagecache_reclaim(size_t frames);
+void pagecache_init();
+
+
+#endif // PAGECACHE_H
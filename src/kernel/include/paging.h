@@ -3,14 +3,75 @@
 
 
 #include <stdint.h>
+#include "kernel.h"
 #include "multiboot.h"
+#include "pmm.h"
 
 #define VMM_NO_MEM ((void *)0x13579B01)
 
+// Part of the address space that belongs to user space, the first 4 MiB stay
+// identity mapped for the kernel.
+#define USER_START  0x00400000
+#define USER_END    0xC0000000
+
+// Physical memory is mapped at kernel_offset up to this size, see
+// paging_init(). Devices are mapped after it, see paging_map_mmio().
+#define DIRECT_MAP_SIZE 0x38000000  // 896MB
+
+// Flags of vmm_map().
+#define VMM_WRITE       0x002
+#define VMM_USER        0x004
+#define VMM_BORROWED    0x400   // frame is not owned and never freed
+#define VMM_EXEC        0x800   // pages hold code, the others are no execute
+
+// Modes of vmm_transfer().
+#define VMM_MOVE    0   // unmap the pages from the source
+#define VMM_SHARE   1   // map the same frames in both contexts
+#define VMM_COW     2   // share the frames until one side writes
+
+// Errors returned by the vmm functions.
+#define VMM_EFAULT  -1  // source page is not mapped
+#define VMM_ENOMEM  -2
+#define VMM_EEXIST  -3  // destination page is already mapped
+#define VMM_EINVAL  -4
+
+typedef struct vmm_context vmm_context_t;
+
+struct vfs_file;
+
+// Returns the address of physical memory in the direct map, it must lie
+// below the end of the map.
+static inline void* phys_to_virt(phys_addr_t addr)
+{
+    return (void *)((uintptr_t)addr + (uintptr_t)&kernel_offset);
+}
+
+// Physical address of kernel memory, either in the direct map or identity
+// mapped below USER_START.
+static inline uintptr_t virt_to_phys(const void *addr)
+{
+    if ((uintptr_t)addr >= (uintptr_t)&kernel_offset)
+    {
+        return (uintptr_t)addr - (uintptr_t)&kernel_offset;
+    }
+
+    return (uintptr_t)addr;
+}
+
 void* alloc_page(size_t pages);
 void free_page(void *start, size_t pages);
+vmm_context_t* vmm_create_context();
+void vmm_destroy_context(vmm_context_t *context);
+void vmm_activate(vmm_context_t *context);
+int vmm_map(vmm_context_t *context, uintptr_t v_addr, phys_addr_t p_addr, uint32_t flags);
+int vmm_add_region(vmm_context_t *context, uintptr_t start, size_t size, uint32_t flags, uintptr_t source, size_t source_size);
+int vmm_add_file_region(vmm_context_t *context, uintptr_t start, size_t size, uint32_t flags, struct vfs_file *file, size_t offset, size_t file_size);
+int vmm_transfer(vmm_context_t *src, uintptr_t src_addr, vmm_context_t *dst, uintptr_t dst_addr, size_t pages, int mode);
 void paging_register_interrupt();
-void paging_init(multiboot_info_t *mb_info);
+void* paging_map_mmio(uintptr_t p_addr, size_t size);
+void* paging_map_wc(uintptr_t p_addr, size_t size);
+void paging_init_cpu();
+void paging_init();
 
 
 #endif // PAGING_H
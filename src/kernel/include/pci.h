@@ -0,0 +1,73 @@
+#ifndef PCI_H
+#define PCI_H
+
+
+#include <stdint.h>
+
+/*
+PCI configuration mechanism #1
+
+A function is selected by writing its address to PCI_CONFIG_ADDRESS, the
+addressed dword of its configuration space is then read or written through
+PCI_CONFIG_DATA.
+
+ 31      30..24     23..16   15..11   10..8      7..2       1..0
++--------+----------+--------+--------+----------+----------+------+
+| enable | reserved | bus    | slot   | function | register | 0    |
++--------+----------+--------+--------+----------+----------+------+
+
+pci_init() walks every bus and slot once and keeps the functions it finds,
+drivers look them up by class or vendor and device id afterwards.
+*/
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+// configuration space registers
+#define PCI_VENDOR_ID       0x00    // device id, vendor id
+#define PCI_COMMAND         0x04
+#define PCI_CLASS           0x08    // revision, prog if, subclass, class
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10
+#define PCI_SUBSYSTEM       0x2C    // subsystem id, subsystem vendor id
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO      0x0001
+#define PCI_COMMAND_MEMORY  0x0002
+#define PCI_COMMAND_MASTER  0x0004
+
+#define PCI_HEADER_MULTI    0x80    // further functions in the slot
+#define PCI_BAR_IO          0x00000001
+#define PCI_BAR_IO_MASK     0xFFFFFFFC
+#define PCI_BAR_MEMORY_MASK 0xFFFFFFF0
+#define PCI_IRQ_NONE        0xFF
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+
+#define PCI_MAX_DEVICES     32
+
+typedef struct pci_device
+{
+    uint8_t bus;
+    uint8_t slot;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+    uint16_t subsystem;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq;            // PIC line, PCI_IRQ_NONE if not routed
+    uint32_t bar[6];
+} pci_device_t;
+
+uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset);
+void pci_config_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value);
+void pci_enable(pci_device_t *device, uint16_t command);
+pci_device_t* pci_find_class(uint8_t class, uint8_t subclass);
+pci_device_t* pci_find_device(uint16_t vendor, uint16_t device);
+void pci_init();
+
+
+#endif // PCI_H
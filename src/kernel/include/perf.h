@@ -0,0 +1,62 @@
+#ifndef PERF_H
+#define PERF_H
+
+
+#include <stdint.h>
+
+/*
+Hardware performance counters
+
+perf_init() looks for architectural performance monitoring (cpuid leaf
+0xA) and lets the counters of every cpu count these events in kernel and
+user mode:
+
+    event               counter
+    cycles              fixed counter 1, or a general one before version 2
+    instructions        fixed counter 0, or a general one before version 2
+    LLC misses          general, architectural event 2E/41
+    dTLB misses         general, event 08/01 of Intel family 6 only
+    branch misses       general, architectural event C5/00
+
+General counter 0 is left to the profiler, events that find no counter are
+not counted. The counters run freely: perf_begin() reads them with rdpmc
+and perf_end() adds the differences to the totals of a perf_t, so scopes
+can be nested and repeated. Without a PMU, e.g. QEMU without KVM, only the
+time stamp counter is read.
+
+    perf_t perf = PERF_INIT;
+
+    perf_begin(&perf);
+    memcpy(dest, src, size);
+    perf_end(&perf);
+    perf_print("memcpy", &perf, 1);
+*/
+
+#define PERF_TSC            0
+#define PERF_CYCLES         1
+#define PERF_INSTRUCTIONS   2
+#define PERF_LLC_MISSES     3
+#define PERF_DTLB_MISSES    4
+#define PERF_BRANCH_MISSES  5
+#define PERF_EVENTS         6
+
+typedef struct perf
+{
+    uint64_t start[PERF_EVENTS];
+    uint64_t total[PERF_EVENTS];
+} perf_t;
+
+#define PERF_INIT { { 0 }, { 0 } }
+
+uint32_t perf_events();
+void perf_begin(perf_t *perf);
+void perf_end(perf_t *perf);
+void perf_print(const char *name, const perf_t *perf, uint32_t runs);
+void perf_init_cpu();
+void perf_init();
+#ifdef PERF_BENCHMARK
+void perf_benchmark();
+#endif
+
+
+#endif // PERF_H
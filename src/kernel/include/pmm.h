@@ -3,16 +3,89 @@
 
 
 #include <stdint.h>
-#include "multiboot.h"
+#include <stddef.h>
+
+#define FRAME_SIZE 0x1000
 
 #define PMM_NO_MEM ((void *)0x13579B00)
+#define PMM_NO_FRAME ((phys_addr_t)-1)
+
+// Allocation flags of pmm_alloc(), they select the first zone to try.
+#define GFP_KERNEL      0x00    // normal, then DMA
+#define GFP_DMA         0x01    // DMA only, below 16MB
+#define GFP_HIGHMEM     0x02    // high, then normal, then DMA
+#define GFP_ATOMIC      0x04    // below the minimum of a zone, never reclaims
+
+// Frames asked from the reclaim function at least, see pmm_set_reclaim().
+#define RECLAIM_BATCH 32
+
+// Physical address, PAE paging reaches memory above 4GB.
+typedef uint64_t phys_addr_t;
+
+// Flags of a frame descriptor.
+#define PAGE_CACHE      0x0001  // frame of the page cache
+#define PAGE_MOVABLE    0x0002  // mapped once at owner and index, see pmm_set_migrate()
+
+// Descriptor of a frame, pmm_init() allocates one for every frame of the
+// bitmap. The pmm keeps the reference count and clears the descriptor when
+// the frame is freed, the owner of a frame uses the rest.
+typedef struct page
+{
+    uint32_t refs;          // mappings of the frame, 0 counts as 1
+    uint16_t flags;         // PAGE_*
+    uint8_t order;          // block of 2^order frames, for a buddy allocator
+    uint8_t isolated;       // taken by compaction, see pmm_free()
+    union
+    {
+        struct
+        {
+            struct page *prev;  // list links of the owner
+            struct page *next;
+        };
+        struct
+        {
+            void *owner;        // address space of a PAGE_MOVABLE frame
+            uint32_t index;     // and the address it is mapped at
+        };
+    };
+} page_t;
+
+extern page_t *frame_pages;
+
+// Returns the descriptor of a frame the pmm manages.
+static inline page_t* pmm_page(phys_addr_t addr)
+{
+    return &frame_pages[addr / FRAME_SIZE];
+}
+
+// Returns the address of the frame of a descriptor.
+static inline phys_addr_t pmm_page_addr(const page_t *page)
+{
+    return (phys_addr_t)(page - frame_pages) * FRAME_SIZE;
+}
+
+typedef size_t (*pmm_reclaim_t)(size_t frames);
+typedef int (*pmm_migrate_t)(page_t *page, phys_addr_t to);
 
+void pmm_free(phys_addr_t addr, size_t frames);
+phys_addr_t pmm_alloc(size_t frames, unsigned gfp);
 void free_frame(uintptr_t addr, size_t frames);
 void* alloc_frame(size_t frames);
+void free_high_frame(phys_addr_t addr);
+phys_addr_t alloc_high_frame();
+uint32_t pmm_frame_share(phys_addr_t addr);
+uint32_t pmm_frame_unshare(phys_addr_t addr);
+uint32_t pmm_frame_refs(phys_addr_t addr);
+void pmm_set_reclaim(pmm_reclaim_t function);
+void pmm_set_migrate(pmm_migrate_t function);
 uintptr_t pmm_get_bitmap();
 void pmm_set_bitmap(uintptr_t addr);
 size_t pmm_get_bitmap_size();
-void pmm_init(multiboot_info_t *mb_info);
+uintptr_t pmm_get_pages();
+size_t pmm_get_pages_size();
+void pmm_init_pages();
+void pmm_init_direct(uint64_t end);
+void pmm_init();
 
 
 #endif // PMM_H
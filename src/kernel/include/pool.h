@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "spinlock.h"
+
+// Allocator for objects of a fixed size, carved out of whole frames. Frames
+// are never given back, freed objects are kept for reuse.
+typedef struct pool
+{
+    const char *name;
+    size_t size;        // object size, at least a pointer
+    void *free;         // list of free objects
+    spinlock_t lock;
+} pool_t;
+
+#define POOL_INIT(pool_name, object_size) \
+    { .name = (pool_name), .size = (object_size), .free = NULL, \
+      .lock = SPINLOCK_INIT(pool_name) }
+
+void* pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
+
+
+#endif // POOL_H
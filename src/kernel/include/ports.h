@@ -3,6 +3,10 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
+
+// Word for outw_indexed(), index in the low and value in the high byte.
+#define PORT_INDEXED(index, value) ((uint16_t)(((index) & 0xFF) | (((value) & 0xFF) << 8)))
 
 // Sends a byte on a I/O location.
 static inline void outb(uint16_t port, uint8_t data)
@@ -46,6 +50,38 @@ static inline uint32_t inl(uint16_t port)
     return data;
 }
 
+// Receives count words from an I/O location into a buffer.
+static inline void insw(uint16_t port, void *buffer, size_t count)
+{
+    asm volatile("rep insw" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+// Sends count words from a buffer on an I/O location.
+static inline void outsw(uint16_t port, const void *buffer, size_t count)
+{
+    asm volatile("rep outsw" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+// Receives count dwords from an I/O location into a buffer.
+static inline void insl(uint16_t port, void *buffer, size_t count)
+{
+    asm volatile("rep insl" : "+D" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+// Sends count dwords from a buffer on an I/O location.
+static inline void outsl(uint16_t port, const void *buffer, size_t count)
+{
+    asm volatile("rep outsl" : "+S" (buffer), "+c" (count) : "d" (port) : "memory");
+}
+
+// Writes a batch of registers of a device whose data port follows its index
+// port, like the VGA CRTC. Every PORT_INDEXED() word sets index and data in
+// one bus cycle instead of two.
+static inline void outw_indexed(uint16_t port, const uint16_t *writes, size_t count)
+{
+    outsw(port, writes, count);
+}
+
 // Wait for a moment.
 static inline void io_wait()
 {
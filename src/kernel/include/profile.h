@@ -0,0 +1,60 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/*
+Sampling profiler
+
+Every sample records the interrupted eip and, for kernel code, the return
+addresses found by walking the saved frame pointers of its stack. Samples
+are taken on the timer tick of every cpu, or with PROFILE_PMC on the NMI
+of a performance counter that overflows every period unhalted cycles,
+which also samples code that runs with interrupts disabled.
+
+Each cpu appends its samples to its own buffer, so taking one needs no
+lock and is safe in an NMI. profile_dump() sends them over the serial port
+as text lines, src/tools/profile.py turns them into folded stacks for
+flame graphs with the symbols of kernel.bin:
+
+    profile begin <mode> <period>
+    <cpu> <k|u> <eip> <caller> <caller> ...
+    profile end <samples> <dropped>
+*/
+
+#define PROFILE_OFF     -1
+#define PROFILE_TIMER   0   // sample on every timer tick
+#define PROFILE_PMC     1   // sample on counter overflow
+
+#define PROFILE_DEPTH   16      // return addresses per sample
+#define PROFILE_BUFFER  0x10000 // bytes per cpu
+#define PROFILE_PERIOD  1000000 // default cycles between PMC samples
+
+#define PROFILE_USER    0x80000000  // sample of user mode, no stack
+
+// Errors returned by profile_start().
+#define PROFILE_ENODEV  -1  // no usable performance counter
+#define PROFILE_ENOMEM  -2
+#define PROFILE_EBUSY   -3
+
+extern volatile int profile_mode;
+
+void __profile_tick(cpu_state_t *cpu);
+
+// Called on every timer tick, costs one compare while not profiling.
+static inline void profile_tick(cpu_state_t *cpu)
+{
+    if (profile_mode != PROFILE_OFF)
+    {
+        __profile_tick(cpu);
+    }
+}
+
+int profile_start(int mode, uint32_t period);
+void profile_stop();
+void profile_dump();
+
+
+#endif // PROFILE_H
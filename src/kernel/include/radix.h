@@ -0,0 +1,38 @@
+#ifndef RADIX_H
+#define RADIX_H
+
+
+#include <stdint.h>
+
+/*
+Radix tree mapping 32 bit indices to pointers
+
+Every node resolves RADIX_SHIFT bits of the index, the tree is only as high
+as the largest index requires. Lookups take no lock, the owner of the tree
+serializes changes.
+*/
+
+#define RADIX_SHIFT 6
+#define RADIX_SLOTS (1 << RADIX_SHIFT)
+
+#define RADIX_ENOMEM    -1
+#define RADIX_EEXIST    -2
+
+typedef struct radix_node
+{
+    void *slots[RADIX_SLOTS];
+    unsigned count;     // used slots
+} radix_node_t;
+
+typedef struct radix_root
+{
+    unsigned height;    // levels of nodes, 0 for an empty tree
+    radix_node_t *node;
+} radix_root_t;
+
+void* radix_lookup(radix_root_t *root, uint32_t index);
+int radix_insert(radix_root_t *root, uint32_t index, void *item);
+void* radix_delete(radix_root_t *root, uint32_t index);
+
+
+#endif // RADIX_H
@@ -0,0 +1,43 @@
+#ifndef RCU_H
+#define RCU_H
+
+
+#include "atomic.h"
+#include "cpu.h"
+
+/*
+Quiescent state based read-copy-update
+
+Readers only disable preemption, so a cpu that leaves an interrupt with
+preemption enabled cannot hold any RCU protected pointer anymore. That is
+reported as a quiescent state, a grace period ends once every cpu passed
+one. Writers publish a new version with rcu_assign_pointer() and free the
+old one after synchronize_rcu().
+*/
+
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+#define rcu_assign_pointer(p, v) \
+    do \
+    { \
+        barrier(); \
+        *(__typeof__(p) volatile *)&(p) = (v); \
+    } while (0)
+
+static inline void rcu_read_lock()
+{
+    this_cpu()->preempt_count++;
+    barrier();
+}
+
+static inline void rcu_read_unlock()
+{
+    barrier();
+    this_cpu()->preempt_count--;
+}
+
+void rcu_quiescent();
+void synchronize_rcu();
+
+
+#endif // RCU_H
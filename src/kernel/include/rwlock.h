@@ -0,0 +1,105 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+
+#include <stdint.h>
+#include "atomic.h"
+#include "interrupt.h"
+
+/*
+Reader-writer spinlock
+
+The low bits count the readers, RW_WRITER is set by a writer as soon as it
+wants the lock. New readers wait while it is set, so writers cannot starve.
+*/
+
+#define RW_WRITER 0x80000000
+
+typedef struct rwlock
+{
+    volatile uint32_t count;
+} rwlock_t;
+
+#define RWLOCK_INIT { 0 }
+
+static inline void read_lock(rwlock_t *lock)
+{
+    uint32_t count;
+
+    while (1)
+    {
+        count = lock->count;
+
+        if ((count & RW_WRITER) == 0 &&
+            cmpxchg(&lock->count, count, count + 1) == count)
+        {
+            return;
+        }
+
+        cpu_relax();
+    }
+}
+
+static inline void read_unlock(rwlock_t *lock)
+{
+    atomic_dec(&lock->count);
+}
+
+static inline void write_lock(rwlock_t *lock)
+{
+    uint32_t count;
+
+    // Claim the lock against other writers, then let the readers drain.
+    while (1)
+    {
+        count = lock->count;
+
+        if ((count & RW_WRITER) == 0 &&
+            cmpxchg(&lock->count, count, count | RW_WRITER) == count)
+        {
+            break;
+        }
+
+        cpu_relax();
+    }
+
+    while (lock->count != RW_WRITER)
+    {
+        cpu_relax();
+    }
+}
+
+static inline void write_unlock(rwlock_t *lock)
+{
+    barrier();
+    lock->count = 0;
+}
+
+static inline uint32_t read_lock_irqsave(rwlock_t *lock)
+{
+    uint32_t eflags = irq_save();
+    read_lock(lock);
+    return eflags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t *lock, uint32_t eflags)
+{
+    read_unlock(lock);
+    irq_restore(eflags);
+}
+
+static inline uint32_t write_lock_irqsave(rwlock_t *lock)
+{
+    uint32_t eflags = irq_save();
+    write_lock(lock);
+    return eflags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t *lock, uint32_t eflags)
+{
+    write_unlock(lock);
+    irq_restore(eflags);
+}
+
+
+#endif // RWLOCK_H
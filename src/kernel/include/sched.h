@@ -0,0 +1,39 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+
+#include <stdint.h>
+#include "interrupt.h"
+#include "spinlock.h"
+#include "thread.h"
+
+#define SCHED_LEVELS        32  // priority levels, 0 is the highest
+#define SCHED_BOOST_TICKS   100 // ticks until every thread is boosted to level 0
+#define SCHED_BALANCE_TICKS 20  // ticks between load balancing runs
+
+typedef struct runqueue
+{
+    spinlock_t lock;                // protects the levels, other cpus enqueue
+    uint32_t bitmap;                // bit n is set if level n is not empty
+    thread_t *head[SCHED_LEVELS];
+    thread_t *tail[SCHED_LEVELS];
+    uint32_t nr_ready;
+    thread_t *current;
+    thread_t *prev;                 // thread switched away from
+    thread_t *idle;
+    uint32_t slice_left;            // ticks until current is preempted
+    uint32_t boost_left;            // ticks until the next priority boost
+    uint32_t balance_left;          // ticks until the next load balancing
+} runqueue_t;
+
+thread_t* sched_current();
+int sched_is_idle();
+void* sched_idle_loop(void *arg);
+void sched_enqueue(thread_t *thread);
+cpu_state_t* sched_schedule(cpu_state_t *cpu);
+void sched_finish_switch();
+cpu_state_t* sched_tick(cpu_state_t *cpu);
+void sched_init_cpu(unsigned cpu, thread_t *current, thread_t *idle);
+
+
+#endif // SCHED_H
@@ -0,0 +1,95 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+
+#include <stdint.h>
+#include "atomic.h"
+#include "spinlock.h"
+
+/*
+Sequence lock
+
+Writers make the sequence odd while they change the data, readers never
+block but retry if the sequence was odd or changed during their read:
+
+    do
+    {
+        seq = read_seqbegin(&lock);
+        value = data;
+    } while (read_seqretry(&lock, seq));
+
+A seqcount_t is enough if there is only a single writer, e.g. the owner of
+per-cpu data, a seqlock_t serializes several writers with a spinlock.
+*/
+
+typedef struct seqcount
+{
+    volatile uint32_t sequence;
+} seqcount_t;
+
+typedef struct seqlock
+{
+    seqcount_t seqcount;
+    spinlock_t lock;
+} seqlock_t;
+
+#define SEQCOUNT_INIT { 0 }
+#define SEQLOCK_INIT(lock_name) { SEQCOUNT_INIT, SPINLOCK_INIT(lock_name) }
+
+static inline uint32_t read_seqcount_begin(const seqcount_t *s)
+{
+    uint32_t sequence;
+
+    while ((sequence = s->sequence) & 1)
+    {
+        cpu_relax();
+    }
+
+    barrier();
+
+    return sequence;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, uint32_t sequence)
+{
+    barrier();
+
+    return s->sequence != sequence;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    s->sequence++;
+    barrier();
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    barrier();
+    s->sequence++;
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t *s)
+{
+    return read_seqcount_begin(&s->seqcount);
+}
+
+static inline int read_seqretry(const seqlock_t *s, uint32_t sequence)
+{
+    return read_seqcount_retry(&s->seqcount, sequence);
+}
+
+static inline void write_seqlock(seqlock_t *s)
+{
+    spin_lock(&s->lock);
+    write_seqcount_begin(&s->seqcount);
+}
+
+static inline void write_sequnlock(seqlock_t *s)
+{
+    write_seqcount_end(&s->seqcount);
+    spin_unlock(&s->lock);
+}
+
+
+#endif // SEQLOCK_H
@@ -0,0 +1,45 @@
+#ifndef SERIAL_H
+#define SERIAL_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+16550 UART on COM1, polled output only
+
+    0   data / divisor low (DLAB)   4   modem control
+    1   irq enable / divisor high   5   line status
+    2   fifo control                6   modem status
+    3   line control (DLAB, 8N1)    7   scratch
+
+Used to get bulk data like profiles and traces to the host, where QEMU
+writes it to a file with -serial file:<path>.
+*/
+
+#define SERIAL_COM1         0x3F8
+
+#define SERIAL_DATA         0
+#define SERIAL_IRQ_ENABLE   1
+#define SERIAL_FIFO         2
+#define SERIAL_LINE         3
+#define SERIAL_MODEM        4
+#define SERIAL_STATUS       5
+#define SERIAL_SCRATCH      7
+
+#define SERIAL_LINE_DLAB    0x80
+#define SERIAL_LINE_8N1     0x03
+#define SERIAL_FIFO_ENABLE  0xC7    // enable, clear, 14 byte threshold
+#define SERIAL_MODEM_READY  0x03    // DTR, RTS
+#define SERIAL_STATUS_EMPTY 0x20    // transmit holding register empty
+
+#define SERIAL_BAUD         115200
+
+void serial_putc(char c);
+void serial_write(const char *data, size_t size);
+void serial_puts(const char *s);
+void serial_put_hex(uint32_t value);
+void serial_init();
+
+
+#endif // SERIAL_H
@@ -0,0 +1,26 @@
+#ifndef SMP_H
+#define SMP_H
+
+
+#include <stdint.h>
+#include "cpu.h"
+
+// Physical address the application processors start at, below 1MB and
+// page aligned. Must match trampoline.S.
+#define SMP_TRAMPOLINE 0x70000
+
+// Filled in by the bootstrap processor before each startup IPI.
+typedef struct smp_trampoline_args
+{
+    uint32_t cr3;
+    uint32_t stack;
+    uint32_t entry;
+    uint32_t cpu;
+} smp_trampoline_args_t;
+
+percpu_t* smp_cpu(unsigned cpu);
+unsigned smp_cpu_count();
+void smp_init();
+
+
+#endif // SMP_H
@@ -0,0 +1,133 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+
+#include <stdint.h>
+#include "atomic.h"
+#include "interrupt.h"
+
+/*
+Ticket spinlock
+
+Every cpu draws a ticket by incrementing next and waits until owner reaches
+it, so the lock is handed out in FIFO order. Both halves fit into one dword
+to draw a ticket with a single xadd.
+
+Locks that are also taken by interrupt handlers, or that must not be held
+across a preemption, have to be taken with the _irqsave variants.
+*/
+
+typedef struct spinlock
+{
+    union
+    {
+        volatile uint32_t tickets;
+        struct
+        {
+            volatile uint16_t owner;    // ticket being served
+            volatile uint16_t next;     // next ticket to hand out
+        };
+    };
+
+    // contention statistics, only written by the lock holder
+    const char *name;
+    uint32_t acquired;
+    uint32_t contended;
+    uint32_t spins;
+    struct spinlock *stat_next;         // registered in lockstat_print()
+} spinlock_t;
+
+#define SPINLOCK_INIT(lock_name) { .tickets = 0, .name = (lock_name) }
+
+// Queue node of an MCS lock, every waiter spins on its own node.
+typedef struct mcs_node
+{
+    struct mcs_node *volatile next;
+    volatile uint32_t locked;
+} mcs_node_t;
+
+typedef struct mcs_lock
+{
+    mcs_node_t *volatile tail;
+
+    const char *name;
+    uint32_t acquired;
+    uint32_t contended;
+    struct mcs_lock *stat_next;
+} mcs_lock_t;
+
+#define MCS_LOCK_INIT(lock_name) { .tail = NULL, .name = (lock_name) }
+
+void __spin_lock_contended(spinlock_t *lock, uint16_t ticket);
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node);
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node);
+void lockstat_print();
+
+// Busy waits until a lock is taken.
+static inline void spin_lock(spinlock_t *lock)
+{
+    uint16_t ticket = xadd(&lock->tickets, 0x10000) >> 16;
+
+    if (lock->owner != ticket)
+    {
+        __spin_lock_contended(lock, ticket);
+    }
+
+    lock->acquired++;
+}
+
+// Tries to take a lock once, returns whether it was taken.
+static inline int spin_trylock(spinlock_t *lock)
+{
+    uint32_t tickets = lock->tickets;
+
+    if ((tickets & 0xFFFF) != (tickets >> 16))
+    {
+        return 0;
+    }
+
+    if (cmpxchg(&lock->tickets, tickets, tickets + 0x10000) != tickets)
+    {
+        return 0;
+    }
+
+    lock->acquired++;
+
+    return 1;
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    barrier();
+    lock->owner++;
+}
+
+// Disables interrupts and takes a lock, returns the previous eflags.
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint32_t eflags = irq_save();
+    spin_lock(lock);
+    return eflags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t eflags)
+{
+    spin_unlock(lock);
+    irq_restore(eflags);
+}
+
+static inline uint32_t mcs_lock_irqsave(mcs_lock_t *lock, mcs_node_t *node)
+{
+    uint32_t eflags = irq_save();
+    mcs_lock(lock, node);
+    return eflags;
+}
+
+static inline void mcs_unlock_irqrestore(mcs_lock_t *lock, mcs_node_t *node, uint32_t eflags)
+{
+    mcs_unlock(lock, node);
+    irq_restore(eflags);
+}
+
+
+#endif // SPINLOCK_H
@@ -0,0 +1,41 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+
+#include <stdint.h>
+
+/*
+System call ABI
+
+eax holds the number, ebx, esi, edi and ebp the arguments and eax the
+result. ecx and edx are clobbered. Calls are made with int 0x30, or with
+sysenter if the cpu supports it, in which case the caller passes its stack
+pointer in ecx and its return address in edx.
+
+SYS_WRITE           buffer, length
+SYS_VM_TRANSFER     tid, source, destination | VMM_MOVE/SHARE/COW, pages
+SYS_CPUSTAT         cpu, cpustat_t buffer, see cpustat.h
+*/
+
+#define SYSCALL_MAX     64
+#define SYSCALL_ENOSYS  ((uint32_t)-1)
+#define SYSCALL_EFAULT  ((uint32_t)-2)
+#define SYSCALL_EINVAL  ((uint32_t)-3)
+#define SYSCALL_ENOMEM  ((uint32_t)-4)
+
+#define SYS_EXIT        0
+#define SYS_YIELD       1
+#define SYS_GETTID      2
+#define SYS_WRITE       3
+#define SYS_VM_TRANSFER 4
+#define SYS_CPUSTAT     5
+
+typedef uint32_t (*syscall_t)(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4);
+
+int syscall_has_sysenter();
+void syscall_register(unsigned nr, syscall_t handler);
+void syscall_init_cpu();
+void syscall_init();
+
+
+#endif // SYSCALL_H
@@ -0,0 +1,60 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+
+#include <stdint.h>
+#include "interrupt.h"
+#include "paging.h"
+#include "spinlock.h"
+
+#define THREAD_STACK_FRAMES 4   // 16kB kernel stack per thread
+
+typedef void* (*thread_func_t)(void *arg);
+
+struct fpu_state;
+
+typedef enum thread_state
+{
+    THREAD_NEW,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_ZOMBIE,  // exited, but a cpu may still be on its stack
+    THREAD_DEAD,    // exited, can be freed by thread_join()
+} thread_state_t;
+
+typedef struct thread
+{
+    uint32_t tid;
+    thread_state_t state;
+    spinlock_t lock;        // protects state changes to dead and joiner
+    int on_cpu;             // a cpu runs on the stack of the thread
+    cpu_state_t *cpu_state; // saved cpu state while the thread is not running
+    unsigned cpu;           // run queue the thread belongs to
+    unsigned priority;      // scheduler level, 0 is the highest
+    uint64_t runtime;       // time stamp counter cycles spent running
+    uintptr_t stack;        // base of the kernel stack, 0 for the boot thread
+    vmm_context_t *context; // user address space, NULL for kernel threads
+    struct fpu_state *fpu;  // saved fpu state, NULL until the first use
+    int fpu_active;         // the fpu holds the state of the thread, see fpu.h
+    thread_func_t entry;
+    void *arg;
+    void *retval;
+    struct thread *joiner;  // thread waiting in thread_join()
+    struct thread *next;    // run queue link
+    struct thread *all_next; // link of the thread list, see thread_find()
+} thread_t;
+
+thread_t* thread_current();
+thread_t* thread_create(thread_func_t entry, void *arg);
+thread_t* thread_create_user(vmm_context_t *context, uintptr_t eip, uintptr_t esp);
+thread_t* thread_find(uint32_t tid);
+void thread_yield();
+void thread_mark_exited(void *retval);
+__attribute__((noreturn)) void thread_exit(void *retval);
+void* thread_join(thread_t *thread);
+void thread_init_cpu(unsigned cpu, uintptr_t stack);
+void thread_init();
+
+
+#endif // THREAD_H
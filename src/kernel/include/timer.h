@@ -4,6 +4,10 @@
 
 #include <stdint.h>
 
+#define TIMER_FREQUENCY 100 // Hz
+
+uint32_t timer_get_ticks();
+uint64_t timer_get_ticks64();
 void timer_init(uint32_t frequency);
 
 
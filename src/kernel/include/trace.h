@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+
+#include <stdint.h>
+
+/*
+Static tracepoints
+
+TRACE(event, a, b) places a 5 byte nop at an 8 byte aligned address and
+records the address, the event and the code that writes the record in the
+.tracepoints section. trace_start() replaces the nops of an event with a
+jump to that code and trace_stop() puts them back, each with one atomic
+qword store, so a disabled tracepoint costs a nop and nothing else.
+
+    disabled    0F 1F 44 00 00      nopl 0(%eax, %eax, 1)
+    enabled     E9 <rel32>          jmp record
+
+A record is 16 bytes: the low 48 bits of the time stamp counter and the
+event in one qword, followed by two arguments. Every cpu writes its own
+ring buffer, the oldest records are overwritten once it is full.
+trace_dump() sends the buffers over the serial port, src/tools/trace.py
+turns them into a Chrome trace (chrome://tracing, Perfetto):
+
+    trace begin <cpus> <cycles per tick> <tick frequency>\n
+    cpu <index> <records>\n   <records * 16 bytes>      for every cpu
+    trace end\n
+*/
+
+// events, a and b of the record
+#define TRACE_IRQ_ENTRY     0   // vector, eip
+#define TRACE_IRQ_EXIT      1   // vector
+#define TRACE_ALLOC_FRAME   2   // address, frames
+#define TRACE_FREE_FRAME    3   // address, frames
+#define TRACE_MAP_PAGE      4   // virtual, physical address
+#define TRACE_PAGE_FAULT    5   // address, error code
+#define TRACE_SWITCH        6   // tid of the previous, of the next thread
+#define TRACE_EVENTS        7
+
+#define TRACE_ALL           ((1 << TRACE_EVENTS) - 1)
+
+#define TRACE_BUFFER        0x10000 // bytes per cpu, a power of two
+
+// Errors returned by trace_start().
+#define TRACE_ENOMEM        -1
+
+typedef struct trace_record
+{
+    uint64_t stamp;         // tsc << 16 | event
+    uint32_t a;
+    uint32_t b;
+} trace_record_t;
+
+// Entry of the .tracepoints section.
+typedef struct tracepoint
+{
+    uintptr_t site;         // the nop
+    uintptr_t target;       // code that writes the record
+    uint32_t event;
+} tracepoint_t;
+
+void __trace_record(uint32_t event, uint32_t a, uint32_t b);
+
+#define TRACE(event, a, b) \
+    do \
+    { \
+        __label__ __trace_on, __trace_off; \
+        asm goto(".balign 8\n\t" \
+                 "1: .byte 0x0F, 0x1F, 0x44, 0x00, 0x00\n\t" \
+                 ".pushsection .tracepoints, \"a\"\n\t" \
+                 ".balign 4\n\t" \
+                 ".long 1b, %l[__trace_on], %c0\n\t" \
+                 ".popsection" \
+                 : : "i" (event) : : __trace_on); \
+        goto __trace_off; \
+    __trace_on: __attribute__((cold)); \
+        __trace_record((event), (uint32_t)(a), (uint32_t)(b)); \
+    __trace_off: ; \
+    } while (0)
+
+int trace_start(uint32_t events);
+void trace_stop();
+void trace_dump();
+
+
+#endif // TRACE_H
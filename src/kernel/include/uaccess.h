@@ -0,0 +1,38 @@
+#ifndef UACCESS_H
+#define UACCESS_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+
+/*
+Exception table
+
+Every instruction that may fault on a user address has an entry with the
+address to continue at instead. The page fault handler looks up the
+faulting eip, so a bad pointer from user space ends the copy early instead
+of panicking the kernel.
+*/
+
+typedef struct exception_entry
+{
+    uintptr_t insn;
+    uintptr_t fixup;
+} exception_entry_t;
+
+// Whether a buffer lies entirely within user space.
+static inline int access_ok(const void *addr, size_t size)
+{
+    uintptr_t start = (uintptr_t)addr;
+
+    return start >= USER_START && start < USER_END &&
+        size <= USER_END - start;
+}
+
+uintptr_t search_exception_table(uintptr_t eip);
+size_t copy_from_user(void *dst, const void *src, size_t size);
+size_t copy_to_user(void *dst, const void *src, size_t size);
+
+
+#endif // UACCESS_H
@@ -0,0 +1,44 @@
+#ifndef VFS_H
+#define VFS_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+#include "radix.h"
+
+#define VFS_HASH_BUCKETS 1024
+
+#define VFS_EINVAL  -1
+#define VFS_ENOMEM  -2
+
+struct vfs_file;
+
+// Fills a frame with a page of a file, zero beyond its end. Returns 0 on
+// success.
+typedef int (*vfs_read_page_t)(struct vfs_file *file, uint32_t index, void *frame);
+
+// A read-only file. Its pages are read through the page cache unless the
+// whole file is in memory anyway.
+typedef struct vfs_file
+{
+    const char *path;       // without the leading slash
+    uint32_t hash;
+    size_t size;
+    const uint8_t *data;    // contents if always in memory, in the direct map
+    vfs_read_page_t read_page;  // used if data is NULL
+    void *private;          // for read_page()
+    radix_root_t pages;     // cached pages by index
+    uint32_t ra_next;       // page that continues a sequential read
+    uint32_t ra_size;       // pages of the last readahead
+    struct vfs_file *hash_next;
+} vfs_file_t;
+
+void vfs_register(vfs_file_t *files, size_t count);
+vfs_file_t* vfs_open(const char *path);
+size_t vfs_read(vfs_file_t *file, size_t offset, size_t size, const void **data);
+void vfs_release(vfs_file_t *file, size_t offset);
+int vfs_mmap(vfs_file_t *file, vmm_context_t *context, uintptr_t v_addr, size_t offset, size_t size, uint32_t flags);
+
+
+#endif // VFS_H
@@ -0,0 +1,159 @@
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+Legacy virtio over PCI
+
+The device is driven through the I/O ports of BAR0, the device specific
+configuration follows the common registers as long as MSI-X is disabled.
+
+ offset  size
++------+------+-----------------------------------------------+
+| 0x00 | 4    | device features                               |
+| 0x04 | 4    | driver features                               |
+| 0x08 | 4    | page frame number of the selected queue       |
+| 0x0C | 2    | size of the selected queue                    |
+| 0x0E | 2    | queue select                                  |
+| 0x10 | 2    | queue notify                                  |
+| 0x12 | 1    | device status                                 |
+| 0x13 | 1    | interrupt status, cleared by reading          |
+| 0x14 | ...  | device configuration                          |
++------+------+-----------------------------------------------+
+
+Split virtqueue
+
+The driver and the device share three rings in physically contiguous memory,
+the used ring starts at the next page boundary:
+
++------------------+-------------------------------+-----+------------------------+
+| descriptor table | available ring                | pad | used ring              |
+| size * 16 bytes  | flags, idx, size * 2, event   |     | flags, idx, size * 8,  |
+|                  |                               |     | event                  |
++------------------+-------------------------------+-----+------------------------+
+
+The driver chains descriptors of a request, puts the head into the available
+ring and publishes it by advancing avail->idx. The device puts the head into
+the used ring once it is done. Neither side takes a lock, the indices are
+only written by their owner and ordered with barriers.
+
+With VIRTIO_F_EVENT_IDX both sides tell the other at which index they want
+to be woken up: the device reads used_event before it interrupts, the driver
+reads avail_event before it notifies. The driver publishes a batch of
+requests at once and notifies once for it, and asks for an interrupt only
+after part of the outstanding requests is done to complete several of them
+per interrupt.
+*/
+
+// registers
+#define VIRTIO_REG_DEVICE_FEATURES  0x00
+#define VIRTIO_REG_DRIVER_FEATURES  0x04
+#define VIRTIO_REG_QUEUE_PFN        0x08
+#define VIRTIO_REG_QUEUE_SIZE       0x0C
+#define VIRTIO_REG_QUEUE_SELECT     0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY     0x10
+#define VIRTIO_REG_STATUS           0x12
+#define VIRTIO_REG_ISR              0x13
+#define VIRTIO_REG_CONFIG           0x14
+
+// device status
+#define VIRTIO_STATUS_ACKNOWLEDGE   0x01
+#define VIRTIO_STATUS_DRIVER        0x02
+#define VIRTIO_STATUS_DRIVER_OK     0x04
+#define VIRTIO_STATUS_FAILED        0x80
+
+#define VIRTIO_ISR_QUEUE            0x01
+
+// features of every device type
+#define VIRTIO_F_EVENT_IDX          (1 << 29)
+
+#define VIRTIO_VENDOR               0x1AF4
+#define VIRTIO_QUEUE_ALIGN          0x1000
+
+// descriptor flags
+#define VIRTQ_DESC_F_NEXT           0x0001
+#define VIRTQ_DESC_F_WRITE          0x0002  // written by the device
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  0x0001
+#define VIRTQ_USED_F_NO_NOTIFY      0x0001
+
+#define VIRTQ_END                   0xFFFF
+
+// Errors returned by the virtio functions.
+#define VIRTIO_ENOSPC   -1  // not enough free descriptors
+#define VIRTIO_ENOMEM   -2
+#define VIRTIO_EINVAL   -3
+
+typedef struct virtq_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct virtq_avail
+{
+    uint16_t flags;
+    volatile uint16_t idx;
+    uint16_t ring[];        // followed by used_event
+} virtq_avail_t;
+
+typedef struct virtq_used_elem
+{
+    uint32_t id;            // head of the descriptor chain
+    uint32_t len;           // bytes written by the device
+} virtq_used_elem_t;
+
+typedef struct virtq_used
+{
+    uint16_t flags;
+    volatile uint16_t idx;
+    virtq_used_elem_t ring[];   // followed by avail_event
+} virtq_used_t;
+
+// Buffer of a request, physical address and size.
+typedef struct virtq_buffer
+{
+    uintptr_t addr;
+    uint32_t len;
+} virtq_buffer_t;
+
+// Driver side of a virtqueue, the owner serializes the calls.
+typedef struct virtqueue
+{
+    uint16_t iobase;
+    uint16_t index;
+    uint16_t size;
+    int event_idx;          // VIRTIO_F_EVENT_IDX was negotiated
+
+    virtq_desc_t *desc;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    volatile uint16_t *used_event;
+    volatile uint16_t *avail_event;
+    size_t frames;
+
+    uint16_t free_head;     // free descriptors, linked by next
+    uint16_t free_count;
+    uint16_t avail_idx;     // next entry of the available ring
+    uint16_t kicked_idx;    // avail->idx at the last notification
+    uint16_t last_used;     // next entry of the used ring to take
+    uint16_t in_flight;     // chains the device owns
+    void **cookies;         // per head descriptor
+} virtqueue_t;
+
+uint32_t virtio_negotiate(uint16_t iobase, uint32_t supported);
+void virtio_ready(uint16_t iobase);
+void virtio_fail(uint16_t iobase);
+int virtq_init(virtqueue_t *vq, uint16_t iobase, uint16_t index, int event_idx);
+int virtq_add(virtqueue_t *vq, const virtq_buffer_t *buffers, unsigned out, unsigned in, void *cookie);
+void virtq_kick(virtqueue_t *vq);
+void* virtq_get_used(virtqueue_t *vq, uint32_t *len);
+int virtq_arm(virtqueue_t *vq);
+
+
+#endif // VIRTIO_H
@@ -0,0 +1,42 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+
+#include <stdint.h>
+
+/*
+A virtio block request is one descriptor chain
+
+    header      type, reserved, sector      read by the device
+    data        one buffer per bio          read or written by the device
+    status      one byte                    written by the device
+
+Its device configuration starts with the capacity in sectors (8 bytes),
+followed by the largest segment size (4 bytes) and the most segments per
+request (4 bytes) if the matching features are offered.
+*/
+
+#define VIRTIO_BLK_DEVICE       0x1001  // transitional, legacy interface
+
+// features
+#define VIRTIO_BLK_F_SIZE_MAX   (1 << 1)
+#define VIRTIO_BLK_F_SEG_MAX    (1 << 2)
+
+// device configuration
+#define VIRTIO_BLK_CAPACITY     0x00
+#define VIRTIO_BLK_SIZE_MAX     0x08
+#define VIRTIO_BLK_SEG_MAX      0x0C
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+
+#define VIRTIO_BLK_S_OK         0
+
+#define VIRTIO_BLK_MAX_SECTORS  256     // per request, 128 KiB
+#define VIRTIO_BLK_MAX_SEGMENTS 32      // bios per request
+#define VIRTIO_BLK_MAX_DEPTH    32      // requests in flight
+
+void virtio_blk_init();
+
+
+#endif // VIRTIO_BLK_H
@@ -0,0 +1,140 @@
+#include "apic.h"
+#include <stdint.h>
+#include "cpu.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "profile.h"
+#include "ports.h"
+#include "sched.h"
+#include "timer.h"
+
+// local APIC registers, offsets from the base
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0B0
+#define LAPIC_SVR           0x0F0
+#define LAPIC_ICR_LOW       0x300
+#define LAPIC_ICR_HIGH      0x310
+#define LAPIC_LVT_TIMER     0x320
+#define LAPIC_LVT_PERF      0x340
+#define LAPIC_TIMER_INIT    0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE    0x100
+#define LAPIC_ICR_PENDING   0x1000
+#define LAPIC_LVT_NMI       0x00400
+#define LAPIC_LVT_MASKED    0x10000
+#define LAPIC_LVT_PERIODIC  0x20000
+#define LAPIC_DIVIDE_16     0x3
+
+#define CALIBRATE_TICKS 5
+
+static volatile uint32_t *lapic = (uint32_t *)LAPIC_DEFAULT_BASE;
+// Local APIC timer counts per timer tick.
+static uint32_t timer_count;
+
+static inline uint32_t __read(uint32_t reg)
+{
+    return lapic[reg / 4];
+}
+
+static inline void __write(uint32_t reg, uint32_t value)
+{
+    lapic[reg / 4] = value;
+}
+
+static cpu_state_t* timer_callback(cpu_state_t *cpu)
+{
+    lapic_eoi();
+    profile_tick(cpu);
+
+    return sched_tick(cpu);
+}
+
+static cpu_state_t* spurious_callback(cpu_state_t *cpu)
+{
+    // Spurious interrupts must not be acknowledged.
+    return cpu;
+}
+
+// Returns the APIC id of the executing cpu.
+uint32_t lapic_id()
+{
+    return __read(LAPIC_ID) >> 24;
+}
+
+// Signals the end of an interrupt delivered by the local APIC.
+void lapic_eoi()
+{
+    __write(LAPIC_EOI, 0);
+}
+
+// Sends an inter-processor interrupt and waits until it was accepted.
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr)
+{
+    __write(LAPIC_ICR_HIGH, apic_id << 24);
+    __write(LAPIC_ICR_LOW, icr);
+
+    while (__read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+    {
+        asm volatile("pause");
+    }
+}
+
+// Measures the speed of the local APIC timer against the timer tick.
+void lapic_timer_calibrate()
+{
+    uint32_t tick;
+
+    __write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    __write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+
+    tick = timer_get_ticks();
+    while (timer_get_ticks() == tick);
+
+    __write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+
+    tick = timer_get_ticks();
+    while (timer_get_ticks() - tick < CALIBRATE_TICKS);
+
+    timer_count = (0xFFFFFFFF - __read(LAPIC_TIMER_CURRENT)) / CALIBRATE_TICKS;
+    __write(LAPIC_TIMER_INIT, 0);
+}
+
+// Starts the periodic local APIC timer with the frequency of the timer tick.
+void lapic_timer_start()
+{
+    __write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    __write(LAPIC_LVT_TIMER, LAPIC_LVT_PERIODIC | INT_LAPIC_TIMER);
+    __write(LAPIC_TIMER_INIT, timer_count);
+}
+
+// Delivers performance counter overflows of the executing cpu as NMI. The
+// entry masks itself on delivery and has to be enabled again every time.
+void lapic_perf_nmi(int enabled)
+{
+    __write(LAPIC_LVT_PERF, enabled ? LAPIC_LVT_NMI : LAPIC_LVT_MASKED);
+}
+
+// Enables the local APIC of the executing cpu.
+void lapic_init_cpu()
+{
+    __write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_LAPIC_SPURIOUS);
+    this_cpu()->apic_id = lapic_id();
+}
+
+// Maps the local APIC and enables it on the bootstrap processor.
+void lapic_init()
+{
+    lapic = paging_map_mmio(rdmsr(MSR_APIC_BASE) & 0xFFFFF000, 0x1000);
+
+    if (lapic == NULL)
+    {
+        PANIC("No room to map the local APIC!");
+    }
+
+    register_interrupt_handler(INT_LAPIC_TIMER, timer_callback);
+    register_interrupt_handler(INT_LAPIC_SPURIOUS, spurious_callback);
+
+    lapic_init_cpu();
+}
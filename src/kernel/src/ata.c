@@ -0,0 +1,433 @@
+#include "ata.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+#include "block.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#ifdef ATA_BENCHMARK
+#include "console.h"
+#include "cpu.h"
+#include "perf.h"
+#endif
+
+#define PRD_EOT         0x8000  // last entry of the table
+#define PRD_BOUNDARY    0x10000 // an entry must not cross 64 KiB
+#define PRD_ENTRIES     (FRAME_SIZE / sizeof(prd_t))
+
+// Physical region descriptor of a bus master transfer.
+typedef struct prd
+{
+    uint32_t addr;
+    uint16_t size;  // 0 means 64 KiB
+    uint16_t flags;
+} __attribute__((packed)) prd_t;
+
+typedef struct ata_drive
+{
+    int present;
+    unsigned index;         // 0 master, 1 slave
+    struct ata_channel *channel;
+    block_device_t device;
+} ata_drive_t;
+
+typedef struct ata_channel
+{
+    uint16_t base;
+    uint16_t ctrl;
+    uint16_t bmide;         // bus master registers, 0 without DMA
+    uint8_t irq;
+    prd_t *prdt;
+    block_queue_t queue;
+    block_request_t *request;   // request the drive works on
+    int dma;                // the active request uses DMA
+    bio_t *bio;             // PIO position within the active request
+    uint32_t offset;        // bytes done of bio
+    uint32_t remaining;     // sectors left to transfer with PIO
+    ata_drive_t drives[2];
+} ata_channel_t;
+
+static ata_channel_t channels[2];
+static const char *drive_names[4] = { "hda", "hdb", "hdc", "hdd" };
+
+// Waits 400ns for the drive select to settle by reading the alternate status.
+static void ata_delay(ata_channel_t *channel)
+{
+    unsigned i;
+
+    for (i = 0; i < 4; i++)
+    {
+        inb(channel->ctrl);
+    }
+}
+
+// Polls until the drive is not busy, returns the final status.
+static uint8_t ata_wait(ata_channel_t *channel)
+{
+    uint8_t status;
+
+    while ((status = inb(channel->base + ATA_REG_STATUS)) & ATA_SR_BSY)
+    {
+        asm volatile("pause");
+    }
+
+    return status;
+}
+
+// Sets up the task file and sends a command for a run of sectors.
+static void ata_command(ata_channel_t *channel, unsigned drive, uint32_t sector, uint32_t count, uint8_t command)
+{
+    outb(channel->base + ATA_REG_DRIVE, 0xE0 | (drive << 4) | ((sector >> 24) & 0x0F));
+    ata_delay(channel);
+    outb(channel->base + ATA_REG_COUNT, count & 0xFF);  // 0 means 256
+    outb(channel->base + ATA_REG_LBA0, sector & 0xFF);
+    outb(channel->base + ATA_REG_LBA1, (sector >> 8) & 0xFF);
+    outb(channel->base + ATA_REG_LBA2, (sector >> 16) & 0xFF);
+    outb(channel->base + ATA_REG_COMMAND, command);
+}
+
+// Fills the PRD table with the buffers of a request, returns 0 if they
+// cannot be described.
+static int ata_build_prdt(ata_channel_t *channel, block_request_t *request)
+{
+    bio_t *bio;
+    unsigned entry = 0;
+    uint32_t addr, size, chunk;
+
+    for (bio = request->head; bio; bio = bio->next)
+    {
+        addr = virt_to_phys(bio->buffer);
+        size = bio->count * BLOCK_SECTOR_SIZE;
+
+        if (addr & 1)
+        {
+            return 0;
+        }
+
+        while (size)
+        {
+            chunk = PRD_BOUNDARY - (addr & (PRD_BOUNDARY - 1));
+            chunk = chunk < size ? chunk : size;
+
+            if (entry == PRD_ENTRIES)
+            {
+                return 0;
+            }
+
+            channel->prdt[entry].addr = addr;
+            channel->prdt[entry].size = chunk & 0xFFFF;
+            channel->prdt[entry].flags = 0;
+            entry++;
+
+            addr += chunk;
+            size -= chunk;
+        }
+    }
+
+    channel->prdt[entry - 1].flags = PRD_EOT;
+
+    return 1;
+}
+
+// Transfers the next sector of a PIO request from or to the drive.
+static void ata_pio_sector(ata_channel_t *channel)
+{
+    uint8_t *data;
+
+    if (channel->offset == channel->bio->count * BLOCK_SECTOR_SIZE)
+    {
+        channel->bio = channel->bio->next;
+        channel->offset = 0;
+    }
+
+    data = (uint8_t *)channel->bio->buffer + channel->offset;
+
+    if (channel->bio->write)
+    {
+        outsw(channel->base + ATA_REG_DATA, data, BLOCK_SECTOR_SIZE / 2);
+    }
+    else
+    {
+        insw(channel->base + ATA_REG_DATA, data, BLOCK_SECTOR_SIZE / 2);
+    }
+
+    channel->offset += BLOCK_SECTOR_SIZE;
+    channel->remaining--;
+}
+
+// Starts a request, with DMA if the controller supports it.
+static void ata_start(block_queue_t *queue, block_request_t *request)
+{
+    ata_channel_t *channel = queue->private;
+    ata_drive_t *drive = request->device->private;
+    uint8_t command;
+
+    channel->request = request;
+    channel->dma = channel->bmide && ata_build_prdt(channel, request);
+
+    if (channel->dma)
+    {
+        outl(channel->bmide + BM_REG_PRDT, virt_to_phys(channel->prdt));
+        outb(channel->bmide + BM_REG_COMMAND, request->write ? 0 : BM_CMD_READ);
+        // The status bits are cleared by writing them.
+        outb(channel->bmide + BM_REG_STATUS,
+            inb(channel->bmide + BM_REG_STATUS) | BM_SR_IRQ | BM_SR_ERR);
+
+        command = request->write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+        ata_command(channel, drive->index, request->sector, request->count, command);
+
+        outb(channel->bmide + BM_REG_COMMAND,
+            (request->write ? 0 : BM_CMD_READ) | BM_CMD_START);
+
+        return;
+    }
+
+    channel->bio = request->head;
+    channel->offset = 0;
+    channel->remaining = request->count;
+
+    command = request->write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO;
+    ata_command(channel, drive->index, request->sector, request->count, command);
+
+    // Writes send the first sector right away, every further one after the
+    // interrupt of the previous.
+    if (request->write)
+    {
+        while ((ata_wait(channel) & (ATA_SR_DRQ | ATA_SR_ERR)) == 0)
+        {
+        }
+
+        ata_pio_sector(channel);
+    }
+}
+
+// Hands the active request back to the block layer, which starts the next.
+static void ata_finish(ata_channel_t *channel, int error)
+{
+    block_request_t *request = channel->request;
+
+    channel->request = NULL;
+    block_complete(&channel->queue, request, error);
+}
+
+static cpu_state_t* ata_callback(cpu_state_t *cpu)
+{
+    ata_channel_t *channel = cpu->int_no == channels[0].irq ? &channels[0] : &channels[1];
+    block_request_t *request = channel->request;
+    uint8_t bm_status = 0;
+    uint8_t status;
+
+    if (channel->dma)
+    {
+        bm_status = inb(channel->bmide + BM_REG_STATUS);
+
+        if ((bm_status & BM_SR_IRQ) == 0)
+        {
+            return cpu;
+        }
+
+        outb(channel->bmide + BM_REG_COMMAND, 0);
+        outb(channel->bmide + BM_REG_STATUS, bm_status | BM_SR_IRQ | BM_SR_ERR);
+    }
+
+    // Reading the status acknowledges the interrupt.
+    status = inb(channel->base + ATA_REG_STATUS);
+
+    if (request == NULL)
+    {
+        return cpu;
+    }
+
+    if ((status & (ATA_SR_ERR | ATA_SR_DF)) || (bm_status & BM_SR_ERR))
+    {
+        ata_finish(channel, BLOCK_EIO);
+    }
+    else if (channel->dma)
+    {
+        ata_finish(channel, 0);
+    }
+    else if (!request->write)
+    {
+        ata_pio_sector(channel);
+
+        if (channel->remaining == 0)
+        {
+            ata_finish(channel, 0);
+        }
+    }
+    else if (channel->remaining)
+    {
+        ata_pio_sector(channel);
+    }
+    else
+    {
+        ata_finish(channel, 0);
+    }
+
+    return cpu;
+}
+
+// Identifies a drive, registers it as block device if it is an ATA disk.
+static void ata_probe(ata_channel_t *channel, unsigned index, const char *name)
+{
+    ata_drive_t *drive = &channel->drives[index];
+    uint16_t identify[256];
+    uint8_t status;
+
+    outb(channel->base + ATA_REG_DRIVE, 0xA0 | (index << 4));
+    ata_delay(channel);
+    outb(channel->base + ATA_REG_COUNT, 0);
+    outb(channel->base + ATA_REG_LBA0, 0);
+    outb(channel->base + ATA_REG_LBA1, 0);
+    outb(channel->base + ATA_REG_LBA2, 0);
+    outb(channel->base + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+
+    if (inb(channel->base + ATA_REG_STATUS) == 0)
+    {
+        return;
+    }
+
+    ata_wait(channel);
+
+    // ATAPI and SATA devices set the signature and do not answer.
+    if (inb(channel->base + ATA_REG_LBA1) || inb(channel->base + ATA_REG_LBA2))
+    {
+        return;
+    }
+
+    while (((status = inb(channel->base + ATA_REG_STATUS)) & (ATA_SR_DRQ | ATA_SR_ERR)) == 0)
+    {
+    }
+
+    if (status & ATA_SR_ERR)
+    {
+        return;
+    }
+
+    insw(channel->base + ATA_REG_DATA, identify, 256);
+
+    drive->present = 1;
+    drive->index = index;
+    drive->channel = channel;
+    drive->device.name = name;
+    drive->device.sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    drive->device.queue = &channel->queue;
+    drive->device.private = drive;
+
+    if (drive->device.sectors)
+    {
+        block_register(&drive->device);
+    }
+}
+
+// Build with -DATA_BENCHMARK to compare PIO with a loop of inw against
+// rep insw on every channel with a master drive at boot.
+#ifdef ATA_BENCHMARK
+#define BENCHMARK_SECTORS 64
+
+// Reads the first sectors of a drive with PIO, once with a loop of inw and
+// once with rep insw, and prints the counts per sector of both.
+static void ata_benchmark(ata_channel_t *channel, unsigned index)
+{
+    static uint16_t buffer[BLOCK_SECTOR_SIZE / 2];
+    static const char *names[2] = { "inw loop", "rep insw" };
+    perf_t perf[2] = { PERF_INIT, PERF_INIT };
+    unsigned method, sector, i;
+
+    for (method = 0; method < 2; method++)
+    {
+        ata_command(channel, index, 0, BENCHMARK_SECTORS, ATA_CMD_READ_PIO);
+
+        for (sector = 0; sector < BENCHMARK_SECTORS; sector++)
+        {
+            if (ata_wait(channel) & ATA_SR_ERR)
+            {
+                return;
+            }
+
+            while ((inb(channel->base + ATA_REG_STATUS) & ATA_SR_DRQ) == 0)
+            {
+            }
+
+            perf_begin(&perf[method]);
+
+            if (method == 0)
+            {
+                for (i = 0; i < BLOCK_SECTOR_SIZE / 2; i++)
+                {
+                    buffer[i] = inw(channel->base + ATA_REG_DATA);
+                }
+            }
+            else
+            {
+                insw(channel->base + ATA_REG_DATA, buffer, BLOCK_SECTOR_SIZE / 2);
+            }
+
+            perf_end(&perf[method]);
+        }
+    }
+
+    kprintf("%s: per sector\n", channel->drives[index].device.name);
+
+    for (method = 0; method < 2; method++)
+    {
+        perf_print(names[method], &perf[method], BENCHMARK_SECTORS);
+    }
+}
+#endif
+
+static void ata_init_channel(ata_channel_t *channel, uint16_t base, uint16_t ctrl, uint16_t bmide, uint8_t irq, const char **names)
+{
+    channel->base = base;
+    channel->ctrl = ctrl;
+    channel->irq = irq;
+    block_queue_init(&channel->queue, ATA_MAX_SECTORS, ATA_MAX_SEGMENTS, 1, ata_start, NULL, channel);
+
+    // No drive pulls the bus down.
+    if (inb(base + ATA_REG_STATUS) == 0xFF)
+    {
+        return;
+    }
+
+    if (bmide)
+    {
+        channel->prdt = alloc_frame(1);
+        channel->bmide = (void *)channel->prdt != PMM_NO_MEM ? bmide : 0;
+    }
+
+    outb(ctrl, ATA_CTRL_NIEN);
+    ata_probe(channel, 0, names[0]);
+    ata_probe(channel, 1, names[1]);
+
+#ifdef ATA_BENCHMARK
+    if (channel->drives[0].present)
+    {
+        ata_benchmark(channel, 0);
+    }
+#endif
+
+    register_interrupt_handler(irq, ata_callback);
+    outb(ctrl, 0);
+}
+
+void ata_init()
+{
+    pci_device_t *pci = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+    uint16_t bmide = 0;
+
+    // Bus mastering is announced by bit 7 of the programming interface.
+    if (pci && (pci->prog_if & 0x80))
+    {
+        bmide = pci->bar[4] & PCI_BAR_IO_MASK;
+        pci_enable(pci, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+    }
+
+    ata_init_channel(&channels[0], ATA_PRIMARY_BASE, ATA_PRIMARY_CTRL,
+        bmide, IRQ14, &drive_names[0]);
+    ata_init_channel(&channels[1], ATA_SECONDARY_BASE, ATA_SECONDARY_CTRL,
+        bmide ? bmide + 8 : 0, IRQ15, &drive_names[2]);
+}
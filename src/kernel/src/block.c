@@ -0,0 +1,497 @@
+#include "block.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "completion.h"
+#include "console.h"
+#include "pagecache.h"
+#include "pmm.h"
+#include "pool.h"
+#include "spinlock.h"
+#include "vfs.h"
+
+#define PAGE_SECTORS    (FRAME_SIZE / BLOCK_SECTOR_SIZE)
+#define FILE_SIZE_MAX   0xFFFFF000  // device files end at the last whole page
+#define FILE_PATH_MAX   16
+
+// State of a synchronous block_read() or block_write().
+typedef struct block_wait
+{
+    completion_t done;
+    int error;
+} block_wait_t;
+
+// File of a device, dev/<name>, read through the page cache.
+typedef struct block_file
+{
+    vfs_file_t file;
+    char path[FILE_PATH_MAX];
+} block_file_t;
+
+static pool_t request_pool = POOL_INIT("block_request", sizeof(block_request_t));
+static pool_t file_pool = POOL_INIT("block_file", sizeof(block_file_t));
+static block_device_t *devices = NULL;
+static spinlock_t devices_lock = SPINLOCK_INIT("block_devices");
+
+void block_queue_init(block_queue_t *queue, uint32_t max_sectors, unsigned max_segments, unsigned depth, block_start_t start, block_kick_t kick, void *private)
+{
+    memset(queue, 0, sizeof(block_queue_t));
+    queue->lock.name = "block_queue";
+    queue->max_sectors = max_sectors;
+    queue->max_segments = max_segments;
+    queue->depth = depth;
+    queue->start = start;
+    queue->kick = kick;
+    queue->private = private;
+}
+
+// Reads a page of a device file, the part past the end of the device is
+// zero.
+static int block_read_page(vfs_file_t *file, uint32_t index, void *frame)
+{
+    block_device_t *device = file->private;
+    uint32_t sector = index * PAGE_SECTORS;
+    uint32_t count = device->sectors - sector < PAGE_SECTORS ?
+        device->sectors - sector : PAGE_SECTORS;
+
+    memset((uint8_t *)frame + count * BLOCK_SECTOR_SIZE, 0,
+        FRAME_SIZE - count * BLOCK_SECTOR_SIZE);
+
+    return block_read(device, sector, count, frame) ? -1 : 0;
+}
+
+// Adds the file dev/<name> of a device, only done at boot like every other
+// change of the vfs index.
+static void block_add_file(block_device_t *device)
+{
+    block_file_t *bf;
+    size_t length = strlen(device->name);
+
+    if (length >= FILE_PATH_MAX - 4 || (bf = pool_alloc(&file_pool)) == NULL)
+    {
+        kprintf("%s: no device file\n", device->name);
+        return;
+    }
+
+    memcpy(bf->path, "dev/", 4);
+    memcpy(bf->path + 4, device->name, length + 1);
+
+    bf->file.path = bf->path;
+    bf->file.size = device->sectors < FILE_SIZE_MAX / BLOCK_SECTOR_SIZE ?
+        device->sectors * BLOCK_SECTOR_SIZE : FILE_SIZE_MAX;
+    bf->file.read_page = block_read_page;
+    bf->file.private = device;
+
+    vfs_register(&bf->file, 1);
+}
+
+void block_register(block_device_t *device)
+{
+    spin_lock(&devices_lock);
+    device->next = devices;
+    devices = device;
+    spin_unlock(&devices_lock);
+
+    block_add_file(device);
+
+    kprintf("%s: %u sectors\n", device->name, device->sectors);
+}
+
+// Returns the device with a name, NULL if there is none.
+block_device_t* block_find(const char *name)
+{
+    block_device_t *device;
+
+    spin_lock(&devices_lock);
+
+    for (device = devices; device && strcmp(device->name, name); device = device->next)
+    {
+    }
+
+    spin_unlock(&devices_lock);
+
+    return device;
+}
+
+// Tries to add a bio to the front or the back of a pending request.
+static int request_merge(block_queue_t *queue, block_request_t *request, bio_t *bio)
+{
+    if (request->device != bio->device || request->write != bio->write ||
+        request->count + bio->count > queue->max_sectors ||
+        request->segments >= queue->max_segments)
+    {
+        return 0;
+    }
+
+    if (request->sector + request->count == bio->sector)
+    {
+        request->tail->next = bio;
+        request->tail = bio;
+    }
+    else if (bio->sector + bio->count == request->sector)
+    {
+        bio->next = request->head;
+        request->head = bio;
+        request->sector = bio->sector;
+    }
+    else
+    {
+        return 0;
+    }
+
+    request->count += bio->count;
+    request->segments++;
+
+    return 1;
+}
+
+// Inserts a request into the pending list, which is sorted by sector.
+static void request_insert(block_queue_t *queue, block_request_t *request)
+{
+    block_request_t **link = &queue->pending;
+
+    while (*link && (*link)->sector <= request->sector)
+    {
+        link = &(*link)->next;
+    }
+
+    request->next = *link;
+    *link = request;
+}
+
+// Takes the next request, the one at or after the current position or the
+// lowest one if there is none. Called with the lock.
+static block_request_t* queue_next(block_queue_t *queue)
+{
+    block_request_t **link = &queue->pending;
+    block_request_t *request;
+
+    while (*link && (*link)->sector < queue->position)
+    {
+        link = &(*link)->next;
+    }
+
+    if (*link == NULL)
+    {
+        link = &queue->pending;
+    }
+
+    request = *link;
+    *link = request->next;
+    request->next = NULL;
+
+    queue->position = request->sector + request->count;
+
+    return request;
+}
+
+// Takes as many pending requests as the device accepts, in dispatch order.
+// Called with the lock.
+static block_request_t* queue_dispatch(block_queue_t *queue)
+{
+    block_request_t *batch = NULL;
+    block_request_t **tail = &batch;
+
+    while (queue->pending && queue->in_flight < queue->depth)
+    {
+        *tail = queue_next(queue);
+        tail = &(*tail)->next;
+        queue->in_flight++;
+    }
+
+    return batch;
+}
+
+// Hands a batch of requests to the driver, without the lock.
+static void queue_start(block_queue_t *queue, block_request_t *batch)
+{
+    block_request_t *request;
+
+    if (batch == NULL)
+    {
+        return;
+    }
+
+    while (batch)
+    {
+        request = batch;
+        batch = request->next;
+        request->next = NULL;
+        queue->start(queue, request);
+    }
+
+    if (queue->kick)
+    {
+        queue->kick(queue);
+    }
+}
+
+// Queues a bio, its done function is called once it is transferred.
+int block_submit(bio_t *bio)
+{
+    block_device_t *device = bio->device;
+    block_queue_t *queue = device->queue;
+    block_request_t *request;
+    block_request_t *new_request;
+    uint32_t eflags;
+
+    if (bio->count == 0 || bio->count > queue->max_sectors ||
+        bio->sector >= device->sectors ||
+        bio->count > device->sectors - bio->sector)
+    {
+        return BLOCK_EINVAL;
+    }
+
+    bio->next = NULL;
+
+    // Allocated up front, the pool must not be used with the lock held.
+    new_request = pool_alloc(&request_pool);
+
+    eflags = spin_lock_irqsave(&queue->lock);
+
+    for (request = queue->pending; request; request = request->next)
+    {
+        if (request_merge(queue, request, bio))
+        {
+            break;
+        }
+    }
+
+    if (request)
+    {
+        // A merge at the front can make the list unsorted.
+        if (request->head == bio)
+        {
+            block_request_t **link = &queue->pending;
+
+            while (*link != request)
+            {
+                link = &(*link)->next;
+            }
+
+            *link = request->next;
+            request_insert(queue, request);
+        }
+    }
+    else if (new_request)
+    {
+        new_request->device = device;
+        new_request->sector = bio->sector;
+        new_request->count = bio->count;
+        new_request->write = bio->write;
+        new_request->segments = 1;
+        new_request->head = bio;
+        new_request->tail = bio;
+        request_insert(queue, new_request);
+        new_request = NULL;
+    }
+    else
+    {
+        spin_unlock_irqrestore(&queue->lock, eflags);
+        return BLOCK_ENOMEM;
+    }
+
+    request = queue_dispatch(queue);
+
+    spin_unlock_irqrestore(&queue->lock, eflags);
+
+    if (new_request)
+    {
+        pool_free(&request_pool, new_request);
+    }
+
+    queue_start(queue, request);
+
+    return 0;
+}
+
+// Finishes a request of a queue and starts the next ones, called by drivers
+// from their interrupt handler.
+void block_complete(block_queue_t *queue, block_request_t *request, int error)
+{
+    block_request_t *batch;
+    bio_t *bio;
+    bio_t *bio_next;
+
+    spin_lock(&queue->lock);
+
+    queue->in_flight--;
+    batch = queue_dispatch(queue);
+
+    spin_unlock(&queue->lock);
+
+    // Keep the device busy while the callbacks run.
+    queue_start(queue, batch);
+
+    for (bio = request->head; bio; bio = bio_next)
+    {
+        bio_next = bio->next;
+        bio->done(bio, error);
+    }
+
+    pool_free(&request_pool, request);
+}
+
+static void block_wait_done(bio_t *bio, int error)
+{
+    block_wait_t *wait = bio->private;
+
+    wait->error = error;
+    complete(&wait->done);
+}
+
+// Submits a bio and sleeps until it is done.
+static int block_transfer(block_device_t *device, uint32_t sector, uint32_t count, void *buffer, int write)
+{
+    block_wait_t wait = { .done = COMPLETION_INIT, .error = 0 };
+    bio_t bio =
+    {
+        .device = device,
+        .sector = sector,
+        .count = count,
+        .buffer = buffer,
+        .write = write,
+        .done = block_wait_done,
+        .private = &wait,
+    };
+    int result = block_submit(&bio);
+
+    if (result)
+    {
+        return result;
+    }
+
+    wait_for_completion(&wait.done);
+
+    return wait.error;
+}
+
+// Reads sectors into a physically contiguous buffer.
+int block_read(block_device_t *device, uint32_t sector, uint32_t count, void *buffer)
+{
+    return block_transfer(device, sector, count, buffer, BIO_READ);
+}
+
+// Writes sectors from a physically contiguous buffer.
+int block_write(block_device_t *device, uint32_t sector, uint32_t count, const void *buffer)
+{
+    return block_transfer(device, sector, count, (void *)buffer, BIO_WRITE);
+}
+
+#ifdef BLOCK_CHECK
+#define CHECK_PAGES 8
+
+// Build with -DBLOCK_CHECK to check every device at boot. Its first pages
+// are read by a batch of bios submitted out of order, which the queue merges
+// and sorts, the first page is written back unchanged, and then all of them
+// are read again through the device file and the page cache. Both reads have
+// to match, the pages of the file are reclaimed afterwards.
+void block_check()
+{
+    static const uint32_t order[CHECK_PAGES] = { 1, 3, 5, 7, 0, 2, 4, 6 };
+    block_wait_t waits[CHECK_PAGES];
+    bio_t bios[CHECK_PAGES];
+    char path[FILE_PATH_MAX];
+    block_device_t *device;
+    vfs_file_t *file;
+    uint8_t *buffer;
+    const uint32_t *data;
+    const uint32_t *expected;
+    uint32_t pages, page, i, j;
+    int error, mismatch;
+
+    // Devices are only registered by earlier initcalls, the list is stable.
+    for (device = devices; device; device = device->next)
+    {
+        pages = device->sectors / PAGE_SECTORS;
+        pages = pages < CHECK_PAGES ? pages : CHECK_PAGES;
+
+        memcpy(path, "dev/", 4);
+        memcpy(path + 4, device->name, strlen(device->name) + 1);
+
+        file = vfs_open(path);
+        buffer = alloc_frame(CHECK_PAGES);
+
+        if (pages == 0 || file == NULL || block_find(device->name) != device ||
+            (void *)buffer == PMM_NO_MEM)
+        {
+            kprintf("%s: check skipped\n", device->name);
+
+            if ((void *)buffer != PMM_NO_MEM)
+            {
+                free_frame((uintptr_t)buffer, CHECK_PAGES);
+            }
+
+            continue;
+        }
+
+        error = 0;
+
+        for (i = 0, j = 0; i < CHECK_PAGES; i++)
+        {
+            if (order[i] >= pages)
+            {
+                continue;
+            }
+
+            waits[j].done = (completion_t)COMPLETION_INIT;
+            waits[j].error = 0;
+            bios[j] = (bio_t)
+            {
+                .device = device,
+                .sector = order[i] * PAGE_SECTORS,
+                .count = PAGE_SECTORS,
+                .buffer = buffer + order[i] * FRAME_SIZE,
+                .write = BIO_READ,
+                .done = block_wait_done,
+                .private = &waits[j],
+            };
+
+            if (block_submit(&bios[j]))
+            {
+                error = BLOCK_EIO;
+                continue;
+            }
+
+            j++;
+        }
+
+        while (j--)
+        {
+            wait_for_completion(&waits[j].done);
+            error = error ? error : waits[j].error;
+        }
+
+        if (error == 0)
+        {
+            error = block_write(device, 0, PAGE_SECTORS, buffer);
+        }
+
+        mismatch = 0;
+
+        for (page = 0; page < pages && error == 0; page++)
+        {
+            if (vfs_read(file, page * FRAME_SIZE, FRAME_SIZE, (const void **)&data) != FRAME_SIZE)
+            {
+                error = BLOCK_EIO;
+                break;
+            }
+
+            expected = (const uint32_t *)(buffer + page * FRAME_SIZE);
+
+            for (i = 0; i < FRAME_SIZE / sizeof(uint32_t); i++)
+            {
+                mismatch |= data[i] != expected[i];
+            }
+
+            vfs_release(file, page * FRAME_SIZE);
+        }
+
+        kprintf("%s: check of %u pages %s, %u pages reclaimed\n", device->name,
+            pages, error ? "failed" : mismatch ? "mismatched" : "passed",
+            pagecache_reclaim(pages));
+
+        free_frame((uintptr_t)buffer, CHECK_PAGES);
+    }
+}
+#endif
@@ -0,0 +1,50 @@
+#include "completion.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "thread.h"
+
+// Blocks the current thread until the completion is signaled, only one
+// thread may wait.
+void wait_for_completion(completion_t *completion)
+{
+    thread_t *current;
+    uint32_t eflags = irq_save();
+
+    spin_lock(&completion->lock);
+
+    if (!completion->done)
+    {
+        current = sched_current();
+        completion->waiter = current;
+        current->state = THREAD_BLOCKED;
+        spin_unlock(&completion->lock);
+
+        // A wake up before the yield makes the thread ready again, the
+        // scheduler does not queue it twice.
+        thread_yield();
+    }
+    else
+    {
+        spin_unlock(&completion->lock);
+    }
+
+    irq_restore(eflags);
+}
+
+// Signals a completion and wakes up its waiter, callable from interrupts.
+void complete(completion_t *completion)
+{
+    thread_t *waiter;
+    uint32_t eflags = spin_lock_irqsave(&completion->lock);
+
+    completion->done = 1;
+    waiter = completion->waiter;
+    completion->waiter = NULL;
+
+    spin_unlock_irqrestore(&completion->lock, eflags);
+
+    if (waiter)
+    {
+        sched_enqueue(waiter);
+    }
+}
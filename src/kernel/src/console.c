@@ -2,15 +2,20 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <string.h>
+#include "fb.h"
+#include "multiboot.h"
+#include "pmm.h"
 #include "ports.h"
+#include "spinlock.h"
 
 // TODO: combine with stdio.h functions
 
 // TODO: read from BIOS data area
 #define BASE_PORT 0x3D4
 
-#define X_MAX 80
-#define Y_MAX 25
+// size of the VGA text mode
+#define TEXT_X_MAX 80
+#define TEXT_Y_MAX 25
 
 #define BLANK 0x20
 
@@ -36,52 +41,114 @@
 
 static int pos_x = 0;
 static int pos_y = 0;
+static int x_max = TEXT_X_MAX;
+static int y_max = TEXT_Y_MAX;
 static uint16_t *videoram = (uint16_t *) 0xB8000;
 
+// With a framebuffer videoram is a copy in memory and shown holds the cells
+// on the screen. Only the rows between dirty_start and dirty_end changed
+// since the last flush, and only cells that differ from shown are drawn.
+static uint16_t *shown = NULL;
+static int dirty_start = 0;
+static int dirty_end = 0;
+// Protects the screen and cursor, kprintf() is used from interrupts as well.
+static spinlock_t console_lock = SPINLOCK_INIT("console");
+
 // Encodes the character c with the text and background color.
 static inline uint16_t code(char c, uint16_t color_text, uint16_t color_back)
 {
     return c | (((color_back << 4) | color_text) << 8);
 }
 
+// Marks rows as changed since the last flush.
+static inline void damage(int start, int end)
+{
+    if (dirty_start == dirty_end)
+    {
+        dirty_start = start;
+        dirty_end = end;
+    }
+    else
+    {
+        dirty_start = start < dirty_start ? start : dirty_start;
+        dirty_end = end > dirty_end ? end : dirty_end;
+    }
+}
+
+// Draws the cells of the damaged rows that differ from the screen.
+static void flush()
+{
+    int i;
+    int end = dirty_end * x_max;
+
+    for (i = dirty_start * x_max; i < end; i++)
+    {
+        if (videoram[i] != shown[i])
+        {
+            fb_draw(i % x_max, i / x_max, videoram[i] & 0xFF,
+                (videoram[i] >> 8) & 0x0F, videoram[i] >> 12);
+            shown[i] = videoram[i];
+        }
+    }
+
+    dirty_start = dirty_end = 0;
+}
+
 // Moves the cursor after the last written position.
 static void update_cursor()
 {
-    uint16_t pos = pos_y * X_MAX + pos_x;
+    uint16_t pos = pos_y * x_max + pos_x;
 
-    outb(BASE_PORT, 0x0E);
-    outb(BASE_PORT + 1, pos >> 8);
+    // The framebuffer has no cursor, the text is brought onto the screen
+    // instead.
+    if (shown)
+    {
+        flush();
+        return;
+    }
+
+    uint16_t regs[2] =
+    {
+        PORT_INDEXED(0x0E, pos >> 8),
+        PORT_INDEXED(0x0F, pos),
+    };
 
-    outb(BASE_PORT, 0x0F);
-    outb(BASE_PORT + 1, pos);
+    outw_indexed(BASE_PORT, regs, 2);
 }
 
 // Clears the screen with the default text and background color.
 void kclear()
 {
     int i;
+    uint32_t eflags = spin_lock_irqsave(&console_lock);
 
-    for (i = 0; i < Y_MAX * X_MAX; i++)
+    for (i = 0; i < y_max * x_max; i++)
     {
         videoram[i] = code(BLANK, DEF_TEXT, DEF_BACK);
     }
 
+    damage(0, y_max);
     pos_x = pos_y = 0;
     update_cursor();
+
+    spin_unlock_irqrestore(&console_lock, eflags);
 }
 
-// Moves the contents of every line one up and clears the last.
+// Moves the contents of every line one up and clears the last. With a
+// framebuffer this only changes the copy in memory, the next flush draws
+// the cells that differ afterwards.
 static void scroll()
 {
     int i;
 
-    memmove(videoram, videoram + X_MAX, (Y_MAX - 1) * X_MAX * 2 - 1);
+    memmove(videoram, videoram + x_max, (y_max - 1) * x_max * sizeof(uint16_t));
 
-    for (i = (Y_MAX - 1) * X_MAX; i < Y_MAX * X_MAX; i++)
+    for (i = (y_max - 1) * x_max; i < y_max * x_max; i++)
     {
         videoram[i] = code(BLANK, DEF_TEXT, DEF_BACK);
     }
 
+    damage(0, y_max);
     pos_y--;
 }
 
@@ -91,24 +158,75 @@ static void print_char(char c)
 {
     // If the end of a line is reached, '\n' will be ignored
     // without generating an empty line.
-    if (c == '\n' || pos_x >= X_MAX)
+    if (c == '\n' || pos_x >= x_max)
     {
         pos_x = 0;
         pos_y++;
     }
 
-    if (pos_y >= Y_MAX)
+    if (pos_y >= y_max)
     {
         scroll();
     }
 
     if (c != '\n')
     {
-        videoram[pos_y * X_MAX + pos_x] = code(c, DEF_TEXT, DEF_BACK);
+        videoram[pos_y * x_max + pos_x] = code(c, DEF_TEXT, DEF_BACK);
+        damage(pos_y, pos_y + 1);
         pos_x++;
     }
 }
 
+// Switches to the framebuffer if the boot loader set one up, keeps what was
+// printed in text mode so far.
+void console_init(multiboot_info_t *mb_info)
+{
+    size_t frames;
+    uint16_t *cells;
+    uint16_t *screen;
+    uint32_t eflags;
+    int x, y;
+
+    if (fb_init(mb_info))
+    {
+        return;
+    }
+
+    frames = (fb_columns() * fb_rows() * sizeof(uint16_t) + FRAME_SIZE - 1) / FRAME_SIZE;
+    cells = alloc_frame(frames);
+    screen = alloc_frame(frames);
+
+    if ((void *)cells == PMM_NO_MEM || (void *)screen == PMM_NO_MEM)
+    {
+        return;
+    }
+
+    // Nothing is on the screen yet, every cell is drawn by the first flush.
+    memset(screen, 0xFF, frames * FRAME_SIZE);
+
+    eflags = spin_lock_irqsave(&console_lock);
+
+    for (y = 0; y < (int)fb_rows(); y++)
+    {
+        for (x = 0; x < (int)fb_columns(); x++)
+        {
+            cells[y * fb_columns() + x] = x < x_max && y < y_max ?
+                videoram[y * x_max + x] : code(BLANK, DEF_TEXT, DEF_BACK);
+        }
+    }
+
+    videoram = cells;
+    shown = screen;
+    x_max = fb_columns();
+    y_max = fb_rows();
+    pos_y = pos_y < y_max ? pos_y : y_max - 1;
+
+    damage(0, y_max);
+    flush();
+
+    spin_unlock_irqrestore(&console_lock, eflags);
+}
+
 // Prints a string to the screen, uses print_char
 static void print_string(const char *s)
 {
@@ -144,6 +262,7 @@ static void print_int(uint32_t i, int base)
 void kprintf(const char *format, ...)
 {
     va_list ptr;
+    uint32_t eflags = spin_lock_irqsave(&console_lock);
     va_start(ptr, format);
 
     while (*format != '\0')
@@ -193,4 +312,6 @@ void kprintf(const char *format, ...)
 
     va_end(ptr);
     update_cursor();
+
+    spin_unlock_irqrestore(&console_lock, eflags);
 }
@@ -0,0 +1,76 @@
+#include "cpustat.h"
+#include <stdint.h>
+#include "cpu.h"
+#include "seqlock.h"
+#include "sched.h"
+#include "thread.h"
+
+static cpustat_t stats[MAX_CPUS];
+// Only the owning cpu writes its stats, other cpus may read them.
+static seqcount_t stats_seq[MAX_CPUS];
+// Time stamp of the last context change.
+static uint64_t last_tsc[MAX_CPUS];
+
+// Returns the cycles since the last context change of a cpu.
+static inline uint64_t __elapsed(unsigned cpu)
+{
+    uint64_t now = rdtsc();
+    uint64_t delta = now - last_tsc[cpu];
+
+    last_tsc[cpu] = now;
+
+    return delta;
+}
+
+// Charges the time until an interrupt to the interrupted thread.
+void cpustat_enter()
+{
+    unsigned cpu = cpu_id();
+    uint64_t delta = __elapsed(cpu);
+    thread_t *thread = sched_current();
+
+    write_seqcount_begin(&stats_seq[cpu]);
+
+    if (sched_is_idle())
+    {
+        stats[cpu].time[CPU_TIME_IDLE] += delta;
+    }
+    else
+    {
+        stats[cpu].time[CPU_TIME_THREAD] += delta;
+
+        if (thread)
+        {
+            thread->runtime += delta;
+        }
+    }
+
+    write_seqcount_end(&stats_seq[cpu]);
+}
+
+// Charges the time since cpustat_enter() to an interrupt context.
+void cpustat_leave(unsigned context)
+{
+    unsigned cpu = cpu_id();
+
+    write_seqcount_begin(&stats_seq[cpu]);
+    stats[cpu].time[context] += __elapsed(cpu);
+    write_seqcount_end(&stats_seq[cpu]);
+}
+
+// Copies the time accounting of a cpu.
+void cpustat_get(unsigned cpu, cpustat_t *stat)
+{
+    unsigned i;
+    uint32_t sequence;
+
+    do
+    {
+        sequence = read_seqcount_begin(&stats_seq[cpu]);
+
+        for (i = 0; i < CPU_TIME_MAX; i++)
+        {
+            stat->time[i] = stats[cpu].time[i];
+        }
+    } while (read_seqcount_retry(&stats_seq[cpu], sequence));
+}
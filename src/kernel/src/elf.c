@@ -0,0 +1,180 @@
+#include "elf.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "paging.h"
+#include "pmm.h"
+#include "thread.h"
+#include "vfs.h"
+
+// Checks that an image is an i386 executable whose program headers lie
+// within the first length bytes.
+static int elf_check(const elf_header_t *header, size_t length)
+{
+    if (length < sizeof(elf_header_t) ||
+        header->magic != ELF_MAGIC ||
+        header->class != ELF_CLASS32 ||
+        header->data != ELF_DATA2LSB ||
+        header->type != ELF_ET_EXEC ||
+        header->machine != ELF_EM_386 ||
+        header->phentsize != sizeof(elf_program_header_t))
+    {
+        return 0;
+    }
+
+    return header->phoff <= length &&
+        header->phnum <= (length - header->phoff) / sizeof(elf_program_header_t);
+}
+
+// Sets up the PT_LOAD segments as regions of an address space, backed by
+// the image in the direct map or by a file if one is given. Returns the
+// entry point in entry.
+static int elf_load_segments(vmm_context_t *context, const elf_header_t *header, size_t size, uintptr_t image, vfs_file_t *file, uintptr_t *entry)
+{
+    const elf_program_header_t *phdr;
+    unsigned i;
+    uint32_t flags;
+    int result;
+
+    phdr = (const elf_program_header_t *)((uintptr_t)header + header->phoff);
+
+    for (i = 0; i < header->phnum; i++, phdr++)
+    {
+        if (phdr->type != ELF_PT_LOAD || phdr->memsz == 0)
+        {
+            continue;
+        }
+
+        if (phdr->filesz > phdr->memsz || phdr->offset > size ||
+            phdr->filesz > size - phdr->offset)
+        {
+            return ELF_EINVAL;
+        }
+
+        flags = VMM_USER | (phdr->flags & ELF_PF_W ? VMM_WRITE : 0) |
+            (phdr->flags & ELF_PF_X ? VMM_EXEC : 0);
+
+        if (file)
+        {
+            result = vmm_add_file_region(context, phdr->vaddr, phdr->memsz,
+                flags, file, phdr->offset, phdr->filesz);
+        }
+        else
+        {
+            result = vmm_add_region(context, phdr->vaddr, phdr->memsz,
+                flags, virt_to_phys((void *)(image + phdr->offset)), phdr->filesz);
+        }
+
+        if (result == VMM_ENOMEM)
+        {
+            return ELF_ENOMEM;
+        }
+        else if (result)
+        {
+            return ELF_EINVAL;
+        }
+    }
+
+    *entry = header->entry;
+
+    return 0;
+}
+
+// Sets up an executable image in the direct map as regions of an address
+// space. Nothing is mapped or copied here, pages are mapped from the image
+// when the program first touches them, so the image has to stay in memory
+// as long as the context exists.
+int elf_load(vmm_context_t *context, uintptr_t image, size_t size, uintptr_t *entry)
+{
+    const elf_header_t *header = (const elf_header_t *)image;
+
+    if (!elf_check(header, size))
+    {
+        return ELF_EINVAL;
+    }
+
+    return elf_load_segments(context, header, size, image, NULL, entry);
+}
+
+// Sets up an executable file as regions of an address space, its pages
+// are shared with the page cache. The program headers have to be within
+// the first page.
+int elf_load_file(vmm_context_t *context, vfs_file_t *file, uintptr_t *entry)
+{
+    const void *header;
+    size_t length = vfs_read(file, 0, FRAME_SIZE, &header);
+    int result = ELF_EINVAL;
+
+    if (length == 0)
+    {
+        return ELF_ENOMEM;
+    }
+
+    if (elf_check(header, length))
+    {
+        result = elf_load_segments(context, header, file->size, 0, file, entry);
+    }
+
+    vfs_release(file, 0);
+
+    return result;
+}
+
+// Gives a context a user stack and starts a thread at entry in it. The
+// context is destroyed if that fails.
+static thread_t* elf_start(vmm_context_t *context, uintptr_t entry)
+{
+    thread_t *thread = NULL;
+
+    if (vmm_add_region(context, USER_STACK_TOP - USER_STACK_SIZE,
+        USER_STACK_SIZE, VMM_USER | VMM_WRITE, 0, 0) == 0)
+    {
+        thread = thread_create_user(context, entry, USER_STACK_TOP);
+    }
+
+    if (thread == NULL)
+    {
+        vmm_destroy_context(context);
+    }
+
+    return thread;
+}
+
+// Starts an executable image in the direct map in a new address space.
+thread_t* elf_exec(uintptr_t image, size_t size)
+{
+    uintptr_t entry;
+    vmm_context_t *context = vmm_create_context();
+
+    if (context == NULL)
+    {
+        return NULL;
+    }
+
+    if (elf_load(context, image, size, &entry) != 0)
+    {
+        vmm_destroy_context(context);
+        return NULL;
+    }
+
+    return elf_start(context, entry);
+}
+
+// Starts an executable file in a new address space.
+thread_t* elf_exec_file(vfs_file_t *file)
+{
+    uintptr_t entry;
+    vmm_context_t *context = vmm_create_context();
+
+    if (context == NULL)
+    {
+        return NULL;
+    }
+
+    if (elf_load_file(context, file, &entry) != 0)
+    {
+        vmm_destroy_context(context);
+        return NULL;
+    }
+
+    return elf_start(context, entry);
+}
@@ -0,0 +1,168 @@
+#include "fb.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+#include "font.h"
+#include "multiboot.h"
+#include "paging.h"
+#include "pmm.h"
+
+#define COLORS 16
+#define GLYPH_PIXELS (FONT_WIDTH * FONT_HEIGHT)
+
+// A glyph expanded for one pair of colors.
+typedef struct glyph
+{
+    uint32_t pixels[GLYPH_PIXELS];
+    uint8_t color_text;
+    uint8_t color_back;
+    uint8_t valid;
+} glyph_t;
+
+static uint8_t *base;
+static uint32_t pitch;
+static unsigned columns;
+static unsigned rows;
+static uint32_t palette[COLORS];
+static glyph_t *glyphs;
+
+// The VGA text mode palette as 8 bit red, green, blue.
+static const uint8_t vga_colors[COLORS][3] =
+{
+    { 0x00, 0x00, 0x00 }, { 0x00, 0x00, 0xAA }, { 0x00, 0xAA, 0x00 },
+    { 0x00, 0xAA, 0xAA }, { 0xAA, 0x00, 0x00 }, { 0xAA, 0x00, 0xAA },
+    { 0xAA, 0x55, 0x00 }, { 0xAA, 0xAA, 0xAA }, { 0x55, 0x55, 0x55 },
+    { 0x55, 0x55, 0xFF }, { 0x55, 0xFF, 0x55 }, { 0x55, 0xFF, 0xFF },
+    { 0xFF, 0x55, 0x55 }, { 0xFF, 0x55, 0xFF }, { 0xFF, 0xFF, 0x55 },
+    { 0xFF, 0xFF, 0xFF },
+};
+
+// Scales an 8 bit color channel to its field of a pixel.
+static inline uint32_t __channel(uint8_t value, uint8_t position, uint8_t size)
+{
+    return (uint32_t)(value >> (8 - size)) << position;
+}
+
+// Finds and maps the framebuffer the boot loader set up, returns 0 or an
+// FB_E* error if there is none that can be used.
+int fb_init(multiboot_info_t *mb_info)
+{
+    uint64_t addr = mb_info->framebuffer_addr;
+    size_t size;
+    unsigned i;
+
+    if ((mb_info->flags & MULTIBOOT_INFO_FRAMEBUFFER_INFO) == 0 ||
+        mb_info->framebuffer_type != MULTIBOOT_FRAMEBUFFER_TYPE_RGB ||
+        mb_info->framebuffer_bpp != FB_DEPTH)
+    {
+        return FB_ENODEV;
+    }
+
+    size = (size_t)mb_info->framebuffer_pitch * mb_info->framebuffer_height;
+
+    // The device window only maps memory below 4GB.
+    if (addr + size > 0x100000000ULL)
+    {
+        return FB_ENODEV;
+    }
+
+    base = paging_map_wc((uintptr_t)addr, size);
+
+    if (base == NULL)
+    {
+        return FB_ENOMEM;
+    }
+
+    glyphs = alloc_frame((FONT_GLYPHS * sizeof(glyph_t) + FRAME_SIZE - 1) / FRAME_SIZE);
+
+    if ((void *)glyphs == PMM_NO_MEM)
+    {
+        return FB_ENOMEM;
+    }
+
+    memset(glyphs, 0, FONT_GLYPHS * sizeof(glyph_t));
+
+    for (i = 0; i < COLORS; i++)
+    {
+        palette[i] =
+            __channel(vga_colors[i][0], mb_info->framebuffer_red_field_position,
+                mb_info->framebuffer_red_mask_size) |
+            __channel(vga_colors[i][1], mb_info->framebuffer_green_field_position,
+                mb_info->framebuffer_green_mask_size) |
+            __channel(vga_colors[i][2], mb_info->framebuffer_blue_field_position,
+                mb_info->framebuffer_blue_mask_size);
+    }
+
+    pitch = mb_info->framebuffer_pitch;
+    columns = mb_info->framebuffer_width / FONT_WIDTH;
+    rows = mb_info->framebuffer_height / FONT_HEIGHT;
+
+    return 0;
+}
+
+unsigned fb_columns()
+{
+    return columns;
+}
+
+unsigned fb_rows()
+{
+    return rows;
+}
+
+// Returns the pixels of a character in a pair of colors, expands the glyph
+// if it was last drawn in other colors.
+static const uint32_t* fb_glyph(char c, uint8_t color_text, uint8_t color_back)
+{
+    unsigned index = (uint8_t)c >= FONT_FIRST && (uint8_t)c <= FONT_LAST ?
+        (uint8_t)c - FONT_FIRST : '?' - FONT_FIRST;
+    glyph_t *glyph = &glyphs[index];
+    uint32_t text = palette[color_text & (COLORS - 1)];
+    uint32_t back = palette[color_back & (COLORS - 1)];
+    unsigned x, y;
+
+    if (glyph->valid && glyph->color_text == color_text &&
+        glyph->color_back == color_back)
+    {
+        return glyph->pixels;
+    }
+
+    for (y = 0; y < FONT_HEIGHT; y++)
+    {
+        for (x = 0; x < FONT_WIDTH; x++)
+        {
+            glyph->pixels[y * FONT_WIDTH + x] =
+                (font_8x8[index][y] >> x) & 1 ? text : back;
+        }
+    }
+
+    glyph->color_text = color_text;
+    glyph->color_back = color_back;
+    glyph->valid = 1;
+
+    return glyph->pixels;
+}
+
+// Draws a character into the cell at column x, row y.
+void fb_draw(unsigned x, unsigned y, char c, uint8_t color_text, uint8_t color_back)
+{
+    const uint32_t *pixels = fb_glyph(c, color_text, color_back);
+    uint8_t *line = base + y * FONT_HEIGHT * pitch + x * FONT_WIDTH * sizeof(uint32_t);
+    uint32_t *dst;
+    unsigned i, j;
+
+    // Whole rows of the cell in sequence, the write combining buffers
+    // turn them into bursts.
+    for (i = 0; i < FONT_HEIGHT; i++)
+    {
+        dst = (uint32_t *)line;
+
+        for (j = 0; j < FONT_WIDTH; j++)
+        {
+            dst[j] = *pixels++;
+        }
+
+        line += pitch;
+    }
+}
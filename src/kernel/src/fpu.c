@@ -0,0 +1,203 @@
+#include "fpu.h"
+#include <stdint.h>
+#include "kernel.h"
+#include "console.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "pool.h"
+#include "sched.h"
+#include "thread.h"
+
+#define CR0_MP      0x00000002  // wait and fwait trap on TS as well
+#define CR0_EM      0x00000004  // no fpu, every fpu instruction traps
+#define CR0_TS      0x00000008  // task switched, the next fpu use traps
+#define CR0_NE      0x00000020  // fpu errors raise #MF, not IRQ13
+
+#define CR4_OSFXSR      0x00000200  // fxsave, fxrstor and SSE
+#define CR4_OSXMMEXCPT  0x00000400  // unmasked SSE errors raise #XM
+
+// MXCSR after reset, every exception masked.
+#define MXCSR_DEFAULT   0x1F80
+
+// Save areas, 512 bytes each out of whole frames and thus 512 byte aligned.
+static pool_t state_pool = POOL_INIT("fpu_state", sizeof(fpu_state_t));
+
+// Features of the cpus, detected by fpu_init().
+static int has_fpu;
+static int has_fxsr;
+static int has_sse;
+
+static inline uint32_t __get_cr0()
+{
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r" (cr0));
+    return cr0;
+}
+
+static inline void __set_cr0(uint32_t cr0)
+{
+    asm volatile("mov %0, %%cr0" : : "r" (cr0) : "memory");
+}
+
+// Saves the fpu state, fnsave reinitializes the fpu as well.
+static inline void __save(fpu_state_t *state)
+{
+    if (has_fxsr)
+    {
+        asm volatile("fxsave %0" : "=m" (*state));
+    }
+    else
+    {
+        asm volatile("fnsave %0" : "=m" (*state));
+    }
+}
+
+static inline void __restore(fpu_state_t *state)
+{
+    if (has_fxsr)
+    {
+        asm volatile("fxrstor %0" : : "m" (*state));
+    }
+    else
+    {
+        asm volatile("frstor %0" : : "m" (*state));
+    }
+}
+
+// Saves the state of a thread that is switched out if it used the fpu since
+// it was switched in, the next thread traps on its first use.
+void fpu_switch(thread_t *prev)
+{
+    if (prev->fpu_active)
+    {
+        __save(prev->fpu);
+        prev->fpu_active = 0;
+        __set_cr0(__get_cr0() | CR0_TS);
+    }
+}
+
+// Frees the save area of a thread that has exited.
+void fpu_release(thread_t *thread)
+{
+    if (thread->fpu)
+    {
+        pool_free(&state_pool, thread->fpu);
+        thread->fpu = NULL;
+    }
+}
+
+// Ends a user thread that cannot go on with the fpu, the kernel itself must
+// not use it.
+static cpu_state_t* fpu_fail(cpu_state_t *cpu, const char *reason)
+{
+    thread_t *current = thread_current();
+
+    if (current && current->context && (cpu->cs & GDT_RPL_USER))
+    {
+        kprintf("\nthread %u: %s at eip 0x%x\n", current->tid, reason, cpu->eip);
+        thread_mark_exited((void *)-1);
+        return sched_schedule(cpu);
+    }
+
+    kprintf("\n\n%s at eip 0x%x", reason, cpu->eip);
+    PANIC("FPU fault!");
+}
+
+// Device not available, the current thread uses the fpu for the first time
+// since it was switched in. A thread that never used it before starts with
+// the state after reset.
+static cpu_state_t* fpu_callback(cpu_state_t *cpu)
+{
+    thread_t *current = thread_current();
+    uint32_t mxcsr = MXCSR_DEFAULT;
+
+    if (!has_fpu || current == NULL)
+    {
+        return fpu_fail(cpu, "fpu not available");
+    }
+
+    if (current->fpu == NULL)
+    {
+        current->fpu = pool_alloc(&state_pool);
+
+        if (current->fpu == NULL)
+        {
+            return fpu_fail(cpu, "no memory for the fpu state");
+        }
+
+        asm volatile("clts\n\t"
+                     "fninit");
+
+        if (has_sse)
+        {
+            asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+        }
+    }
+    else
+    {
+        asm volatile("clts");
+        __restore(current->fpu);
+    }
+
+    current->fpu_active = 1;
+
+    return cpu;
+}
+
+// x87 errors (#MF) and unmasked SSE errors (#XM).
+static cpu_state_t* fpu_error_callback(cpu_state_t *cpu)
+{
+    return fpu_fail(cpu, cpu->int_no == INT_SIMD_EXCEPTION ?
+        "SSE exception" : "fpu exception");
+}
+
+// Enables the fpu and SSE of the executing cpu, the first use of every
+// thread traps.
+void fpu_init_cpu()
+{
+    uint32_t cr0 = __get_cr0();
+    uint32_t cr4;
+
+    if (!has_fpu)
+    {
+        __set_cr0(cr0 | CR0_EM);
+        return;
+    }
+
+    if (has_fxsr)
+    {
+        asm volatile("mov %%cr4, %0" : "=r" (cr4));
+        cr4 |= CR4_OSFXSR | (has_sse ? CR4_OSXMMEXCPT : 0);
+        asm volatile("mov %0, %%cr4" : : "r" (cr4));
+    }
+
+    __set_cr0((cr0 & ~CR0_EM) | CR0_MP | CR0_NE | CR0_TS);
+}
+
+void fpu_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    has_fpu = (edx & CPUID_EDX_FPU) != 0;
+    has_fxsr = has_fpu && (edx & CPUID_EDX_FXSR);
+    has_sse = has_fxsr && (edx & CPUID_EDX_SSE);
+
+    register_interrupt_handler(INT_COPROCESSOR_NOT_AVL, fpu_callback);
+    register_interrupt_handler(INT_COPROCESSOR_ERROR, fpu_error_callback);
+    register_interrupt_handler(INT_SIMD_EXCEPTION, fpu_error_callback);
+
+    fpu_init_cpu();
+
+    if (has_fpu)
+    {
+        kprintf("fpu: %s, saved with %s\n", has_sse ? "x87 and SSE" : "x87",
+            has_fxsr ? "fxsave" : "fnsave");
+    }
+    else
+    {
+        kprintf("fpu: none\n");
+    }
+}
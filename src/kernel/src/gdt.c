@@ -1,4 +1,8 @@
+#include "gdt.h"
 #include <stdint.h>
+#include <string.h>
+#include "cpu.h"
+#include "smp.h"
 
 /*
 gdt descriptor
@@ -82,7 +86,8 @@ GR  Granularity bit.
     if 1 the limit is in 4 KiB blocks (page granularity).
 */
 
-#define GDT_ENTRIES 5
+#define GDT_ENTRIES 7
+#define ENTRY_STACK_SIZE 1024  // sysenter entry stack per cpu
 
 // granularity
 #define SEG_SIZE(x) ((x) << 0x06)   // size (0: 16 bit, 1: 32 bit)
@@ -121,6 +126,15 @@ GR  Granularity bit.
 
 #define GDT_GRAN_PL3 SEG_SIZE(1) | SEG_GRAN(1)
 
+// 32 bit available TSS, a system segment
+#define GDT_TSS      SEG_TYPE(0) | SEG_PRIV(0) | \
+                     SEG_PRES(1) | 0x09
+
+#define GDT_GRAN_TSS SEG_SIZE(0) | SEG_GRAN(0)
+
+// per-cpu data, byte granular so its limit covers only percpu_t
+#define GDT_GRAN_PCPU SEG_SIZE(1) | SEG_GRAN(0)
+
 
 struct gdt_entry
 {
@@ -133,12 +147,47 @@ struct gdt_entry
 } __attribute__((packed));
 typedef struct gdt_entry gdt_entry_t;
 
+// Task state segment, only used for the stack switch on ring transitions.
+struct tss
+{
+    uint32_t link;
+    uint32_t esp0;
+    uint32_t ss0;
+    uint32_t esp1;
+    uint32_t ss1;
+    uint32_t esp2;
+    uint32_t ss2;
+    uint32_t cr3;
+    uint32_t eip;
+    uint32_t eflags;
+    uint32_t eax, ecx, edx, ebx, esp, ebp, esi, edi;
+    uint32_t es, cs, ss, ds, fs, gs;
+    uint32_t ldt;
+    uint16_t trap;
+    uint16_t iomap_base;
+} __attribute__((packed));
+typedef struct tss tss_t;
+
+// Stack that sysenter switches to. Its top holds a copy of esp0, which the
+// entry code loads first; an NMI or debug exception before that lands on the
+// rest of the stack.
+struct entry_stack
+{
+    uint8_t stack[ENTRY_STACK_SIZE];
+    uint32_t esp0;
+} __attribute__((packed));
+typedef struct entry_stack entry_stack_t;
+
 extern void gdt_reload();
 
-static gdt_entry_t gdt[GDT_ENTRIES];
+// Every cpu has its own gdt, so the same selectors refer to its own TSS and
+// per-cpu data.
+static gdt_entry_t gdts[MAX_CPUS][GDT_ENTRIES];
+static tss_t tss[MAX_CPUS];
+static entry_stack_t entry_stacks[MAX_CPUS];
 
 
-static void gdt_set(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity)
+static void gdt_set(gdt_entry_t *gdt, int i, uint32_t base, uint32_t limit, uint8_t access, uint8_t granularity)
 {
     gdt[i].base_low     = base & 0xFFFF;
     gdt[i].base_middle  = (base >> 16) & 0xFF;
@@ -149,7 +198,7 @@ static void gdt_set(int i, uint32_t base, uint32_t limit, uint8_t access, uint8_
     gdt[i].access       = access;
 }
 
-static void gdt_load()
+static void gdt_load(gdt_entry_t *gdt)
 {
     struct
     {
@@ -163,15 +212,51 @@ static void gdt_load()
 
     asm volatile("lgdt %0" : : "m" (gdtp));
     gdt_reload();
+    asm volatile("ltr %w0" : : "r" (GDT_TSS_SEL));
 }
 
-void gdt_init()
+// Sets up and loads the gdt, TSS and per-cpu data of a cpu.
+void gdt_init_cpu(unsigned cpu)
+{
+    gdt_entry_t *gdt = gdts[cpu];
+    percpu_t *percpu = smp_cpu(cpu);
+
+    percpu->self = percpu;
+    percpu->id = cpu;
+
+    memset(&tss[cpu], 0, sizeof(tss_t));
+    tss[cpu].ss0 = GDT_KERNEL_DATA;
+    tss[cpu].iomap_base = sizeof(tss_t);
+
+    gdt_set(gdt, 0, 0, 0, 0, 0);
+    gdt_set(gdt, 1, 0, 0x000FFFFF, (GDT_CODE_PL0), (GDT_GRAN_PL0));
+    gdt_set(gdt, 2, 0, 0x000FFFFF, (GDT_DATA_PL0), (GDT_GRAN_PL0));
+    gdt_set(gdt, 3, 0, 0x000FFFFF, (GDT_CODE_PL3), (GDT_GRAN_PL3));
+    gdt_set(gdt, 4, 0, 0x000FFFFF, (GDT_DATA_PL3), (GDT_GRAN_PL3));
+    gdt_set(gdt, 5, (uint32_t)&tss[cpu], sizeof(tss_t) - 1,
+        (GDT_TSS), (GDT_GRAN_TSS));
+    gdt_set(gdt, 6, (uint32_t)percpu, sizeof(percpu_t) - 1,
+        (GDT_DATA_PL0), (GDT_GRAN_PCPU));
+
+    gdt_load(gdt);
+}
+
+// Sets the stack the executing cpu switches to when entering ring 0.
+void gdt_set_kernel_stack(uint32_t esp0)
+{
+    unsigned cpu = cpu_id();
+
+    tss[cpu].esp0 = esp0;
+    entry_stacks[cpu].esp0 = esp0;
+}
+
+// Returns the stack pointer sysenter starts with on a cpu, see entry_stack.
+void* gdt_get_entry_stack(unsigned cpu)
 {
-    gdt_set(0, 0, 0, 0, 0);
-    gdt_set(1, 0, 0x000FFFFF, (GDT_CODE_PL0), (GDT_GRAN_PL0));
-    gdt_set(2, 0, 0x000FFFFF, (GDT_DATA_PL0), (GDT_GRAN_PL0));
-    gdt_set(3, 0, 0x000FFFFF, (GDT_CODE_PL3), (GDT_GRAN_PL3));
-    gdt_set(4, 0, 0x000FFFFF, (GDT_DATA_PL3), (GDT_GRAN_PL3));
+    return &entry_stacks[cpu].esp0;
+}
 
-    gdt_load();
+void gdt_init()
+{
+    gdt_init_cpu(0);
 }
@@ -65,6 +65,7 @@ P   Can be set to 0 for unused interrupts or for Paging.
 #define INT_GATE_TRP_32 0xF     // 32 bit trap gate
 
 #define INT_KERNEL (INT_GATE_INT_32 | INT_PRES(1) | INT_PRIV(0))
+#define INT_USER   (INT_GATE_INT_32 | INT_PRES(1) | INT_PRIV(3))
 
 extern void intr0();
 extern void intr1();
@@ -83,7 +84,9 @@ extern void intr13();
 extern void intr14();
 // reserved
 extern void intr16();
-// 17-31 reserved
+// 17-18
+extern void intr19();
+// 20-31 reserved
 extern void intr32();
 extern void intr33();
 extern void intr34();
@@ -102,6 +105,11 @@ extern void intr46();
 extern void intr47();
 // syscall
 extern void intr48();
+// reschedule
+extern void intr49();
+// local APIC
+extern void intr50();
+extern void intr63();
 
 
 struct idt_entry
@@ -165,7 +173,12 @@ void idt_init()
 
     idt_set(16, (uint32_t)intr16, 0x08, INT_KERNEL);
 
-    for (i = 17; i < 32; i++) CAST_ENTRY(idt[i]) = 0; // 17-31 reserved
+    CAST_ENTRY(idt[17]) = 0;
+    CAST_ENTRY(idt[18]) = 0;
+
+    idt_set(19, (uint32_t)intr19, 0x08, INT_KERNEL);
+
+    for (i = 20; i < 32; i++) CAST_ENTRY(idt[i]) = 0; // 20-31 reserved
 
     idt_set(32, (uint32_t)intr32, 0x08, INT_KERNEL);
     idt_set(33, (uint32_t)intr33, 0x08, INT_KERNEL);
@@ -183,9 +196,15 @@ void idt_init()
     idt_set(45, (uint32_t)intr45, 0x08, INT_KERNEL);
     idt_set(46, (uint32_t)intr46, 0x08, INT_KERNEL);
     idt_set(47, (uint32_t)intr47, 0x08, INT_KERNEL);
-    idt_set(48, (uint32_t)intr48, 0x08, INT_KERNEL);
+    idt_set(48, (uint32_t)intr48, 0x08, INT_USER);
+    idt_set(49, (uint32_t)intr49, 0x08, INT_KERNEL);
+    idt_set(50, (uint32_t)intr50, 0x08, INT_KERNEL);
+
+    for (i = 51; i < 63; i++) CAST_ENTRY(idt[i]) = 0;
+
+    idt_set(63, (uint32_t)intr63, 0x08, INT_KERNEL);
 
-    for (i = 49; i < IDT_ENTRIES; i++) CAST_ENTRY(idt[i]) = 0;
+    for (i = 64; i < IDT_ENTRIES; i++) CAST_ENTRY(idt[i]) = 0;
 
     idt_load();
 
@@ -206,3 +225,9 @@ void idt_init()
     outb(0xA0, 0x0);
     asm volatile("sti");
 }
+
+// Loads the shared idt on an application processor.
+void idt_init_cpu()
+{
+    idt_load();
+}
@@ -0,0 +1,80 @@
+#include "initrd.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "pmm.h"
+#include "vfs.h"
+#include "console.h"
+
+// Checks that every entry of an image lies within the image.
+static int initrd_check(uintptr_t start, size_t size)
+{
+    uint32_t i;
+    const initrd_header_t *header = (const initrd_header_t *)start;
+    const initrd_entry_t *entry = (const initrd_entry_t *)(header + 1);
+    const char *name;
+
+    if (size < sizeof(initrd_header_t) || header->magic != INITRD_MAGIC ||
+        header->size > size ||
+        header->count > (size - sizeof(initrd_header_t)) / sizeof(initrd_entry_t))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < header->count; i++, entry++)
+    {
+        if (entry->name >= header->size || entry->offset % INITRD_ALIGN ||
+            entry->offset > header->size ||
+            entry->size > header->size - entry->offset)
+        {
+            return 0;
+        }
+
+        // The name has to be terminated within the image.
+        for (name = (const char *)(start + entry->name); *name; name++)
+        {
+            if ((uintptr_t)name >= start + header->size - 1)
+            {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+// Indexes the files of an initrd image in the direct map. The files point
+// into the image, which has to stay in memory for good.
+int initrd_init(uintptr_t start, size_t size)
+{
+    uint32_t i;
+    const initrd_header_t *header = (const initrd_header_t *)start;
+    const initrd_entry_t *entry = (const initrd_entry_t *)(header + 1);
+    size_t frames;
+    vfs_file_t *files;
+
+    if (!initrd_check(start, size))
+    {
+        return -1;
+    }
+
+    frames = (header->count * sizeof(vfs_file_t) + FRAME_SIZE - 1) / FRAME_SIZE;
+    files = alloc_frame(frames ? frames : 1);
+
+    if ((void *)files == PMM_NO_MEM)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < header->count; i++, entry++)
+    {
+        files[i].path = (const char *)(start + entry->name);
+        files[i].size = entry->size;
+        files[i].data = (const uint8_t *)(start + entry->offset);
+    }
+
+    vfs_register(files, header->count);
+
+    kprintf("initrd: %u files\n", header->count);
+
+    return 0;
+}
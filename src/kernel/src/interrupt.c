@@ -1,19 +1,45 @@
 #include "interrupt.h"
 #include <stdint.h>
 #include "ports.h"
+#include "cpustat.h"
+#include "cpu.h"
+#include "rcu.h"
+#include "spinlock.h"
+#include "trace.h"
 
+// Read under RCU, interrupt handlers run with preemption disabled.
 static interrupt_t interrupt_handlers[256];
+// Serializes writers of interrupt_handlers.
+static spinlock_t handlers_lock = SPINLOCK_INIT("interrupt_handlers");
 
-void interrupt_handler(cpu_state_t cpu)
+// Called by intr_common_handler, returns the cpu state to switch to.
+cpu_state_t* interrupt_handler(cpu_state_t *cpu)
 {
+    unsigned context = CPU_TIME_SOFTIRQ;
+    uint32_t int_no = cpu->int_no;
+    interrupt_t handler;
+
+    // An NMI can hit any other handler halfway through its accounting, so
+    // only its own handler runs.
+    if (cpu->int_no == INT_NONMASKABLE_INT)
+    {
+        handler = rcu_dereference(interrupt_handlers[cpu->int_no]);
+        return handler ? handler(cpu) : cpu;
+    }
+
+    cpustat_enter();
+    TRACE(TRACE_IRQ_ENTRY, int_no, cpu->eip);
+
     // cpu interrupts
-    if (cpu.int_no <= 0x1F)
+    if (cpu->int_no <= 0x1F)
     {
     }
     // hardware interrupts
-    else if (cpu.int_no >= 0x20 && cpu.int_no <= 0x2F)
+    else if (cpu->int_no >= 0x20 && cpu->int_no <= 0x2F)
     {
-        if (cpu.int_no >= 0x28)
+        context = CPU_TIME_IRQ;
+
+        if (cpu->int_no >= 0x28)
         {
             outb(0xA0, 0x20);
         }
@@ -21,16 +47,45 @@ void interrupt_handler(cpu_state_t cpu)
         outb(0x20, 0x20);
     }
 
+    // local APIC interrupts, acknowledged by their handlers
+    else if (cpu->int_no == INT_LAPIC_TIMER)
+    {
+        context = CPU_TIME_IRQ;
+    }
+
     // registered interrupt handlers
-    if (interrupt_handlers[cpu.int_no] != 0)
+    handler = rcu_dereference(interrupt_handlers[cpu->int_no]);
+
+    if (handler != 0)
     {
-        interrupt_handlers[cpu.int_no](cpu);
+        cpu = handler(cpu);
     }
+
+    // The interrupted thread is outside of any read-side section.
+    if (this_cpu()->preempt_count == 0)
+    {
+        rcu_quiescent();
+    }
+
+    // The handler may have switched to another thread's state.
+    TRACE(TRACE_IRQ_EXIT, int_no, 0);
+    cpustat_leave(context);
+
+    return cpu;
 }
 
 void register_interrupt_handler(uint8_t int_no, interrupt_t handler)
 {
-    interrupt_handlers[int_no] = handler;
+    uint32_t eflags = spin_lock_irqsave(&handlers_lock);
+    rcu_assign_pointer(interrupt_handlers[int_no], handler);
+    spin_unlock_irqrestore(&handlers_lock, eflags);
+}
+
+// Removes a handler, no cpu executes it anymore once this returns.
+void unregister_interrupt_handler(uint8_t int_no)
+{
+    register_interrupt_handler(int_no, 0);
+    synchronize_rcu();
 }
 
 void init_interrupt_handler()
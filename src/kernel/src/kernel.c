@@ -1,12 +1,36 @@
 #include "kernel.h"
 #include <stdint.h>
+#include "cpu.h"
 #include "multiboot.h"
 #include "console.h"
+#include "memblock.h"
 #include "pmm.h"
 #include "paging.h"
 #include "gdt.h"
 #include "interrupt.h"
 #include "idt.h"
+#include "timer.h"
+#include "thread.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "syscall.h"
+#include "fpu.h"
+#include "elf.h"
+#include "initrd.h"
+#include "vfs.h"
+#include "pagecache.h"
+#include "block.h"
+#include "pci.h"
+#include "ata.h"
+#include "virtio_blk.h"
+#include "serial.h"
+#include "perf.h"
+#ifdef PROFILE
+#include "profile.h"
+#endif
+#ifdef TRACE_BOOT
+#include "trace.h"
+#endif
 
 // TODO: list
 // - reserve first 4MB?
@@ -16,9 +40,180 @@
 // - seperate section for ro kernel data
 // - multiboot header for asm files
 
+// Timer ticks after which the boot is reported in microseconds.
+#define BOOT_CALIBRATION_TICKS 5
+
+// A step of the boot, see initcalls.
+typedef struct initcall
+{
+    const char *name;
+    void (*function)();
+} initcall_t;
+
+static multiboot_info_t *boot_info;
+
+// Indexes the initrd modules and starts every other module and /init as a
+// user program.
+static void start_modules()
+{
+    uint32_t i;
+    size_t size;
+    uintptr_t start;
+    multiboot_module_t *mod = phys_to_virt(boot_info->mods_addr);
+    vfs_file_t *init;
+
+    for (i = 0; i < boot_info->mods_count; i++, mod++)
+    {
+        size = mod->mod_end - mod->mod_start;
+        start = (uintptr_t)phys_to_virt(mod->mod_start);
+
+        // Modules are used in place, the kernel reaches them in the direct
+        // map only.
+        if (mod->mod_end > DIRECT_MAP_SIZE)
+        {
+            kprintf("module %u: above the direct map\n", i);
+        }
+        else if (initrd_init(start, size) != 0 &&
+            elf_exec(start, size) == NULL)
+        {
+            kprintf("module %u: not started\n", i);
+        }
+    }
+
+    init = vfs_open("/init");
+
+    if (init && elf_exec_file(init) == NULL)
+    {
+        kprintf("/init: not started\n");
+    }
+}
+
+static void boot_memblock()
+{
+    memblock_init(boot_info);
+}
+
+static void boot_console()
+{
+    console_init(boot_info);
+}
+
+static void boot_timer()
+{
+    timer_init(TIMER_FREQUENCY);
+}
+
+#ifdef PROFILE
+// Build with -DPROFILE to profile the rest of the boot and send the samples
+// over the serial port.
+static void boot_profile()
+{
+    if (profile_start(PROFILE_PMC, 0) != 0)
+    {
+        profile_start(PROFILE_TIMER, 0);
+    }
+}
+#endif
+
+#ifdef TRACE_BOOT
+// Build with -DTRACE_BOOT to trace the rest of the boot and send the records
+// over the serial port.
+static void boot_trace()
+{
+    trace_start(TRACE_ALL);
+}
+#endif
+
+// The boot in the order it runs, everything the first user program does not
+// need is set up lazily, like most of the frame bitmap.
+static const initcall_t initcalls[] =
+{
+    { "memblock", boot_memblock },
+    { "pmm", pmm_init },
+    { "paging", paging_init },
+    { "console", boot_console },
+    { "gdt", gdt_init },
+    { "interrupts", init_interrupt_handler },
+    { "idt", idt_init },
+    { "page faults", paging_register_interrupt },
+    { "fpu", fpu_init },
+    { "pagecache", pagecache_init },
+    { "threads", thread_init },
+    { "syscalls", syscall_init },
+    { "timer", boot_timer },
+    { "perf", perf_init },
+    { "smp", smp_init },
+#ifdef PERF_BENCHMARK
+    { "benchmark", perf_benchmark },
+#endif
+#ifdef PROFILE
+    { "profile", boot_profile },
+#endif
+#ifdef TRACE_BOOT
+    { "trace", boot_trace },
+#endif
+    { "pci", pci_init },
+    { "ata", ata_init },
+    { "virtio-blk", virtio_blk_init },
+#ifdef BLOCK_CHECK
+    { "block check", block_check },
+#endif
+    { "modules", start_modules },
+};
+
+#define INITCALLS (sizeof(initcalls) / sizeof(initcalls[0]))
+
+// Time stamps of the boot: when kmain() was entered, the end of every
+// initcall and when the timer started to tick.
+static uint64_t boot_start;
+static uint64_t boot_end[INITCALLS];
+static uint64_t boot_timer_start;
+
+// Prints how long every step of the boot took. The time stamp counter is
+// measured against the timer, which needs a few ticks to be precise; until
+// then the steps are printed in kilocycles.
+static void boot_report()
+{
+    uint64_t ticks = timer_get_ticks64();
+    uint64_t cycles = rdtsc() - boot_timer_start;
+    uint32_t divisor = 1000;
+    const char *unit = "kcycles";
+    uint64_t last = boot_start;
+    unsigned i;
+
+    if (ticks >= BOOT_CALIBRATION_TICKS)
+    {
+        divisor = div64(cycles, ticks * (1000000 / TIMER_FREQUENCY));
+        unit = "us";
+    }
+
+    // The time stamp counter starts at reset, before the firmware runs.
+    kprintf("boot: firmware and loader %u %s\n",
+        (uint32_t)div64(boot_start, divisor), unit);
+
+    for (i = 0; i < INITCALLS; i++)
+    {
+        kprintf("boot: %s %u %s\n", initcalls[i].name,
+            (uint32_t)div64(boot_end[i] - last, divisor), unit);
+        last = boot_end[i];
+    }
+
+    kprintf("boot: total %u %s\n",
+        (uint32_t)div64(last - boot_start, divisor), unit);
+
+    // Locks that were contended during the boot.
+    lockstat_print();
+}
+
 void kmain(uint32_t magic, multiboot_info_t *mb_info)
 {
+    unsigned i;
+
+    boot_start = rdtsc();
+    boot_info = mb_info;
+
     kclear();
+    serial_init();
 
     if (magic != MULTIBOOT_BOOTLOADER_MAGIC)
     {
@@ -33,14 +228,29 @@ void kmain(uint32_t magic, multiboot_info_t *mb_info)
     kprintf("kernel vend    : 0x%x\n", (uint32_t)&kernel_v_end);
     kprintf("kernel offset  : 0x%x\n\n", (uint32_t)&kernel_offset);
 
-    pmm_init(mb_info);
-    paging_init(mb_info);
-    gdt_init();
-    init_interrupt_handler();
-    idt_init();
-    paging_register_interrupt();
+    for (i = 0; i < INITCALLS; i++)
+    {
+        initcalls[i].function();
+        boot_end[i] = rdtsc();
+
+        if (initcalls[i].function == boot_timer)
+        {
+            boot_timer_start = boot_end[i];
+        }
+    }
+
+#ifdef PROFILE
+    profile_stop();
+    profile_dump();
+#endif
+
+#ifdef TRACE_BOOT
+    trace_stop();
+    trace_dump();
+#endif
 
     kprintf("\n");
+    boot_report();
     // test alloc
 
     uint32_t *ptr = (uint32_t *)0x00300000;
@@ -49,7 +259,8 @@ void kmain(uint32_t magic, multiboot_info_t *mb_info)
 
     kprintf("\nend");
 
-    while (1);
+    // The boot thread is done, the idle thread takes over when nothing runs.
+    thread_exit(NULL);
 }
 
 __attribute__((noreturn)) void panic(char *file, int line, char *msg)
@@ -58,7 +269,12 @@ __attribute__((noreturn)) void panic(char *file, int line, char *msg)
 
     kprintf("file: %s\nline: %u\nmsg: %s\n\n", file, line, msg);
 
-    while (1);
+    // Only an NMI can wake the cpu up again.
+    while (1)
+    {
+        asm volatile("cli\n\t"
+                     "hlt");
+    }
 }
 
 
@@ -0,0 +1,260 @@
+#include "memblock.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "kernel.h"
+#include "console.h"
+#include "smp.h"
+
+#define MEMORY_AVAILABLE 1
+
+// Sorted list of blocks that do not overlap or touch.
+typedef struct memblock_type
+{
+    unsigned count;
+    struct
+    {
+        uint64_t base;
+        uint64_t end;
+    } regions[MEMBLOCK_REGIONS];
+} memblock_type_t;
+
+static memblock_type_t memory;
+static memblock_type_t reserved;
+
+static inline uint64_t __max(uint64_t a, uint64_t b)
+{
+    return a > b ? a : b;
+}
+
+static inline uint64_t __min(uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+// Returns the entry after mmap, the entries of the memory map vary in size.
+static inline multiboot_memory_map_t* __mmap_next(multiboot_memory_map_t *mmap)
+{
+    return (void *)((uintptr_t)mmap + mmap->size + sizeof(mmap->size));
+}
+
+// Adds a block to a list, merged with the blocks it overlaps or touches.
+// Returns -1 if the list is full.
+static int region_add(memblock_type_t *type, uint64_t base, uint64_t end)
+{
+    unsigned i = 0, j;
+
+    if (base >= end)
+    {
+        return 0;
+    }
+
+    // The first block that ends at base or later.
+    while (i < type->count && type->regions[i].end < base)
+    {
+        i++;
+    }
+
+    // Every following block that starts at end or earlier is merged.
+    for (j = i; j < type->count && type->regions[j].base <= end; j++)
+    {
+        base = __min(base, type->regions[j].base);
+        end = __max(end, type->regions[j].end);
+    }
+
+    if (i == j && type->count == MEMBLOCK_REGIONS)
+    {
+        return -1;
+    }
+
+    // Blocks i to j - 1 are replaced by the new one.
+    memmove(&type->regions[i + 1], &type->regions[j],
+        (type->count - j) * sizeof(type->regions[0]));
+    type->count += 1 - (j - i);
+    type->regions[i].base = base;
+    type->regions[i].end = end;
+
+    return 0;
+}
+
+// Adds usable memory.
+void memblock_add(uint64_t base, uint64_t size)
+{
+    if (region_add(&memory, base, base + size) != 0)
+    {
+        kprintf("memblock: too many blocks, 0x%x bytes lost\n", (uint32_t)size);
+    }
+}
+
+// Reserves memory, it is never handed out.
+void memblock_reserve(uint64_t base, uint64_t size)
+{
+    if (region_add(&reserved, base, base + size) != 0)
+    {
+        PANIC("Too many reserved memory blocks!");
+    }
+}
+
+// Calls a function for every free block within start and end, in order.
+void memblock_for_each_free(uint64_t start, uint64_t end, memblock_free_t function)
+{
+    uint64_t base, limit;
+    unsigned i, j = 0, k;
+
+    for (i = 0; i < memory.count; i++)
+    {
+        base = __max(memory.regions[i].base, start);
+        limit = __min(memory.regions[i].end, end);
+
+        // Reserved blocks below this one are skipped for good.
+        while (j < reserved.count && reserved.regions[j].end <= base)
+        {
+            j++;
+        }
+
+        for (k = j; base < limit && k < reserved.count &&
+            reserved.regions[k].base < limit; k++)
+        {
+            if (reserved.regions[k].base > base)
+            {
+                function(base, reserved.regions[k].base);
+            }
+
+            base = __max(base, reserved.regions[k].end);
+        }
+
+        if (base < limit)
+        {
+            function(base, limit);
+        }
+    }
+}
+
+// Searches a free block for an aligned allocation within min and max.
+static uint64_t find_free(uint64_t size, uint64_t align, uint64_t min, uint64_t max)
+{
+    uint64_t base, end;
+    unsigned i, j;
+
+    for (i = 0; i < memory.count; i++)
+    {
+        base = __max(memory.regions[i].base, min);
+        end = __min(memory.regions[i].end, max);
+        base = (base + align - 1) & ~(align - 1);
+
+        for (j = 0; j < reserved.count && base + size <= end; j++)
+        {
+            // An overlapping reserved block pushes the allocation past it.
+            if (reserved.regions[j].base < base + size &&
+                reserved.regions[j].end > base)
+            {
+                base = (reserved.regions[j].end + align - 1) & ~(align - 1);
+            }
+        }
+
+        if (base + size <= end)
+        {
+            return base;
+        }
+    }
+
+    return 0;
+}
+
+// Allocates memory that is never freed, aligned on a power of two. The
+// memory lies above 1MB if possible and is mapped during the whole boot.
+// Returns NULL if there is none.
+void* memblock_alloc(size_t size, size_t align)
+{
+    uint64_t base = find_free(size, align, MEMBLOCK_LOW, MEMBLOCK_HIGH);
+
+    if (base == 0)
+    {
+        base = find_free(size, align, 0, MEMBLOCK_LOW);
+    }
+
+    if (base == 0)
+    {
+        return NULL;
+    }
+
+    memblock_reserve(base, size);
+
+    return (void *)(uintptr_t)base;
+}
+
+// Allocates memory that is never freed below max, aligned on a power of
+// two. It is not mapped, the caller has to. Returns the physical address or
+// 0 if there is none.
+uint64_t memblock_alloc_phys(size_t size, size_t align, uint64_t max)
+{
+    uint64_t base = find_free(size, align, MEMBLOCK_LOW, max);
+
+    if (base != 0)
+    {
+        memblock_reserve(base, size);
+    }
+
+    return base;
+}
+
+// Returns the end of the usable memory.
+uint64_t memblock_end()
+{
+    return memory.count ? memory.regions[memory.count - 1].end : 0;
+}
+
+// Collects the usable memory of the memory map and reserves everything in
+// use before the kernel runs. mb_info is a virtual address, the addresses
+// it holds are physical.
+void memblock_init(multiboot_info_t *mb_info)
+{
+    unsigned i;
+    multiboot_module_t *mod = (void *)mb_info->mods_addr;
+    multiboot_memory_map_t *mmap = (void *)mb_info->mmap_addr;
+    multiboot_memory_map_t *mmap_end = (void *)(mb_info->mmap_addr + mb_info->mmap_length);
+
+    kprintf("&multiboot: 0x%x\n", (uintptr_t)mb_info);
+    kprintf("mods_count: %u\n", mb_info->mods_count);
+
+    while (mmap < mmap_end)
+    {
+        if (mmap->type == MEMORY_AVAILABLE)
+        {
+            memblock_add(mmap->addr, mmap->len);
+        }
+
+        mmap = __mmap_next(mmap);
+    }
+
+    // The real mode interrupt table and BIOS data, frame 0 is no address.
+    memblock_reserve(0, 0x1000);
+
+    memblock_reserve((uintptr_t)&kernel_start,
+        (uintptr_t)&kernel_end - (uintptr_t)&kernel_start);
+
+    // Reserve the start up code of the application processors.
+    memblock_reserve(SMP_TRAMPOLINE, 0x1000);
+
+    memblock_reserve((uintptr_t)mb_info - (uintptr_t)&kernel_offset,
+        sizeof(multiboot_info_t));
+    memblock_reserve(mb_info->mmap_addr, mb_info->mmap_length);
+
+    if (mb_info->flags & MULTIBOOT_INFO_CMDLINE)
+    {
+        memblock_reserve(mb_info->cmdline, strlen((char *)mb_info->cmdline) + 1);
+    }
+
+    memblock_reserve(mb_info->mods_addr,
+        mb_info->mods_count * sizeof(multiboot_module_t));
+
+    for (i = 0; i < mb_info->mods_count; i++, mod++)
+    {
+        memblock_reserve(mod->mod_start, mod->mod_end - mod->mod_start);
+
+        if (mod->cmdline)
+        {
+            memblock_reserve(mod->cmdline, strlen((char *)mod->cmdline) + 1);
+        }
+    }
+}
@@ -0,0 +1,394 @@
+#include "pagecache.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "interrupt.h"
+#include "paging.h"
+#include "pmm.h"
+#include "pool.h"
+#include "radix.h"
+#include "spinlock.h"
+#include "vfs.h"
+
+/*
+Page cache
+
+Every page of a file that has been read is kept in the radix tree of the
+file, so read(), mmap() and executables all share the same frame. A page
+mapped into an address space holds a reference to its frame in the pmm.
+
+Reclaim uses two lists. New pages start on the inactive list and move to
+the active list when they are used a second time. Under memory pressure
+alloc_frame() calls pagecache_reclaim(), which refills the inactive list
+from the tail of the active list and frees unused pages from the tail of
+the inactive list. Pages that are pinned or mapped somewhere are skipped.
+Borrowed pages cost no frame of their own and are never on a list, which
+holds for every page of the initrd. Pages of device files are read into
+frames of their own, see block.h.
+*/
+
+typedef struct lru_list
+{
+    cache_page_t *head;     // most recently added
+    cache_page_t *tail;
+    size_t count;
+} lru_list_t;
+
+static pool_t page_pool = POOL_INIT("cache_page", sizeof(cache_page_t));
+// Protects the radix trees of all files, both lists and the page flags.
+static spinlock_t cache_lock = SPINLOCK_INIT("pagecache");
+static lru_list_t active;
+static lru_list_t inactive;
+
+static void lru_add(lru_list_t *list, cache_page_t *page)
+{
+    page->prev = NULL;
+    page->next = list->head;
+
+    if (list->head)
+    {
+        list->head->prev = page;
+    }
+    else
+    {
+        list->tail = page;
+    }
+
+    list->head = page;
+    list->count++;
+}
+
+static void lru_del(lru_list_t *list, cache_page_t *page)
+{
+    if (page->prev)
+    {
+        page->prev->next = page->next;
+    }
+    else
+    {
+        list->head = page->next;
+    }
+
+    if (page->next)
+    {
+        page->next->prev = page->prev;
+    }
+    else
+    {
+        list->tail = page->prev;
+    }
+
+    list->count--;
+}
+
+// Records a use of a page, the second use on the inactive list activates it.
+static void mark_accessed(cache_page_t *page)
+{
+    if (page->flags & CACHE_BORROWED)
+    {
+        return;
+    }
+
+    if ((page->flags & (CACHE_ACTIVE | CACHE_REFERENCED)) == CACHE_REFERENCED)
+    {
+        lru_del(&inactive, page);
+        page->flags = (page->flags & ~CACHE_REFERENCED) | CACHE_ACTIVE;
+        lru_add(&active, page);
+    }
+    else
+    {
+        page->flags |= CACHE_REFERENCED;
+    }
+}
+
+// Number of pages of a file.
+static inline uint32_t __file_pages(vfs_file_t *file)
+{
+    return (file->size + FRAME_SIZE - 1) / FRAME_SIZE;
+}
+
+static void page_destroy(cache_page_t *page)
+{
+    if ((page->flags & CACHE_BORROWED) == 0)
+    {
+        free_frame(page->frame, 1);
+    }
+
+    pool_free(&page_pool, page);
+}
+
+// Reads a page of a file into memory, the page is not in the cache yet.
+// Page aligned data of files that are always in memory is used in place.
+static cache_page_t* page_create(vfs_file_t *file, uint32_t index)
+{
+    uint32_t offset = index * FRAME_SIZE;
+    uint32_t length = file->size - offset < FRAME_SIZE ? file->size - offset : FRAME_SIZE;
+    cache_page_t *page = pool_alloc(&page_pool);
+    void *frame;
+
+    if (page == NULL)
+    {
+        return NULL;
+    }
+
+    page->file = file;
+    page->index = index;
+
+    if (file->data && ((uintptr_t)file->data + offset) % FRAME_SIZE == 0)
+    {
+        page->frame = (uintptr_t)file->data + offset;
+        page->flags = CACHE_BORROWED;
+
+        return page;
+    }
+
+    frame = alloc_frame(1);
+
+    if (frame == PMM_NO_MEM)
+    {
+        pool_free(&page_pool, page);
+        return NULL;
+    }
+
+    if (file->data)
+    {
+        memcpy(frame, file->data + offset, length);
+        memset((uint8_t *)frame + length, 0, FRAME_SIZE - length);
+    }
+    else if (file->read_page(file, index, frame) != 0)
+    {
+        free_frame((uintptr_t)frame, 1);
+        pool_free(&page_pool, page);
+        return NULL;
+    }
+
+    page->frame = (uintptr_t)frame;
+    pmm_page(virt_to_phys(frame))->flags |= PAGE_CACHE;
+
+    return page;
+}
+
+// Adds a new page to the cache and pins it. If another cpu was faster its
+// page is used instead. Returns NULL if there is no memory for the index.
+static cache_page_t* page_insert(cache_page_t *page)
+{
+    cache_page_t *cached;
+    uint32_t eflags = spin_lock_irqsave(&cache_lock);
+
+    cached = radix_lookup(&page->file->pages, page->index);
+
+    if (cached == NULL && radix_insert(&page->file->pages, page->index, page) == 0)
+    {
+        cached = page;
+
+        if ((page->flags & CACHE_BORROWED) == 0)
+        {
+            lru_add(&inactive, page);
+        }
+    }
+
+    if (cached)
+    {
+        cached->pins++;
+    }
+
+    spin_unlock_irqrestore(&cache_lock, eflags);
+
+    if (cached != page)
+    {
+        page_destroy(page);
+    }
+
+    return cached;
+}
+
+// Reads the pages following a missed page. Sequential misses double the
+// window, anything else starts over with the smallest one.
+static void readahead(vfs_file_t *file, uint32_t index)
+{
+    uint32_t i, end;
+    cache_page_t *page;
+    uint32_t eflags = spin_lock_irqsave(&cache_lock);
+
+    if (index == file->ra_next && file->ra_size)
+    {
+        file->ra_size = file->ra_size * 2 < CACHE_RA_MAX ? file->ra_size * 2 : CACHE_RA_MAX;
+    }
+    else
+    {
+        file->ra_size = CACHE_RA_MIN;
+    }
+
+    file->ra_next = index + file->ra_size;
+    end = file->ra_next < __file_pages(file) ? file->ra_next : __file_pages(file);
+
+    spin_unlock_irqrestore(&cache_lock, eflags);
+
+    for (i = index + 1; i < end; i++)
+    {
+        eflags = spin_lock_irqsave(&cache_lock);
+        page = radix_lookup(&file->pages, i);
+        spin_unlock_irqrestore(&cache_lock, eflags);
+
+        if (page)
+        {
+            continue;
+        }
+
+        page = page_create(file, i);
+
+        if (page == NULL || (page = page_insert(page)) == NULL)
+        {
+            break;
+        }
+
+        pagecache_put(page);
+    }
+}
+
+// Returns the pinned page of a file at an index, reading it if it is not
+// cached. NULL if the index is past the end or the page cannot be read.
+cache_page_t* pagecache_get(vfs_file_t *file, uint32_t index)
+{
+    cache_page_t *page;
+    uint32_t eflags;
+
+    if (index >= __file_pages(file))
+    {
+        return NULL;
+    }
+
+    eflags = spin_lock_irqsave(&cache_lock);
+    page = radix_lookup(&file->pages, index);
+
+    if (page)
+    {
+        page->pins++;
+        mark_accessed(page);
+    }
+
+    spin_unlock_irqrestore(&cache_lock, eflags);
+
+    if (page)
+    {
+        return page;
+    }
+
+    page = page_create(file, index);
+
+    if (page == NULL || (page = page_insert(page)) == NULL)
+    {
+        return NULL;
+    }
+
+    // Files in memory are never read, there is nothing to gain.
+    if (file->data == NULL)
+    {
+        readahead(file, index);
+    }
+
+    return page;
+}
+
+// Unpins a page returned by pagecache_get().
+void pagecache_put(cache_page_t *page)
+{
+    uint32_t eflags = spin_lock_irqsave(&cache_lock);
+
+    page->pins--;
+
+    spin_unlock_irqrestore(&cache_lock, eflags);
+}
+
+// Unpins the cached page of a file at an index.
+void pagecache_release(vfs_file_t *file, uint32_t index)
+{
+    cache_page_t *page;
+    uint32_t eflags = spin_lock_irqsave(&cache_lock);
+
+    page = radix_lookup(&file->pages, index);
+
+    if (page)
+    {
+        page->pins--;
+    }
+
+    spin_unlock_irqrestore(&cache_lock, eflags);
+}
+
+// Frees up to a number of unused pages, returns how many frames were freed.
+// Called by alloc_frame(), possibly with the cache lock held by this cpu,
+// so it gives up instead of waiting for the lock.
+size_t pagecache_reclaim(size_t frames)
+{
+    size_t scan;
+    size_t freed = 0;
+    cache_page_t *page;
+    cache_page_t *victims = NULL;
+    uint32_t eflags = irq_save();
+
+    if (!spin_trylock(&cache_lock))
+    {
+        irq_restore(eflags);
+        return 0;
+    }
+
+    // Keep the inactive list at least as long as the active one, active
+    // pages that were used since the last scan get another round.
+    for (scan = active.count; scan && active.count > inactive.count; scan--)
+    {
+        page = active.tail;
+        lru_del(&active, page);
+
+        if (page->flags & CACHE_REFERENCED)
+        {
+            page->flags &= ~CACHE_REFERENCED;
+            lru_add(&active, page);
+        }
+        else
+        {
+            page->flags &= ~CACHE_ACTIVE;
+            lru_add(&inactive, page);
+        }
+    }
+
+    for (scan = inactive.count; scan && freed < frames; scan--)
+    {
+        page = inactive.tail;
+        lru_del(&inactive, page);
+
+        if (page->pins || pmm_frame_refs(virt_to_phys((void *)page->frame)) > 1)
+        {
+            lru_add(&inactive, page);
+        }
+        else if (page->flags & CACHE_REFERENCED)
+        {
+            page->flags = (page->flags & ~CACHE_REFERENCED) | CACHE_ACTIVE;
+            lru_add(&active, page);
+        }
+        else
+        {
+            radix_delete(&page->file->pages, page->index);
+            page->next = victims;
+            victims = page;
+            freed++;
+        }
+    }
+
+    spin_unlock(&cache_lock);
+    irq_restore(eflags);
+
+    while (victims)
+    {
+        page = victims;
+        victims = page->next;
+        page_destroy(page);
+    }
+
+    return freed;
+}
+
+void pagecache_init()
+{
+    pmm_set_reclaim(pagecache_reclaim);
+}
@@ -4,17 +4,42 @@
 #include "kernel.h"
 #include "multiboot.h"
 #include "pmm.h"
+#include "memblock.h"
 #include "interrupt.h"
 #include "console.h"
+#include "cpu.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "thread.h"
+#include "uaccess.h"
+#include "pagecache.h"
+#include "vfs.h"
+#include "trace.h"
 
 /*
+PAE paging
+
+cr3 points to a table of four page directory pointers, one per GB. Page
+directories and page tables hold 512 entries of 64 bits, which address 64GB
+of physical memory:
+
+    31  30|29           21|20           12|11                 0
+    +-----+---------------+---------------+--------------------+
+    | PDPT|   directory   |     table     |       offset       |
+    +-----+---------------+---------------+--------------------+
+
+Entries of the page directory pointer table hold the frame address and the
+present bit only, every other bit is reserved.
 
 directory entry & table entry
-    31              12|11        9|                                 0
-    +---+---/~/---+---+---+---+---+---+---+---+---+---+---+---+---+---+
-    |  Frame Address  |   AVAIL   |  PD / PT  | A | C | W | U | R | P |
-    +---+---/~/---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    63  62      36|35             12|11        9|                                 0
+    +----+---/~/---+---+---/~/---+---+---+---+---+---+---+---+---+---+---+---+---+---+
+    | NX |    0    |  Frame Address  |   AVAIL   |  PD / PT  | A | C | W | U | R | P |
+    +----+---/~/---+---+---/~/---+---+---+---+---+---+---+---+---+---+---+---+---+---+
 
+NX  No execute, instruction fetches from the page fault. Reserved unless
+    EFER.NXE is set, see paging_init_cpu().
 P   If the bit is set, the page is actually in physical memory at the moment.
 R   Read/Write permissions flag.
     If the bit is set, the page is read/write. Otherwise the page is read-only.
@@ -26,7 +51,8 @@ W   Write-Through abilities of the page.
 C   Cache Disable bit. If the bit is set, the page will not be cached.
 A   Accessed bit, used to discover whether a page has been read or written to.
 AVAIL
-    Available for software use.
+    Available for software use. Bit 9 marks copy-on-write pages, bit 10
+    frames that are borrowed from somewhere else and must not be freed.
 
 PD
       2       0
@@ -36,7 +62,7 @@ PD
 
 G   Global, ignored if size 4 KiB. Otherwise the same as PT Global.
 S   Page Size, stores the page size for that specific entry.
-    If the bit is set, then pages are 4 MiB in size. Otherwise, they are 4 KiB.
+    If the bit is set, then pages are 2 MiB in size. Otherwise, they are 4 KiB.
 0   Ignored if size 4 KiB. Otherwise set to 1 if the CPU writes to.
 
 PT
@@ -57,11 +83,27 @@ D   If the Dirty flag is set, then the page has been written to. This flag is
 #define PE_USER     0x04
 #define PE_WRITE    0x08
 #define PE_CACHE_D  0x10
+#define PE_WC       PE_WRITE    // PAT entry 1, write combining
 #define PE_ACCESSED 0x20
-#define PE_FRAME    0xFFFFF000
+#define PE_FRAME    0x0000000FFFFFF000ULL
+#define PE_COW      0x200
+#define PE_BORROWED 0x400
+#define PE_NX       0x8000000000000000ULL
+
+/*
+Page attribute table
+
+The PWT, PCD and PAT bits of an entry select one of eight memory types in
+MSR_PAT. The power on value repeats WB, WT, UC-, UC, entry 1 (PWT alone)
+becomes write combining so PE_WC mappings combine their stores into full
+bus bursts. Every cpu has to use the same table.
+*/
+
+#define PAT_WC      0x01
+#define PAT_ENTRY1  8
 
 // page directory entry only
-#define PDE_SIZE    0x40
+#define PDE_SIZE    0x80
 
 // page table entry only
 #define PTE_DIRTY   0x40
@@ -69,33 +111,113 @@ D   If the Dirty flag is set, then the page has been written to. This flag is
 
 // other definitions
 #define PAGE_SIZE 0x1000
-#define PD_SIZE 0x400
-#define PT_SIZE 0x400
-#define PD_RSHIFT 22
+#define PAGE_MASK 0xFFFFF000
+#define PDPT_SIZE 4
+#define PD_SIZE 0x200
+#define PT_SIZE 0x200
+#define PDPT_RSHIFT 30
+#define PD_RSHIFT 21
 #define PT_RSHIFT 12
 
-typedef uint32_t* page_table_t;
-typedef uint32_t* page_directory_t;
+/*
+Kernel GB
+
+    0xC0000000                          0xF8000000        0xFFE00000
+    |------------ direct map -------------|---- devices ----|-- kmap --|
+
+Physical memory is mapped linearly with 2MB pages from 0 on, up to its end
+or DIRECT_MAP_SIZE. The kernel image, the frame descriptors and every frame
+of alloc_frame() lie at their physical address plus kernel_offset, so page
+tables are cleared and edited there without a temporary mapping. Devices
+are mapped one after the other behind the direct map and only frames above
+it need a window of kmap().
+*/
+
+#define LARGE_PAGE_SIZE 0x200000
+
+// Device window, see paging_map_mmio().
+#define MMIO_BASE   0xF8000000
+
+// Two windows per cpu in the last page table, see kmap().
+#define KMAP_BASE   0xFFE00000
+#define KMAP_SLOTS  2
 
-typedef struct vmm_context
+// page fault error code
+#define PF_PRESENT  0x01
+#define PF_WRITE    0x02
+#define PF_USER     0x04
+
+#define EFLAGS_IF   0x200
+
+#define CR0_WP      0x00010000
+#define CR0_PG      0x80000000
+
+typedef uint64_t pte_t;
+typedef pte_t* page_table_t;
+typedef pte_t* page_directory_t;
+
+#define VMM_REGIONS 32
+
+// Part of user space that is mapped on demand when it is first touched.
+typedef struct vmm_region
+{
+    uint32_t start;         // first address, 0 marks an unused slot
+    uint32_t end;           // first address after the region
+    uint32_t flags;         // VMM_WRITE, VMM_EXEC
+    uint32_t source;        // physical address of the data at start
+    uint32_t source_size;   // bytes of data, the rest of the region is zero
+    vfs_file_t *file;       // file the data comes from instead, if any
+    uint32_t offset;        // offset of the data at start in the file
+} vmm_region_t;
+
+// Contexts are page aligned, which the table in cr3 needs to be on 32 bytes.
+// The page fault handler takes the lock of a context as well, so every other
+// path must take it with interrupts off.
+struct vmm_context
 {
-    page_directory_t page_directory;
-} vmm_context_t;
+    pte_t pdpt[PDPT_SIZE];
+    page_directory_t page_directories[PDPT_SIZE];
+    spinlock_t lock;    // protects the user part of the page directories
+    vmm_region_t regions[VMM_REGIONS];
+    uint32_t cpus;      // cpus that have the context loaded, one bit each
+    struct vmm_context *next;
+};
 
 static vmm_context_t *kernel_context;
 
+// User contexts, compaction only moves frames of the ones on this list.
+static vmm_context_t *contexts;
+static spinlock_t contexts_lock = SPINLOCK_INIT("vmm_contexts");
+
+// Context loaded on each cpu.
+static vmm_context_t *loaded[MAX_CPUS];
+
+// Page table of the kmap() windows.
+static page_table_t kmap_table;
+
+// End of the physical memory in the direct map.
+static phys_addr_t direct_end;
+
+// Next free address of the device window.
+static uint32_t mmio_next = MMIO_BASE;
+
+// PE_NX if the cpu supports it, set on user pages that hold no code.
+static pte_t pe_nx;
+
 // Aligns an address on a multiple of PAGE_SIZE, rounding up.
 static inline uint32_t __align_up(uint32_t addr)
 {
-    return (addr + ~PE_FRAME) & PE_FRAME;
+    return (addr + ~PAGE_MASK) & PAGE_MASK;
 }
 
 // Aligns an address on a multiple of PAGE_SIZE, rounding down.
 static inline uint32_t __align_down(uint32_t addr)
 {
-    return addr & PE_FRAME;
+    return addr & PAGE_MASK;
 }
 
+// Index of the directory entry of an address, counted over all four page
+// directories.
 static inline unsigned __get_pd_idx(uint32_t addr)
 {
     return addr >> PD_RSHIFT;
@@ -103,14 +225,105 @@ static inline unsigned __get_pd_idx(uint32_t addr)
 
 static inline unsigned __get_pt_idx(uint32_t addr)
 {
-    return (addr >> PT_RSHIFT) & ~PE_FRAME;
+    return (addr >> PT_RSHIFT) & (PT_SIZE - 1);
+}
+
+// Returns a directory entry by the index of __get_pd_idx().
+static inline pte_t* __get_pde(vmm_context_t *context, unsigned pd_idx)
+{
+    return &context->page_directories[pd_idx / PD_SIZE][pd_idx % PD_SIZE];
+}
+
+// Returns the page table of a directory entry, in the direct map.
+static inline page_table_t __get_pt(pte_t pde)
+{
+    return phys_to_virt(pde & PE_FRAME);
+}
+
+// No execute bit of a user page, unless the region holds code.
+static inline pte_t __get_nx(uint32_t flags)
+{
+    return flags & VMM_EXEC ? 0 : pe_nx;
+}
+
+// Records the only mapping of a private user frame, compaction may move it.
+static inline void __set_movable(phys_addr_t frame, vmm_context_t *context, uint32_t v_addr)
+{
+    page_t *page = pmm_page(frame);
+
+    page->owner = context;
+    page->index = v_addr;
+    page->flags |= PAGE_MOVABLE;
+}
+
+// Whether [addr, addr + pages * PAGE_SIZE) lies within user space.
+static inline int __is_user_range(uint32_t addr, size_t pages)
+{
+    return addr >= USER_START && addr < USER_END &&
+        pages <= (USER_END - addr) / PAGE_SIZE;
+}
+
+static inline uint32_t __get_page_directory()
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+    return cr3;
+}
+
+// Drops a page from the TLB if the context is the one in use on this cpu.
+// Other cpus cannot hold the entry, see vmm_activate().
+static inline void __invalidate(vmm_context_t *context, uint32_t v_addr)
+{
+    if (__get_page_directory() == virt_to_phys(context->pdpt))
+    {
+        asm volatile("invlpg %0" : : "m" (*(uint8_t *)v_addr) : "memory");
+    }
+}
+
+// Returns a frame in the direct map or maps it at a window of the executing
+// cpu, frames above the direct map are not reached otherwise. The thread
+// keeps the cpu until kunmap().
+static void* kmap(phys_addr_t frame, unsigned slot)
+{
+    uint32_t v_addr;
+
+    this_cpu()->preempt_count++;
+    barrier();
+
+    if (frame < direct_end)
+    {
+        return phys_to_virt(frame);
+    }
+
+    v_addr = KMAP_BASE + (cpu_id() * KMAP_SLOTS + slot) * PAGE_SIZE;
+    kmap_table[__get_pt_idx(v_addr)] = frame | PE_RW | PE_PRESENT | pe_nx;
+    asm volatile("invlpg %0" : : "m" (*(uint8_t *)v_addr) : "memory");
+
+    return (void *)v_addr;
+}
+
+// Removes a window of kmap(), the direct map stays as it is.
+static void kunmap(void *addr)
+{
+    if ((uint32_t)addr >= KMAP_BASE)
+    {
+        kmap_table[__get_pt_idx((uint32_t)addr)] = 0;
+        asm volatile("invlpg %0" : : "m" (*(uint8_t *)addr) : "memory");
+    }
+
+    barrier();
+    this_cpu()->preempt_count--;
 }
 
+// Returns a cleared page directory, PMM_NO_MEM if memory has run out.
 static page_directory_t create_page_directory()
 {
     page_directory_t pd = alloc_frame(1);
 
-    memset(pd, 0, PAGE_SIZE);
+    if ((void *)pd != PMM_NO_MEM)
+    {
+        memset(pd, 0, PAGE_SIZE);
+    }
 
     return pd;
 }
@@ -124,62 +337,133 @@ static page_table_t create_page_table()
     return pt;
 }
 
-static void map_page(vmm_context_t *context, uint32_t v_addr, uint32_t p_addr)
+// Returns the page table entry of an address, the page table is created if
+// it is missing and create is set. NULL if there is none.
+static pte_t* get_page_entry(vmm_context_t *context, uint32_t v_addr, int create)
+{
+    pte_t *pde = __get_pde(context, __get_pd_idx(v_addr));
+    page_table_t pt;
+
+    if ((*pde & PE_PRESENT) == 0)
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+
+        pt = alloc_frame(1);
+
+        if ((void *)pt == PMM_NO_MEM)
+        {
+            return NULL;
+        }
+
+        memset(pt, 0, PAGE_SIZE);
+
+        // Access is checked by the page table entries of user space.
+        *pde = virt_to_phys(pt) | PE_PRESENT | PE_RW |
+            (v_addr >= USER_START && v_addr < USER_END ? PE_USER : 0);
+    }
+
+    pt = __get_pt(*pde);
+
+    return &pt[__get_pt_idx(v_addr)];
+}
+
+static void map_page(vmm_context_t *context, uint32_t v_addr, uint32_t p_addr, pte_t flags)
 {
-    // TODO: flags
-    unsigned pd_idx = __get_pd_idx(v_addr);
     unsigned pt_idx = __get_pt_idx(v_addr);
-    page_directory_t pd = context->page_directory;
-    page_table_t pt = (uint32_t *)(pd[pd_idx] & PE_FRAME);
+    pte_t *pde = __get_pde(context, __get_pd_idx(v_addr));
+    page_table_t pt;
 
-    if ((pd[pd_idx] & PE_PRESENT) == 0)
+    if ((*pde & PE_PRESENT) == 0)
     {
         pt = create_page_table();
-        pd[pd_idx] = (uint32_t)pt | PE_RW | PE_PRESENT;
+        *pde = virt_to_phys(pt) | PE_RW | PE_PRESENT;
     }
 
-    if (pt[pt_idx] & PE_PRESENT)
+    pt = __get_pt(*pde);
+
+    if ((*pde & PDE_SIZE) || (pt[pt_idx] & PE_PRESENT))
     {
         PANIC("Already mapped!");
     }
 
-    pt[pt_idx] = ((uint32_t)p_addr) | PE_PRESENT; // (flags & ~PE_FRAME)
-
-    // TODO: flush the entry in the TLB, if paging is already activated
+    pt[pt_idx] = p_addr | (flags & ~PE_FRAME) | PE_PRESENT;
+    TRACE(TRACE_MAP_PAGE, v_addr, p_addr);
 
     // i486 and later only!
-    // asm volatile("invlpg %0" : : "memory" (*(uint8_t *)v_addr));
+    asm volatile("invlpg %0" : : "m" (*(uint8_t *)v_addr) : "memory");
 }
 
-static void map_memory(vmm_context_t *context, uint32_t v_addr_start, uint32_t p_addr_start, uint32_t p_addr_end)
+// Maps physical memory at kernel_offset with 2MB pages, up to the end of
+// the memory or DIRECT_MAP_SIZE. Only the pages of the kernel image hold
+// code.
+static void map_direct(vmm_context_t *context)
 {
-    p_addr_start = __align_down(p_addr_start);
-    v_addr_start = __align_down(v_addr_start);
-    p_addr_end = __align_up(p_addr_end);
+    uint64_t end = memblock_end();
+    uint32_t p_addr;
+    pte_t nx;
 
-    while (p_addr_start < p_addr_end)
+    end = (end + LARGE_PAGE_SIZE - 1) & ~(uint64_t)(LARGE_PAGE_SIZE - 1);
+    direct_end = end < DIRECT_MAP_SIZE ? end : DIRECT_MAP_SIZE;
+
+    for (p_addr = 0; p_addr < direct_end; p_addr += LARGE_PAGE_SIZE)
     {
-        map_page(context, v_addr_start, p_addr_start);
-        v_addr_start += PAGE_SIZE;
-        p_addr_start += PAGE_SIZE;
+        nx = p_addr < (uintptr_t)&kernel_end &&
+            p_addr + LARGE_PAGE_SIZE > (uintptr_t)&kernel_start ? 0 : pe_nx;
+
+        *__get_pde(context, __get_pd_idx(p_addr + (uintptr_t)&kernel_offset)) =
+            p_addr | PDE_SIZE | PE_RW | PE_PRESENT | nx;
     }
 }
 
+// Maps device memory at the next free pages of the device window. Returns
+// the address of p_addr there, NULL if the window is full.
+static void* map_device(uintptr_t p_addr, size_t size, pte_t flags)
+{
+    uint32_t offset = p_addr & ~PAGE_MASK;
+    size_t pages = (offset + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t v_addr;
+    size_t i;
+
+    spin_lock(&kernel_context->lock);
+
+    if (pages > (KMAP_BASE - mmio_next) / PAGE_SIZE)
+    {
+        spin_unlock(&kernel_context->lock);
+        return NULL;
+    }
+
+    v_addr = mmio_next;
+    mmio_next += pages * PAGE_SIZE;
+
+    for (i = 0; i < pages; i++)
+    {
+        map_page(kernel_context, v_addr + i * PAGE_SIZE,
+            __align_down(p_addr) + i * PAGE_SIZE, flags);
+    }
+
+    spin_unlock(&kernel_context->lock);
+
+    return (void *)(v_addr + offset);
+}
+
 static void identity_map(vmm_context_t *context, uint32_t p_addr_start, uint32_t p_addr_end)
 {
     p_addr_start = __align_down(p_addr_start);
     p_addr_end = __align_up(p_addr_end);
     unsigned pd_idx = __get_pd_idx(p_addr_start);
     unsigned pt_idx = __get_pt_idx(p_addr_start);
-    page_directory_t pd = context->page_directory;
-    page_table_t pt = (uint32_t *)(pd[pd_idx] & PE_FRAME);
+    pte_t *pde = __get_pde(context, pd_idx);
+    page_table_t pt = __get_pt(*pde);
 
     while (p_addr_start < p_addr_end)
     {
-        if ((pd[pd_idx] & PE_PRESENT) == 0)
+        if ((*pde & PE_PRESENT) == 0)
         {
             pt = create_page_table();
-            pd[pd_idx] = (uint32_t)pt | PE_RW | PE_PRESENT;
+            *pde = virt_to_phys(pt) | PE_RW | PE_PRESENT;
         }
 
         pt[pt_idx] = p_addr_start | PE_RW | PE_PRESENT;
@@ -188,7 +472,8 @@ static void identity_map(vmm_context_t *context, uint32_t p_addr_start, uint32_t
         if (++pt_idx >= PT_SIZE)
         {
             pt_idx = 0;
-            pd_idx++;
+            pde = __get_pde(context, ++pd_idx);
+            pt = __get_pt(*pde);
         }
     }
 }
@@ -210,23 +495,799 @@ static void identity_map(vmm_context_t *context, uint32_t p_addr_start, uint32_t
 
 static inline void __switch_page_directory(vmm_context_t *context)
 {
-    asm volatile("mov %0, %%cr3" : : "r" (context->page_directory));
+    asm volatile("mov %0, %%cr3" : : "r" (virt_to_phys(context->pdpt)) : "memory");
 }
 
 static void activate_paging()
 {
     uint32_t cr0;
     asm volatile("mov %%cr0, %0" : "=r" (cr0));
-    cr0 |= 0x80000000;
+    // Write protect makes the kernel fault on copy-on-write pages as well.
+    cr0 |= CR0_PG | CR0_WP;
     asm volatile("mov %0, %%cr0" : : "r" (cr0));
 }
 
-static void page_fault_callback(cpu_state_t cpu)
+// Takes the locks of two contexts, always in the same order, with
+// interrupts off. Returns the previous eflags.
+static uint32_t lock_contexts(vmm_context_t *a, vmm_context_t *b)
+{
+    uint32_t eflags = irq_save();
+
+    if (a == b)
+    {
+        spin_lock(&a->lock);
+    }
+    else if (a < b)
+    {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    }
+    else
+    {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+
+    return eflags;
+}
+
+static void unlock_contexts(vmm_context_t *a, vmm_context_t *b, uint32_t eflags)
+{
+    spin_unlock(&a->lock);
+
+    if (a != b)
+    {
+        spin_unlock(&b->lock);
+    }
+
+    irq_restore(eflags);
+}
+
+// Frees the page directories a context owns, the last one is the kernel's.
+static void free_page_directories(vmm_context_t *context)
+{
+    unsigned i;
+
+    for (i = 0; i < PDPT_SIZE - 1; i++)
+    {
+        if (context->page_directories[i])
+        {
+            free_frame((uintptr_t)context->page_directories[i], 1);
+        }
+    }
+}
+
+// Creates an address space with an empty user part. The page directory of
+// the kernel GB is shared with the kernel context, the identity mapped
+// memory below USER_START is copied: page tables the kernel creates there
+// later on are not seen by this context.
+vmm_context_t* vmm_create_context()
+{
+    unsigned i;
+    vmm_context_t *context = alloc_frame(1);
+    page_directory_t pd;
+    uint32_t eflags;
+
+    if ((void *)context == PMM_NO_MEM)
+    {
+        return NULL;
+    }
+
+    memset(context, 0, sizeof(vmm_context_t));
+    context->lock.name = "vmm_context";
+
+    for (i = 0; i < PDPT_SIZE - 1; i++)
+    {
+        pd = create_page_directory();
+
+        if ((void *)pd == PMM_NO_MEM)
+        {
+            free_page_directories(context);
+            free_frame((uintptr_t)context, 1);
+            return NULL;
+        }
+
+        context->page_directories[i] = pd;
+        context->pdpt[i] = virt_to_phys(pd) | PE_PRESENT;
+    }
+
+    context->page_directories[i] = kernel_context->page_directories[i];
+    context->pdpt[i] = kernel_context->pdpt[i];
+
+    for (i = 0; i < __get_pd_idx(USER_START); i++)
+    {
+        *__get_pde(context, i) = *__get_pde(kernel_context, i);
+    }
+
+    eflags = spin_lock_irqsave(&contexts_lock);
+    context->next = contexts;
+    contexts = context;
+    spin_unlock_irqrestore(&contexts_lock, eflags);
+
+    return context;
+}
+
+// Frees an address space and every frame of its user part that is no longer
+// mapped anywhere else. The context must not be active on any cpu.
+void vmm_destroy_context(vmm_context_t *context)
+{
+    unsigned pd_idx, pt_idx;
+    pte_t *pde;
+    page_table_t pt;
+    phys_addr_t frame;
+    vmm_context_t **link;
+    uint32_t eflags;
+
+    // Compaction must not find it anymore before its frames are freed.
+    eflags = spin_lock_irqsave(&contexts_lock);
+
+    for (link = &contexts; *link != context; link = &(*link)->next)
+    {
+    }
+
+    *link = context->next;
+    spin_unlock_irqrestore(&contexts_lock, eflags);
+
+    for (pd_idx = __get_pd_idx(USER_START); pd_idx < __get_pd_idx(USER_END); pd_idx++)
+    {
+        pde = __get_pde(context, pd_idx);
+
+        if ((*pde & PE_PRESENT) == 0)
+        {
+            continue;
+        }
+
+        pt = __get_pt(*pde);
+
+        for (pt_idx = 0; pt_idx < PT_SIZE; pt_idx++)
+        {
+            frame = pt[pt_idx] & PE_FRAME;
+
+            if ((pt[pt_idx] & PE_PRESENT) == 0 || (pt[pt_idx] & PE_BORROWED))
+            {
+                continue;
+            }
+
+            if (pmm_frame_unshare(frame) == 0)
+            {
+                free_high_frame(frame);
+            }
+        }
+
+        free_frame((uintptr_t)pt, 1);
+    }
+
+    free_page_directories(context);
+    free_frame((uintptr_t)context, 1);
+}
+
+// Switches the executing cpu to an address space, NULL for the kernel one.
+// User contexts are always reloaded: page table changes only invalidate the
+// TLB of the cpu that makes them, so a context must not stay loaded on a cpu
+// that runs something else in the meantime. A context is marked as loaded
+// before cr3 points to it and unmarked after cr3 has moved on, see
+// migrate_page().
+void vmm_activate(vmm_context_t *context)
+{
+    unsigned cpu = cpu_id();
+    vmm_context_t *prev = loaded[cpu];
+
+    if (context == NULL)
+    {
+        if (__get_page_directory() == virt_to_phys(kernel_context->pdpt))
+        {
+            return;
+        }
+
+        context = kernel_context;
+    }
+
+    if (prev != context)
+    {
+        atomic_or(&context->cpus, 1u << cpu);
+    }
+
+    __switch_page_directory(context);
+
+    if (prev && prev != context)
+    {
+        atomic_and(&prev->cpus, ~(1u << cpu));
+    }
+
+    loaded[cpu] = context;
+}
+
+// Maps a page into an address space, it holds no code without VMM_EXEC.
+int vmm_map(vmm_context_t *context, uintptr_t v_addr, phys_addr_t p_addr, uint32_t flags)
+{
+    pte_t *pte;
+    int result = 0;
+    uint32_t eflags = spin_lock_irqsave(&context->lock);
+
+    pte = get_page_entry(context, v_addr, 1);
+
+    if (pte == NULL)
+    {
+        result = VMM_ENOMEM;
+    }
+    else if (*pte & PE_PRESENT)
+    {
+        result = VMM_EEXIST;
+    }
+    else
+    {
+        *pte = (p_addr & PE_FRAME) | (flags & ~(PAGE_MASK | VMM_EXEC)) |
+            PE_PRESENT | __get_nx(flags);
+    }
+
+    spin_unlock_irqrestore(&context->lock, eflags);
+
+    return result;
+}
+
+// Adds a region, backed by physical memory or by a file.
+static int add_region(vmm_context_t *context, uintptr_t start, size_t size, uint32_t flags, vmm_region_t *source)
+{
+    unsigned i;
+    vmm_region_t *free_region = NULL;
+    vmm_region_t *region;
+    int result = 0;
+    uint32_t eflags;
+
+    if (size == 0 || start < USER_START || start >= USER_END ||
+        size > USER_END - start)
+    {
+        return VMM_EINVAL;
+    }
+
+    eflags = spin_lock_irqsave(&context->lock);
+
+    for (i = 0; i < VMM_REGIONS; i++)
+    {
+        region = &context->regions[i];
+
+        if (region->start == 0)
+        {
+            free_region = free_region ? free_region : region;
+        }
+        else if (__align_down(start) < __align_up(region->end) &&
+            __align_down(region->start) < __align_up(start + size))
+        {
+            // Regions must not share a page.
+            result = VMM_EEXIST;
+        }
+    }
+
+    if (result == 0 && free_region == NULL)
+    {
+        result = VMM_ENOMEM;
+    }
+
+    if (result == 0)
+    {
+        *free_region = *source;
+        free_region->start = start;
+        free_region->end = start + size;
+        free_region->flags = flags & (VMM_WRITE | VMM_EXEC);
+
+        if (free_region->source_size > size)
+        {
+            free_region->source_size = size;
+        }
+    }
+
+    spin_unlock_irqrestore(&context->lock, eflags);
+
+    return result;
+}
+
+// Adds a region that is mapped page by page on first access. The first
+// source_size bytes come from the physical memory at source, frames of it
+// that are only read are mapped directly and never freed by the context.
+int vmm_add_region(vmm_context_t *context, uintptr_t start, size_t size, uint32_t flags, uintptr_t source, size_t source_size)
+{
+    vmm_region_t region = { .source = source, .source_size = source_size };
+
+    return add_region(context, start, size, flags, &region);
+}
+
+// Adds a region whose first file_size bytes come from a file at offset,
+// through the page cache. Offset and start must have the same position
+// within a page.
+int vmm_add_file_region(vmm_context_t *context, uintptr_t start, size_t size, uint32_t flags, struct vfs_file *file, size_t offset, size_t file_size)
+{
+    vmm_region_t region = { .file = file, .offset = offset, .source_size = file_size };
+
+    if ((start ^ offset) & ~PAGE_MASK)
+    {
+        return VMM_EINVAL;
+    }
+
+    return add_region(context, start, size, flags, &region);
+}
+
+// Returns the region an address belongs to, NULL if there is none.
+static vmm_region_t* find_region(vmm_context_t *context, uint32_t v_addr)
+{
+    unsigned i;
+    vmm_region_t *region;
+
+    for (i = 0; i < VMM_REGIONS; i++)
+    {
+        region = &context->regions[i];
+
+        if (region->start && v_addr >= __align_down(region->start) &&
+            v_addr < __align_up(region->end))
+        {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+// Part of a page of a region that holds data from its source, there is
+// none if start is not below end.
+static inline void __region_data(vmm_region_t *region, uint32_t page, uint32_t *start, uint32_t *end)
+{
+    *start = page > region->start ? page : region->start;
+    *end = region->start + region->source_size;
+    *end = *end < page + PAGE_SIZE ? *end : page + PAGE_SIZE;
+}
+
+// Index of the file page that holds the data of a page of a region.
+static inline uint32_t __region_index(vmm_region_t *region, uint32_t page)
+{
+    return (region->offset + page - region->start) / PAGE_SIZE;
+}
+
+// Returns the pinned page cache page a fault on a file region needs, NULL
+// if it needs none or it cannot be read. Reading the page may sleep, so it
+// is done without the context lock and with interrupts on if the faulting
+// code had them on.
+static cache_page_t* fault_file_page(vmm_context_t *context, uint32_t v_addr, uint32_t eflags)
+{
+    vmm_region_t *region;
+    vfs_file_t *file = NULL;
+    uint32_t page = __align_down(v_addr);
+    uint32_t data_start, data_end, index = 0;
+    cache_page_t *cached;
+
+    spin_lock(&context->lock);
+
+    region = find_region(context, v_addr);
+
+    if (region && region->file)
+    {
+        __region_data(region, page, &data_start, &data_end);
+
+        if (data_start < data_end)
+        {
+            file = region->file;
+            index = __region_index(region, page);
+        }
+    }
+
+    spin_unlock(&context->lock);
+
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    if (eflags & EFLAGS_IF)
+    {
+        asm volatile("sti");
+    }
+
+    cached = pagecache_get(file, index);
+    asm volatile("cli");
+
+    return cached;
+}
+
+// Maps the page of a region an address belongs to. A page that is fully
+// backed by an aligned frame and only read uses that frame, a write to it
+// copies it later on. Frames of the page cache are reference counted,
+// physical memory is borrowed. Every other page gets a private frame.
+// Pages of files come from cached, see fault_file_page().
+static int handle_region_fault(vmm_context_t *context, uint32_t v_addr, int write, cache_page_t *cached)
+{
+    vmm_region_t *region = find_region(context, v_addr);
+    uint32_t page = __align_down(v_addr);
+    uint32_t data_start, data_end;
+    uint32_t source = 0;    // kernel address of the data
+    uint32_t borrowed = PE_BORROWED;
+    pte_t *pte;
+    phys_addr_t frame;
+    uint8_t *page_data;
+
+    if (region == NULL || (write && (region->flags & VMM_WRITE) == 0))
+    {
+        return -1;
+    }
+
+    pte = get_page_entry(context, page, 1);
+
+    if (pte == NULL)
+    {
+        return VMM_ENOMEM;
+    }
+
+    if (*pte & PE_PRESENT)
+    {
+        return 0;
+    }
+
+    __region_data(region, page, &data_start, &data_end);
+
+    if (data_start < data_end && region->file)
+    {
+        if (cached == NULL)
+        {
+            return VMM_ENOMEM;
+        }
+
+        // The region changed while the page was read, the access faults
+        // again.
+        if (cached->file != region->file ||
+            cached->index != __region_index(region, page))
+        {
+            return 0;
+        }
+
+        source = cached->frame + (data_start - page);
+        borrowed = cached->flags & CACHE_BORROWED ? PE_BORROWED : 0;
+    }
+    else if (data_start < data_end)
+    {
+        source = (uint32_t)phys_to_virt(region->source + (data_start - region->start));
+    }
+
+    if (!write && data_start == page && data_end == page + PAGE_SIZE &&
+        (source & ~PAGE_MASK) == 0 &&
+        (borrowed || pmm_frame_share(virt_to_phys((void *)source))))
+    {
+        *pte = virt_to_phys((void *)source) | PE_PRESENT | PE_USER | borrowed |
+            (region->flags & VMM_WRITE ? PE_COW : 0) | __get_nx(region->flags);
+    }
+    else if ((frame = alloc_high_frame()) != PMM_NO_FRAME)
+    {
+        page_data = kmap(frame, 0);
+        memset(page_data, 0, PAGE_SIZE);
+
+        if (data_start < data_end)
+        {
+            memcpy(page_data + (data_start - page), (void *)source, data_end - data_start);
+        }
+
+        kunmap(page_data);
+
+        *pte = frame | PE_PRESENT | PE_USER | (region->flags & VMM_WRITE) |
+            __get_nx(region->flags);
+        __set_movable(frame, context, page);
+    }
+
+    return *pte & PE_PRESENT ? 0 : VMM_ENOMEM;
+}
+
+// Copies the contents of a frame to another one, both are mapped with
+// kmap().
+static void copy_frame_to(phys_addr_t to, phys_addr_t from)
+{
+    void *src = kmap(from, 0);
+    void *dest = kmap(to, 1);
+
+    memcpy(dest, src, PAGE_SIZE);
+    kunmap(dest);
+    kunmap(src);
+}
+
+// Copies a frame to a new one. Returns PMM_NO_FRAME if memory has run out.
+static phys_addr_t copy_frame(phys_addr_t frame)
+{
+    phys_addr_t copy = alloc_high_frame();
+
+    if (copy != PMM_NO_FRAME)
+    {
+        copy_frame_to(copy, frame);
+    }
+
+    return copy;
+}
+
+// Hands one page over to another context. Frames that cannot be tracked as
+// shared are copied for copy-on-write and refused otherwise.
+static int transfer_page(vmm_context_t *src, uint32_t src_addr, pte_t *src_pte, vmm_context_t *dst, uint32_t dst_addr, pte_t *dst_pte, int mode)
+{
+    pte_t entry = *src_pte;
+    phys_addr_t frame = entry & PE_FRAME;
+    phys_addr_t copy;
+
+    if (mode == VMM_MOVE)
+    {
+        *dst_pte = entry;
+        *src_pte = 0;
+        __invalidate(src, src_addr);
+
+        if ((entry & PE_BORROWED) == 0 && (pmm_page(frame)->flags & PAGE_MOVABLE))
+        {
+            __set_movable(frame, dst, dst_addr);
+        }
+
+        return 0;
+    }
+
+    if ((entry & PE_BORROWED) == 0 && pmm_frame_share(frame) == 0)
+    {
+        if (mode == VMM_SHARE)
+        {
+            return VMM_ENOMEM;
+        }
+
+        copy = copy_frame(frame);
+
+        if (copy == PMM_NO_FRAME)
+        {
+            return VMM_ENOMEM;
+        }
+
+        *dst_pte = copy | (entry & ~(PE_FRAME | PE_COW)) |
+            (entry & PE_COW ? PE_RW : 0);
+        __set_movable(copy, dst, dst_addr);
+
+        return 0;
+    }
+
+    // A shared page that is already copy-on-write stays that way.
+    if (mode == VMM_COW && (entry & PE_RW))
+    {
+        entry = (entry & ~PE_RW) | PE_COW;
+        *src_pte = entry;
+        __invalidate(src, src_addr);
+    }
+
+    *dst_pte = entry;
+
+    return 0;
+}
+
+// Moves or shares whole pages between two address spaces by remapping them,
+// no data is copied. The source context must be inactive or the one of the
+// calling cpu. Nothing is changed if a page is missing in the source or
+// present in the destination.
+int vmm_transfer(vmm_context_t *src, uintptr_t src_addr, vmm_context_t *dst, uintptr_t dst_addr, size_t pages, int mode)
+{
+    size_t i;
+    pte_t *src_pte, *dst_pte;
+    uint32_t offset, eflags;
+    int result = 0;
+
+    if ((src_addr | dst_addr) & ~PAGE_MASK || mode < VMM_MOVE ||
+        mode > VMM_COW || !__is_user_range(src_addr, pages) ||
+        !__is_user_range(dst_addr, pages))
+    {
+        return VMM_EINVAL;
+    }
+
+    if (src == dst && src_addr < dst_addr + pages * PAGE_SIZE &&
+        dst_addr < src_addr + pages * PAGE_SIZE)
+    {
+        return VMM_EINVAL;
+    }
+
+    eflags = lock_contexts(src, dst);
+
+    for (i = 0; i < pages && result == 0; i++)
+    {
+        offset = i * PAGE_SIZE;
+        src_pte = get_page_entry(src, src_addr + offset, 0);
+        dst_pte = get_page_entry(dst, dst_addr + offset, 1);
+
+        if (src_pte == NULL || (*src_pte & PE_PRESENT) == 0 ||
+            (*src_pte & PE_USER) == 0)
+        {
+            result = VMM_EFAULT;
+        }
+        else if (dst_pte == NULL)
+        {
+            result = VMM_ENOMEM;
+        }
+        else if (*dst_pte & PE_PRESENT)
+        {
+            result = VMM_EEXIST;
+        }
+    }
+
+    for (i = 0; i < pages && result == 0; i++)
+    {
+        offset = i * PAGE_SIZE;
+        src_pte = get_page_entry(src, src_addr + offset, 0);
+        dst_pte = get_page_entry(dst, dst_addr + offset, 0);
+
+        result = transfer_page(src, src_addr + offset, src_pte,
+            dst, dst_addr + offset, dst_pte, mode);
+    }
+
+    unlock_contexts(src, dst, eflags);
+
+    return result;
+}
+
+// Gives the faulting context its own writable copy of a copy-on-write page.
+// Returns 0 if the fault has been resolved.
+static int handle_cow_fault(vmm_context_t *context, uint32_t v_addr)
+{
+    pte_t *pte = get_page_entry(context, v_addr, 0);
+    phys_addr_t frame, copy;
+
+    if (pte == NULL || (*pte & (PE_PRESENT | PE_COW)) != (PE_PRESENT | PE_COW))
+    {
+        return -1;
+    }
+
+    frame = *pte & PE_FRAME;
+
+    // Borrowed frames are never written, other mappings may be gone already.
+    if ((*pte & PE_BORROWED) == 0 && pmm_frame_refs(frame) == 1)
+    {
+        *pte = (*pte & ~PE_COW) | PE_RW;
+        __invalidate(context, v_addr);
+        __set_movable(frame, context, __align_down(v_addr));
+
+        return 0;
+    }
+
+    copy = copy_frame(frame);
+
+    if (copy == PMM_NO_FRAME)
+    {
+        return VMM_ENOMEM;
+    }
+
+    // Another context may have copied it in the meantime as well.
+    if ((*pte & PE_BORROWED) == 0 && pmm_frame_unshare(frame) == 0)
+    {
+        free_high_frame(frame);
+    }
+
+    *pte = copy | (*pte & ~(PE_FRAME | PE_COW | PE_BORROWED)) | PE_RW;
+    __invalidate(context, v_addr);
+    __set_movable(copy, context, __align_down(v_addr));
+
+    return 0;
+}
+
+// Moves a private user frame for compaction, see pmm_set_migrate(). The
+// entry is cleared while the frame is copied, a cpu that touches the page
+// in the meantime faults and waits for the context lock. A context that is
+// loaded on another cpu may still have the entry in its TLB and is skipped.
+// Interrupts are off from the first lock on, the context lock is taken by the
+// page fault handler and this cpu must not change while the entry is clear.
+static int migrate_page(page_t *page, phys_addr_t to)
+{
+    phys_addr_t from = pmm_page_addr(page);
+    uint32_t v_addr = page->index;
+    vmm_context_t *context;
+    pte_t *pte, entry;
+    uint32_t eflags;
+    int result = -1;
+
+    eflags = spin_lock_irqsave(&contexts_lock);
+
+    for (context = contexts; context && context != page->owner; context = context->next)
+    {
+    }
+
+    if (context == NULL)
+    {
+        spin_unlock_irqrestore(&contexts_lock, eflags);
+        return -1;
+    }
+
+    spin_lock(&context->lock);
+
+    pte = get_page_entry(context, v_addr, 0);
+
+    if (pte && (*pte & (PE_PRESENT | PE_BORROWED)) == PE_PRESENT &&
+        (*pte & PE_FRAME) == from && pmm_frame_refs(from) == 1)
+    {
+        entry = *pte;
+        *pte = 0;
+        __invalidate(context, v_addr);
+        mb();
+
+        if (context->cpus & ~(1u << cpu_id()))
+        {
+            *pte = entry;
+        }
+        else
+        {
+            copy_frame_to(to, from);
+            *pte = (entry & ~PE_FRAME) | to;
+            __invalidate(context, v_addr);
+
+            __set_movable(to, context, v_addr);
+            page->flags &= ~PAGE_MOVABLE;
+            result = 0;
+        }
+    }
+
+    spin_unlock(&context->lock);
+    spin_unlock_irqrestore(&contexts_lock, eflags);
+
+    return result;
+}
+
+// Resolves faults on user space that are part of the design, demand paging
+// and copy-on-write. Returns 0 if the access can be retried.
+static int handle_user_fault(vmm_context_t *context, uint32_t v_addr, cpu_state_t *cpu)
+{
+    uint32_t error = cpu->error;
+    cache_page_t *cached = NULL;
+    int result;
+
+    if ((error & PF_PRESENT) == 0)
+    {
+        cached = fault_file_page(context, v_addr, cpu->eflags);
+    }
+
+    spin_lock(&context->lock);
+
+    if (error & PF_PRESENT)
+    {
+        result = error & PF_WRITE ? handle_cow_fault(context, v_addr) : -1;
+    }
+    else
+    {
+        result = handle_region_fault(context, v_addr, error & PF_WRITE, cached);
+    }
+
+    spin_unlock(&context->lock);
+
+    if (cached)
+    {
+        pagecache_put(cached);
+    }
+
+    return result;
+}
+
+static cpu_state_t* page_fault_callback(cpu_state_t *cpu)
 {
     uint32_t addr;
+    uintptr_t fixup;
+    thread_t *current = thread_current();
+    vmm_context_t *context = current ? current->context : NULL;
     asm volatile("mov %%cr2, %0" : "=r" (addr));
+    TRACE(TRACE_PAGE_FAULT, addr, cpu->error);
+
+    if (context && __is_user_range(addr, 1) &&
+        handle_user_fault(context, addr, cpu) == 0)
+    {
+        return cpu;
+    }
 
-    kprintf("\n\npage fault (0x%x) at 0x%x", cpu.error, addr);
+    if ((cpu->error & PF_USER) == 0)
+    {
+        // copy_from_user() and friends continue at their fixup code.
+        fixup = search_exception_table(cpu->eip);
+
+        if (fixup)
+        {
+            cpu->eip = fixup;
+            return cpu;
+        }
+    }
+    else if (context)
+    {
+        kprintf("\nthread %u: page fault (0x%x) at 0x%x, eip 0x%x\n",
+            current->tid, cpu->error, addr, cpu->eip);
+        thread_mark_exited((void *)-1);
+        return sched_schedule(cpu);
+    }
+
+    kprintf("\n\npage fault (0x%x) at 0x%x", cpu->error, addr);
     PANIC("Page fault!");
 }
 
@@ -235,29 +1296,106 @@ void paging_register_interrupt()
     register_interrupt_handler(INT_PAGE_FAULT, page_fault_callback);
 }
 
-void paging_init(multiboot_info_t *mb_info)
+// Maps memory mapped device registers uncached in the device window.
+// Returns their address, NULL if the window is full.
+void* paging_map_mmio(uintptr_t p_addr, size_t size)
+{
+    return map_device(p_addr, size, PE_RW | PE_CACHE_D | pe_nx);
+}
+
+// Maps a framebuffer write combining in the device window, without PAT it
+// is write through. Returns its address, NULL if the window is full.
+void* paging_map_wc(uintptr_t p_addr, size_t size)
 {
+    return map_device(p_addr, size, PE_RW | PE_WC | pe_nx);
+}
+
+// Enables the no execute bit and programs the page attribute table of the
+// executing cpu.
+void paging_init_cpu()
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t pat;
+
+    if (pe_nx)
+    {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+
+    if ((edx & CPUID_EDX_PAT) == 0)
+    {
+        return;
+    }
+
+    pat = rdmsr(MSR_PAT);
+    pat &= ~(0xFFULL << PAT_ENTRY1);
+    pat |= (uint64_t)PAT_WC << PAT_ENTRY1;
+
+    asm volatile("wbinvd" : : : "memory");
+    wrmsr(MSR_PAT, pat);
+    asm volatile("wbinvd" : : : "memory");
+}
+
+// Whether the cpu supports the no execute bit.
+static int nx_supported()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(CPUID_EXTENDED, &eax, &ebx, &ecx, &edx);
+
+    if (eax < CPUID_EXT_FEATURES)
+    {
+        return 0;
+    }
+
+    cpuid(CPUID_EXT_FEATURES, &eax, &ebx, &ecx, &edx);
+
+    return (edx & CPUID_EXT_EDX_NX) != 0;
+}
+
+void paging_init()
+{
+    unsigned i;
+    page_directory_t pd;
+
+    pe_nx = nx_supported() ? PE_NX : 0;
+
+    // The page directories of the kernel exist from the start, user
+    // contexts share the last one.
     kernel_context = alloc_frame(1);
-    page_directory_t pd = create_page_directory();
-    kernel_context->page_directory = pd;
+    memset(kernel_context, 0, sizeof(vmm_context_t));
+    kernel_context->lock.name = "vmm_context";
 
-    // TODO: Map the page directory.
+    for (i = 0; i < PDPT_SIZE; i++)
+    {
+        pd = create_page_directory();
+        kernel_context->page_directories[i] = pd;
+        kernel_context->pdpt[i] = virt_to_phys(pd) | PE_PRESENT;
+    }
 
-    map_memory(kernel_context, (uintptr_t)&kernel_v_start,
-        (uintptr_t)&kernel_start, (uintptr_t)&kernel_end);
+    // The kernel image, the multiboot information and the frame
+    // descriptors are part of the direct map.
+    map_direct(kernel_context);
 
     identity_map(kernel_context, pmm_get_bitmap(),
         pmm_get_bitmap() + pmm_get_bitmap_size());
 
-    map_memory(kernel_context, (uintptr_t)mb_info,
-        (uintptr_t)mb_info - (uintptr_t)&kernel_offset,
-        (uintptr_t)mb_info - (uintptr_t)&kernel_offset +
-            sizeof(multiboot_info_t));
-
     identity_map(kernel_context, 0x0, 0x00400000);
 //    identity_map(kernel_context, 0xB8000, 0xBFFFF);
 
+    kmap_table = create_page_table();
+    *__get_pde(kernel_context, __get_pd_idx(KMAP_BASE)) =
+        virt_to_phys(kmap_table) | PE_RW | PE_PRESENT;
+
+    // The loader already enabled PAE, NX must be on before the new tables
+    // are used.
+    paging_init_cpu();
     __switch_page_directory(kernel_context);
 
     activate_paging();
+    pmm_init_direct(direct_end);
+    pmm_init_pages();
+    pmm_set_migrate(migrate_page);
 }
@@ -0,0 +1,164 @@
+#include "pci.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "console.h"
+#include "ports.h"
+#include "spinlock.h"
+
+// The address and data ports form one transaction.
+static spinlock_t config_lock = SPINLOCK_INIT("pci_config");
+
+// Filled once by pci_init(), read only afterwards.
+static pci_device_t devices[PCI_MAX_DEVICES];
+static unsigned device_count;
+
+static inline uint32_t __config_address(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    return 0x80000000 | (bus << 16) | ((slot & 0x1F) << 11) |
+        ((func & 0x07) << 8) | (offset & 0xFC);
+}
+
+// Reads a dword of the configuration space of a function.
+uint32_t pci_config_read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset)
+{
+    uint32_t value;
+    uint32_t eflags = spin_lock_irqsave(&config_lock);
+
+    outl(PCI_CONFIG_ADDRESS, __config_address(bus, slot, func, offset));
+    value = inl(PCI_CONFIG_DATA);
+
+    spin_unlock_irqrestore(&config_lock, eflags);
+
+    return value;
+}
+
+// Writes a dword of the configuration space of a function.
+void pci_config_write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value)
+{
+    uint32_t eflags = spin_lock_irqsave(&config_lock);
+
+    outl(PCI_CONFIG_ADDRESS, __config_address(bus, slot, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+
+    spin_unlock_irqrestore(&config_lock, eflags);
+}
+
+// Sets bits of the command register of a function.
+void pci_enable(pci_device_t *device, uint16_t command)
+{
+    // The upper half is the status register, its bits are cleared by
+    // writing them.
+    uint32_t value = pci_config_read(device->bus, device->slot, device->func, PCI_COMMAND);
+
+    pci_config_write(device->bus, device->slot, device->func, PCI_COMMAND,
+        (value & 0xFFFF) | command);
+}
+
+// Returns the first function of a class, NULL if there is none.
+pci_device_t* pci_find_class(uint8_t class, uint8_t subclass)
+{
+    unsigned i;
+
+    for (i = 0; i < device_count; i++)
+    {
+        if (devices[i].class == class && devices[i].subclass == subclass)
+        {
+            return &devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Returns the first function with a vendor and device id, NULL if there is
+// none.
+pci_device_t* pci_find_device(uint16_t vendor, uint16_t device)
+{
+    unsigned i;
+
+    for (i = 0; i < device_count; i++)
+    {
+        if (devices[i].vendor == vendor && devices[i].device == device)
+        {
+            return &devices[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Reads the header of a function into the device table, returns whether
+// there is a function at the address.
+static int pci_probe(uint8_t bus, uint8_t slot, uint8_t func)
+{
+    uint32_t id = pci_config_read(bus, slot, func, PCI_VENDOR_ID);
+    uint32_t class;
+    pci_device_t *device;
+    unsigned i;
+
+    if ((id & 0xFFFF) == 0xFFFF)
+    {
+        return 0;
+    }
+
+    if (device_count == PCI_MAX_DEVICES)
+    {
+        return 1;
+    }
+
+    device = &devices[device_count++];
+    class = pci_config_read(bus, slot, func, PCI_CLASS);
+
+    device->bus = bus;
+    device->slot = slot;
+    device->func = func;
+    device->vendor = id & 0xFFFF;
+    device->device = id >> 16;
+    device->subsystem = pci_config_read(bus, slot, func, PCI_SUBSYSTEM) >> 16;
+    device->class = class >> 24;
+    device->subclass = (class >> 16) & 0xFF;
+    device->prog_if = (class >> 8) & 0xFF;
+    device->irq = pci_config_read(bus, slot, func, PCI_INTERRUPT_LINE) & 0xFF;
+
+    if (device->irq >= 16)
+    {
+        device->irq = PCI_IRQ_NONE;
+    }
+
+    for (i = 0; i < 6; i++)
+    {
+        device->bar[i] = pci_config_read(bus, slot, func, PCI_BAR0 + 4 * i);
+    }
+
+    kprintf("pci %u:%u.%u: %x:%x class %x:%x irq %u\n", bus, slot, func,
+        device->vendor, device->device, device->class, device->subclass,
+        device->irq);
+
+    return 1;
+}
+
+// Enumerates the functions on all buses.
+void pci_init()
+{
+    unsigned bus, slot, func;
+
+    for (bus = 0; bus < 256; bus++)
+    {
+        for (slot = 0; slot < 32; slot++)
+        {
+            if (!pci_probe(bus, slot, 0))
+            {
+                continue;
+            }
+
+            // Only multi function devices decode the other functions.
+            if ((pci_config_read(bus, slot, 0, PCI_HEADER_TYPE) >> 16) & PCI_HEADER_MULTI)
+            {
+                for (func = 1; func < 8; func++)
+                {
+                    pci_probe(bus, slot, func);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,283 @@
+#include "perf.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "atomic.h"
+#include "console.h"
+#include "cpu.h"
+#include "pmm.h"
+
+// cpuid leaf 0 and 1
+#define CPUID_VENDOR_INTEL  0x756E6547  // "Genu" of "GenuineIntel" in ebx
+#define CPUID_FAMILY(eax)   (((eax) >> 8) & 0xF)
+
+static const char *event_names[PERF_EVENTS] =
+{
+    "tsc", "cycles", "instructions", "llc-misses", "dtlb-misses",
+    "branch-misses"
+};
+
+// Event select of an event on a general counter.
+static const uint32_t event_selects[PERF_EVENTS] =
+{
+    [PERF_CYCLES] = PERFEVTSEL_CYCLES,
+    [PERF_INSTRUCTIONS] = PERFEVTSEL_INSTRUCTIONS,
+    [PERF_LLC_MISSES] = PERFEVTSEL_LLC_MISSES,
+    [PERF_DTLB_MISSES] = PERFEVTSEL_DTLB_MISSES,
+    [PERF_BRANCH_MISSES] = PERFEVTSEL_BRANCH_MISSES
+};
+
+// Bit of an architectural event in ebx of cpuid leaf 0xA.
+static const uint32_t event_missing[PERF_EVENTS] =
+{
+    [PERF_CYCLES] = CPUID_PMU_NO_CYCLES,
+    [PERF_INSTRUCTIONS] = CPUID_PMU_NO_INSTRUCTIONS,
+    [PERF_LLC_MISSES] = CPUID_PMU_NO_LLC_MISSES,
+    [PERF_BRANCH_MISSES] = CPUID_PMU_NO_BRANCH_MISSES
+};
+
+// Set up by perf_init() on the bootstrap processor, the other cpus program
+// their counters the same way.
+static uint32_t events = 1 << PERF_TSC;
+static uint32_t counters[PERF_EVENTS];  // rdpmc index of an event
+static uint64_t masks[PERF_EVENTS] = { [PERF_TSC] = ~0ULL };
+static uint32_t fixed_ctrl;
+static uint64_t global_ctrl;            // 0 while no fixed counter is used
+
+static inline uint64_t __width_mask(unsigned width)
+{
+    return width >= 64 ? ~0ULL : (1ULL << width) - 1;
+}
+
+// Returns the events that are counted, PERF_TSC always is.
+uint32_t perf_events()
+{
+    return events;
+}
+
+// Reads the counters at the start of a scope. The scope must not sleep,
+// the thread keeps the cpu until perf_end().
+void perf_begin(perf_t *perf)
+{
+    unsigned i;
+
+    this_cpu()->preempt_count++;
+    barrier();
+
+    for (i = PERF_CYCLES; i < PERF_EVENTS; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            perf->start[i] = rdpmc(counters[i]);
+        }
+    }
+
+    perf->start[PERF_TSC] = rdtsc();
+}
+
+// Adds what the counters counted since perf_begin() to the totals.
+void perf_end(perf_t *perf)
+{
+    uint64_t now[PERF_EVENTS];
+    unsigned i;
+
+    now[PERF_TSC] = rdtsc();
+
+    for (i = PERF_CYCLES; i < PERF_EVENTS; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            now[i] = rdpmc(counters[i]);
+        }
+    }
+
+    barrier();
+    this_cpu()->preempt_count--;
+
+    for (i = 0; i < PERF_EVENTS; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            perf->total[i] += (now[i] - perf->start[i]) & masks[i];
+        }
+    }
+}
+
+// Prints the totals of the counted events divided by the number of runs.
+void perf_print(const char *name, const perf_t *perf, uint32_t runs)
+{
+    unsigned i;
+
+    kprintf("%s:", name);
+
+    for (i = 0; i < PERF_EVENTS; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            kprintf(" %s %u", event_names[i],
+                (uint32_t)div64(perf->total[i], runs ? runs : 1));
+        }
+    }
+
+    kprintf("\n");
+}
+
+// Lets the counters of this cpu count the events perf_init() chose.
+void perf_init_cpu()
+{
+    unsigned i;
+
+    for (i = PERF_CYCLES; i < PERF_EVENTS; i++)
+    {
+        if (((events >> i) & 1) && (counters[i] & RDPMC_FIXED) == 0)
+        {
+            wrmsr(MSR_PERFEVTSEL0 + counters[i], event_selects[i] |
+                PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN);
+        }
+    }
+
+    if (global_ctrl)
+    {
+        wrmsr(MSR_FIXED_CTR_CTRL, fixed_ctrl);
+        wrmsr(MSR_PERF_GLOBAL_CTRL, global_ctrl);
+    }
+}
+
+// Assigns a fixed counter to an event.
+static void perf_use_fixed(unsigned event, unsigned counter, unsigned width)
+{
+    events |= 1 << event;
+    counters[event] = RDPMC_FIXED | counter;
+    masks[event] = __width_mask(width);
+    fixed_ctrl |= FIXED_CTR_OS(counter) | FIXED_CTR_USR(counter);
+    global_ctrl |= FIXED_CTR_GLOBAL(counter);
+}
+
+// Detects the performance monitoring unit and assigns the events to its
+// counters.
+void perf_init()
+{
+    uint32_t eax, ebx, ecx, edx, vendor, family, missing;
+    unsigned general, width, next = 1, i;
+
+    cpuid(0, &eax, &vendor, &ecx, &edx);
+
+    if (eax < CPUID_PMU)
+    {
+        kprintf("perf: no performance counters, tsc only\n");
+        return;
+    }
+
+    cpuid(1, &family, &ebx, &ecx, &edx);
+    cpuid(CPUID_PMU, &eax, &ebx, &ecx, &edx);
+
+    general = CPUID_PMU_COUNTERS(eax);
+    width = CPUID_PMU_WIDTH(eax);
+
+    if (CPUID_PMU_VERSION(eax) == 0 || general == 0)
+    {
+        kprintf("perf: no performance counters, tsc only\n");
+        return;
+    }
+
+    // Events beyond the length of the ebx vector are missing too.
+    missing = ebx;
+
+    if (CPUID_PMU_EVENTS(eax) < 32)
+    {
+        missing |= ~((1u << CPUID_PMU_EVENTS(eax)) - 1);
+    }
+
+    if (CPUID_PMU_VERSION(eax) >= 2 && CPUID_PMU_FIXED(edx) > FIXED_CTR_CYCLES)
+    {
+        perf_use_fixed(PERF_INSTRUCTIONS, FIXED_CTR_INSTRUCTIONS,
+            CPUID_PMU_FIXED_WIDTH(edx));
+        perf_use_fixed(PERF_CYCLES, FIXED_CTR_CYCLES,
+            CPUID_PMU_FIXED_WIDTH(edx));
+
+        // The profiler keeps using general counter 0.
+        global_ctrl |= __width_mask(general);
+    }
+
+    for (i = PERF_CYCLES; i < PERF_EVENTS && next < general; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            continue;
+        }
+
+        if (i == PERF_DTLB_MISSES ?
+            vendor != CPUID_VENDOR_INTEL || CPUID_FAMILY(family) != 6 :
+            (missing & event_missing[i]) != 0)
+        {
+            continue;
+        }
+
+        events |= 1 << i;
+        counters[i] = next++;
+        masks[i] = __width_mask(width);
+    }
+
+    kprintf("perf: version %u, %u counters, counting",
+        CPUID_PMU_VERSION(eax), general);
+
+    for (i = 0; i < PERF_EVENTS; i++)
+    {
+        if ((events >> i) & 1)
+        {
+            kprintf(" %s", event_names[i]);
+        }
+    }
+
+    kprintf("\n");
+
+    perf_init_cpu();
+}
+
+#ifdef PERF_BENCHMARK
+#define BENCHMARK_FRAMES 16
+#define BENCHMARK_RUNS 16
+
+// Measures memcpy, memset and alloc_frame() and prints the counts per run.
+void perf_benchmark()
+{
+    perf_t copy = PERF_INIT, set = PERF_INIT, alloc = PERF_INIT;
+    size_t size = BENCHMARK_FRAMES * FRAME_SIZE;
+    uint8_t *src = alloc_frame(BENCHMARK_FRAMES);
+    uint8_t *dest = alloc_frame(BENCHMARK_FRAMES);
+    void *frame;
+    unsigned run;
+
+    if ((void *)src == PMM_NO_MEM || (void *)dest == PMM_NO_MEM)
+    {
+        return;
+    }
+
+    for (run = 0; run < BENCHMARK_RUNS; run++)
+    {
+        perf_begin(&set);
+        memset(src, run, size);
+        perf_end(&set);
+
+        perf_begin(&copy);
+        memcpy(dest, src, size);
+        perf_end(&copy);
+
+        perf_begin(&alloc);
+        frame = alloc_frame(1);
+        perf_end(&alloc);
+
+        if (frame != PMM_NO_MEM)
+        {
+            free_frame((uintptr_t)frame, 1);
+        }
+    }
+
+    perf_print("memset 64kB", &set, BENCHMARK_RUNS);
+    perf_print("memcpy 64kB", &copy, BENCHMARK_RUNS);
+    perf_print("alloc_frame", &alloc, BENCHMARK_RUNS);
+
+    free_frame((uintptr_t)src, BENCHMARK_FRAMES);
+    free_frame((uintptr_t)dest, BENCHMARK_FRAMES);
+}
+#endif
@@ -1,32 +1,99 @@
 #include "pmm.h"
 #include <stdint.h>
 #include <string.h>
-#include "multiboot.h"
 #include "kernel.h"
 #include "console.h"
+#include "memblock.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "trace.h"
 
-#define FRAME_SIZE 0x1000
 #define ELEMENT_SIZE (8 * sizeof(uint_fast32_t))
 #define FRAME_MASK ~(FRAME_SIZE - 1)
+#define MAX_FRAMES 0x1000000    // 64GB, the 36 address bits of PAE
+#define NO_FRAME 0xFFFFFFFF
+
+// End of the memory the kernel addresses directly during the boot, the
+// boot page tables map it at kernel_offset.
+#define BOOT_DIRECT_END USER_START
+
+// The descriptors lie in the direct map, at their physical address plus
+// kernel_offset. Those of 64GB take 256MB.
+#define PAGES_LIMIT DIRECT_MAP_SIZE
+
+// The bitmap is set up in chunks of 4MB, see chunk_setup().
+#define CHUNK_FRAMES 1024
+#define CHUNK_ELEMENTS (CHUNK_FRAMES / ELEMENT_SIZE)
+#define MAX_CHUNKS (MAX_FRAMES / CHUNK_FRAMES)
+
+/*
+Zones
+
+    0          16MB                   direct map end                 end
+    |-- DMA -----|-------- normal ---------|----------- high -----------|
+
+The DMA zone holds ISA DMA buffers, the normal zone the rest of the memory
+the kernel addresses directly and the high zone everything else, which is
+only reached through temporary mappings. Until paging_init() sets up the
+direct map only BOOT_DIRECT_END is mapped: the DMA zone ends there, the
+normal zone is empty and the high zone is not used. pmm_init_direct()
+then moves the frames up to the end of the direct map to the lower zones.
+
+An allocation takes frames from the zone its gfp flags ask for and falls
+back to the lower ones. A zone keeps min frames free for GFP_ATOMIC and
+another reserve frames from allocations that fall back to it, so ordinary
+allocations cannot use up the memory only a lower zone provides.
+*/
+
+#define ZONE_DMA_END    0x01000000
+#define ZONE_DMA        0
+#define ZONE_NORMAL     1
+#define ZONE_HIGH       2
+#define ZONES           3
+
+// Frames of a zone, by frame number.
+typedef struct zone
+{
+    const char *name;
+    uint32_t start;
+    uint32_t end;       // first frame after the zone
+    uint32_t next;      // frame after the last allocation, the search starts there
+    uint32_t free;
+    uint32_t min;       // free frames that are left to GFP_ATOMIC
+    uint32_t reserve;   // free frames kept from fallbacks of higher zones
+} zone_t;
 
 // Bitmap, one bit per frame while 1 is reserved and 0 is free.
 static uint_fast32_t *bitmap;
-// Last allocated frame, used as a start point to look for free frames.
-static uintptr_t last_alloc_frame = 0;
 // Size of the bitmap in elements
 static size_t bitmap_length;
-
-// Aligns an address on a multiple of FRAME_SIZE, rounding up.
-static inline uintptr_t __align_up(uintptr_t addr)
+static zone_t zones[ZONES] =
 {
-    return (addr + ~FRAME_MASK) & FRAME_MASK;
-}
-
-// Aligns an address on a multiple of FRAME_SIZE, rounding down.
-static inline uintptr_t __align_down(uintptr_t addr)
-{
-    return addr & FRAME_MASK;
-}
+    [ZONE_DMA] = { .name = "DMA" },
+    [ZONE_NORMAL] = { .name = "normal" },
+    [ZONE_HIGH] = { .name = "high" }
+};
+// Chunks of the bitmap that are set up, one bit per chunk.
+static uint32_t chunks_ready[MAX_CHUNKS / 32];
+// Descriptors of the frames of the bitmap, see pmm_page().
+page_t *frame_pages;
+// Whether the descriptors are mapped, chunk_setup() clears them then.
+static int pages_mapped;
+// Protects the bitmap, the chunks and the zones, taken by every cpu.
+static mcs_lock_t pmm_lock = MCS_LOCK_INIT("pmm");
+
+// Protects the reference counts of the descriptors.
+static spinlock_t refs_lock = SPINLOCK_INIT("pmm_refs");
+
+// Free frames counted by zone_count_free().
+static uint32_t zones_counted;
+
+// Called when memory runs out, see pmm_set_reclaim().
+static pmm_reclaim_t reclaim = NULL;
+// Moves movable frames for compaction, see pmm_set_migrate().
+static pmm_migrate_t migrate = NULL;
+// Set while a compaction runs, only one at a time.
+static int compacting;
 
 // Marks a frame as reserved.
 static inline void __frame_mark_used(unsigned bm_idx, uint_fast32_t bit)
@@ -40,20 +107,11 @@ static inline void __frame_mark_free(unsigned bm_idx, uint_fast32_t bit)
     bitmap[bm_idx] &= ~bit;
 }
 
-// Calculates the amount of frames a memory block needs.
-static inline size_t __get_frames(uintptr_t addr_start, uintptr_t addr_end)
-{
-    return (__align_up(addr_end) - __align_down(addr_start)) / FRAME_SIZE;
-}
-
-// Marks an amount of frames as used, starting at addr.
-static void frame_mark_range_used(uintptr_t addr, size_t frames)
+// Marks an amount of frames as used, starting at frame.
+static void frame_mark_range_used(uint32_t frame, size_t frames)
 {
-    unsigned bm_idx;
-    uint_fast32_t bit;
-    addr /= FRAME_SIZE;
-    bm_idx = addr / ELEMENT_SIZE;
-    bit = 1 << (addr % ELEMENT_SIZE);
+    unsigned bm_idx = frame / ELEMENT_SIZE;
+    uint_fast32_t bit = 1 << (frame % ELEMENT_SIZE);
 
     while (frames--)
     {
@@ -68,14 +126,11 @@ static void frame_mark_range_used(uintptr_t addr, size_t frames)
     }
 }
 
-// Marks an amount of frames as free, starting at addr.
-void free_frame(uintptr_t addr, size_t frames)
+// Marks an amount of frames as free, starting at frame.
+static void frame_mark_range_free(uint32_t frame, size_t frames)
 {
-    unsigned bm_idx;
-    uint_fast32_t bit;
-    addr /= FRAME_SIZE;
-    bm_idx = addr / ELEMENT_SIZE;
-    bit = 1 << (addr % ELEMENT_SIZE);
+    unsigned bm_idx = frame / ELEMENT_SIZE;
+    uint_fast32_t bit = 1 << (frame % ELEMENT_SIZE);
 
     while (frames--)
     {
@@ -90,17 +145,143 @@ void free_frame(uintptr_t addr, size_t frames)
     }
 }
 
-// Allocates an amount of contiguous frames.
-void* alloc_frame(size_t frames)
+// Whether the bitmap of a chunk is set up.
+static inline int __chunk_ready(unsigned chunk)
+{
+    return (chunks_ready[chunk / 32] >> (chunk % 32)) & 1;
+}
+
+// Marks the frames of a free block of memblock as free.
+static void chunk_free(uint64_t base, uint64_t end)
+{
+    base = (base + ~FRAME_MASK) / FRAME_SIZE;
+    end /= FRAME_SIZE;
+
+    if (base < end)
+    {
+        frame_mark_range_free(base, end - base);
+    }
+}
+
+// Number of frames of a chunk, the last one may be shorter.
+static inline uint32_t __chunk_frames(unsigned chunk)
+{
+    size_t elements = bitmap_length - chunk * CHUNK_ELEMENTS;
+
+    return (elements < CHUNK_ELEMENTS ? elements : CHUNK_ELEMENTS) * ELEMENT_SIZE;
+}
+
+// Sets up the bitmap of a chunk from the free memory of memblock: most of
+// the memory is not touched during the boot, so the bitmap of a chunk is
+// written when it is first needed instead of all at once in pmm_init(). The
+// same goes for the descriptors once they are mapped.
+static void chunk_setup(unsigned chunk)
+{
+    uint32_t first = chunk * CHUNK_FRAMES;
+    uint32_t last = first + __chunk_frames(chunk);
+
+    memset(&bitmap[chunk * CHUNK_ELEMENTS], 0xFF,
+        (last - first) / ELEMENT_SIZE * sizeof(uint_fast32_t));
+
+    if (pages_mapped)
+    {
+        memset(&frame_pages[first], 0, (last - first) * sizeof(page_t));
+    }
+
+    memblock_for_each_free((uint64_t)first * FRAME_SIZE,
+        (uint64_t)last * FRAME_SIZE, chunk_free);
+
+    chunks_ready[chunk / 32] |= 1u << (chunk % 32);
+}
+
+// Returns the zone of a frame.
+static inline zone_t* __frame_zone(uint32_t frame)
+{
+    unsigned i = ZONE_DMA;
+
+    while (i < ZONE_HIGH && frame >= zones[i].end)
+    {
+        i++;
+    }
+
+    return &zones[i];
+}
+
+// First zone an allocation asks for, the lower ones are the fallback.
+static inline unsigned __gfp_zone(unsigned gfp)
+{
+    return gfp & GFP_DMA ? ZONE_DMA : gfp & GFP_HIGHMEM ? ZONE_HIGH : ZONE_NORMAL;
+}
+
+// Whether a frame is free, its chunk must be set up.
+static inline int __frame_free(uint32_t frame)
+{
+    return ((bitmap[frame / ELEMENT_SIZE] >> (frame % ELEMENT_SIZE)) & 1) == 0;
+}
+
+// Frees an amount of frames, starting at addr. They may span zones. A frame
+// compaction has isolated stays used, compaction takes it over.
+void pmm_free(phys_addr_t addr, size_t frames)
+{
+    uint32_t frame = addr / FRAME_SIZE;
+    uint32_t end = frame + frames;
+    page_t *page;
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    for (; frame < end; frame++)
+    {
+        if (pages_mapped)
+        {
+            page = &frame_pages[frame];
+
+            if (page->isolated)
+            {
+                page->flags &= ~PAGE_MOVABLE;
+                continue;
+            }
+
+            memset(page, 0, sizeof(page_t));
+        }
+
+        frame_mark_range_free(frame, 1);
+        __frame_zone(frame)->free++;
+    }
+
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+    TRACE(TRACE_FREE_FRAME, (uint32_t)addr, frames);
+}
+
+// Frees an amount of frames of alloc_frame().
+void free_frame(uintptr_t addr, size_t frames)
+{
+    pmm_free(virt_to_phys((void *)addr), frames);
+}
+
+// Frees a frame of alloc_high_frame().
+void free_high_frame(phys_addr_t addr)
+{
+    pmm_free(addr, 1);
+}
+
+// Searches a zone for an amount of contiguous free frames, from the last
+// allocation on, and marks them as used. Returns the first frame.
+static uint32_t find_frames(zone_t *zone, size_t frames)
 {
     uint_fast32_t bit;
     size_t size = 0;
-    uintptr_t addr = 0;
-    unsigned bm_idx = last_alloc_frame / FRAME_SIZE / ELEMENT_SIZE;
-    unsigned bit_idx = last_alloc_frame / FRAME_SIZE % ELEMENT_SIZE;
+    uint32_t frame = 0;
+    unsigned bm_idx = zone->next / ELEMENT_SIZE;
+    unsigned bit_idx = zone->next % ELEMENT_SIZE;
 
-    for (; bm_idx < bitmap_length; bm_idx++)
+    for (; bm_idx < zone->end / ELEMENT_SIZE; bm_idx++)
     {
+        if (!__chunk_ready(bm_idx / CHUNK_ELEMENTS))
+        {
+            chunk_setup(bm_idx / CHUNK_ELEMENTS);
+        }
+
         if (bitmap[bm_idx] == ~(uint_fast32_t)0)
         {
             size = 0;
@@ -111,7 +292,7 @@ void* alloc_frame(size_t frames)
         {
             if (size == 0)
             {
-                addr = bm_idx * ELEMENT_SIZE * FRAME_SIZE;
+                frame = bm_idx * ELEMENT_SIZE;
             }
 
             size += ELEMENT_SIZE;
@@ -126,7 +307,7 @@ void* alloc_frame(size_t frames)
                 {
                     if (size == 0)
                     {
-                        addr = (bm_idx * ELEMENT_SIZE + bit_idx) * FRAME_SIZE;
+                        frame = bm_idx * ELEMENT_SIZE + bit_idx;
                     }
 
                     if (++size >= frames)
@@ -145,80 +326,406 @@ void* alloc_frame(size_t frames)
 
         if (size >= frames)
         {
-            frame_mark_range_used(addr, frames);
-            last_alloc_frame = addr + (frames * FRAME_SIZE);
+            frame_mark_range_used(frame, frames);
+            zone->next = frame + frames;
 
-            return (void *)addr;
+            return frame;
         }
     }
 
-    return PMM_NO_MEM;
+    return NO_FRAME;
+}
+
+// Searches a whole zone, wrapping around after the last allocation.
+static uint32_t find_frames_wrap(zone_t *zone, size_t frames)
+{
+    uint32_t frame = find_frames(zone, frames);
+
+    if (frame == NO_FRAME && zone->next != zone->start)
+    {
+        zone->next = zone->start;
+        frame = find_frames(zone, frames);
+    }
+
+    return frame;
+}
+
+// Whether a zone can give frames to an allocation, fallback is set if the
+// allocation asked for a higher zone.
+static inline int __zone_watermark_ok(zone_t *zone, size_t frames, unsigned gfp, int fallback)
+{
+    uint32_t mark = (gfp & GFP_ATOMIC ? 0 : zone->min) +
+        (fallback ? zone->reserve : 0);
+
+    return zone->start < zone->end && zone->free >= mark + frames;
 }
 
-// Calculates how much space the bitmap requires to represent the memory.
-static size_t required_bitmap_size(multiboot_info_t *mb_info)
+// Tries the zones of an allocation in order. Returns the first frame.
+static uint32_t zones_alloc(size_t frames, unsigned gfp)
 {
-    uintptr_t upper_end = 0;
-    multiboot_memory_map_t *mmap = (void *)mb_info->mmap_addr;
-    multiboot_memory_map_t *mmap_end = mmap + mb_info->mmap_length;
+    unsigned first = __gfp_zone(gfp);
+    unsigned i = first + 1;
+    uint32_t frame;
 
-    while (mmap < mmap_end)
+    while (i-- > 0)
     {
-        if (mmap->type == 1)
+        if (!__zone_watermark_ok(&zones[i], frames, gfp, i != first))
         {
-            if (mmap->addr + mmap->len > upper_end)
-            {
-                upper_end = mmap->addr + mmap->len;
-            }
+            continue;
         }
 
-        mmap++;
+        frame = find_frames_wrap(&zones[i], frames);
+
+        if (frame != NO_FRAME)
+        {
+            zones[i].free -= frames;
+            return frame;
+        }
     }
 
-    kprintf("upper_end: 0x%x\n", upper_end);
-    // TODO: Does this work with 4GB?
-    return (size_t)(upper_end / FRAME_SIZE / 8);
+    return NO_FRAME;
 }
 
-// Searches for a free memory block to save the bitmap.
-static void* find_free_mem(multiboot_info_t *mb_info, size_t size)
+/*
+Compaction
+
+When a run of frames cannot be found although a zone has enough free
+frames, the zone is searched for a window of the size of the run, aligned
+on it, whose used frames are all PAGE_MOVABLE and mapped only once:
+
+    window      |  M  .  .  M  .  M  |          . free, M movable
+    after       |  x  x  x  x  x  x  |  M  M  M  moved to other frames
+
+The free frames of the window are taken and all of its frames isolated
+right away, then the migrate function copies every movable frame to a new
+one and changes its mapping. If one of them cannot be moved, or no target
+is left above the min watermark, the window is given up.
+
+The migrate function runs without pmm_lock, but with interrupts off and the
+locks of the owner held: contexts_lock, then context->lock. Paths that hold
+a context lock free frames, so pmm_lock always comes last:
+
+    contexts_lock  ->  context->lock  ->  pmm_lock
+*/
+
+// Whether a frame can be part of a window, pmm_lock must be held.
+static inline int __frame_compactable(uint32_t frame)
 {
-    multiboot_memory_map_t *mmap = (void *)mb_info->mmap_addr;
-    multiboot_memory_map_t *mmap_end = mmap + mb_info->mmap_length;
+    page_t *page = &frame_pages[frame];
 
-    while (mmap < mmap_end)
+    if (!__chunk_ready(frame / CHUNK_FRAMES))
     {
-        if (mmap->type == 1 && mmap->len >= size)
+        chunk_setup(frame / CHUNK_FRAMES);
+    }
+
+    return __frame_free(frame) || ((page->flags & PAGE_MOVABLE) &&
+        page->refs <= 1 && !page->isolated);
+}
+
+// Returns the first frame of a window in a zone that compaction can empty,
+// NO_FRAME if there is none. pmm_lock must be held.
+static uint32_t find_window(zone_t *zone, size_t frames)
+{
+    uint32_t start = (zone->start + frames - 1) / frames * frames;
+    uint32_t frame;
+
+    for (; start + frames <= zone->end; start += frames)
+    {
+        for (frame = start; frame < start + frames && __frame_compactable(frame); frame++)
         {
-            // TODO: Check for reserved memory blocks.
-            return (void *)((uintptr_t)mmap->addr);
         }
 
-        mmap++;
+        if (frame == start + frames)
+        {
+            return start;
+        }
     }
 
-    return (void *)0x1000;
+    return NO_FRAME;
 }
 
-// Finds the free memory with the BIOS memory map and marks it as free.
-static void process_memory_map(multiboot_info_t *mb_info)
+// Moves the movable frames of an isolated window elsewhere. Returns 0 if
+// none of them is mapped anymore.
+static int migrate_window(uint32_t start, size_t frames)
 {
-    uintptr_t addr_start, addr_end;
-    multiboot_memory_map_t *mmap = (void *)mb_info->mmap_addr;
-    multiboot_memory_map_t *mmap_end = mmap + mb_info->mmap_length;
+    uint32_t frame, to;
+    page_t *page;
+    mcs_node_t node;
+    uint32_t eflags;
 
-    while (mmap < mmap_end)
+    for (frame = start; frame < start + frames; frame++)
     {
-        if (mmap->type == 1)
+        page = &frame_pages[frame];
+
+        if ((page->flags & PAGE_MOVABLE) == 0)
         {
-            addr_start = mmap->addr;
-            addr_end = addr_start + mmap->len;
+            continue;
+        }
 
-            free_frame(addr_start, __get_frames(addr_start, addr_end));
+        // The window is used as a whole, no target can lie within it. The
+        // reserve below the min watermark is left to atomic allocations.
+        eflags = mcs_lock_irqsave(&pmm_lock, &node);
+        to = zones_alloc(1, GFP_HIGHMEM);
+        mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+        if (to == NO_FRAME)
+        {
+            return -1;
         }
 
-        mmap++;
+        if (migrate(page, (phys_addr_t)to * FRAME_SIZE) != 0)
+        {
+            pmm_free((phys_addr_t)to * FRAME_SIZE, 1);
+
+            // The owner may have freed it in the meantime.
+            if (page->flags & PAGE_MOVABLE)
+            {
+                return -1;
+            }
+        }
     }
+
+    return 0;
+}
+
+// Assembles a run of frames in a zone by moving movable frames away.
+// Returns the first frame.
+static uint32_t compact_zone(zone_t *zone, size_t frames)
+{
+    uint32_t start, frame;
+    int moved;
+    page_t *page;
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    start = find_window(zone, frames);
+
+    if (start == NO_FRAME)
+    {
+        mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+        return NO_FRAME;
+    }
+
+    for (frame = start; frame < start + frames; frame++)
+    {
+        if (__frame_free(frame))
+        {
+            frame_mark_range_used(frame, 1);
+            zone->free--;
+        }
+
+        frame_pages[frame].isolated = 1;
+    }
+
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+    moved = migrate_window(start, frames) == 0;
+
+    // Every frame that is not mapped anymore belongs to the window, if it
+    // failed they are given back.
+    eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    for (frame = start; frame < start + frames; frame++)
+    {
+        page = &frame_pages[frame];
+        page->isolated = 0;
+
+        if (!moved && (page->flags & PAGE_MOVABLE))
+        {
+            continue;
+        }
+
+        memset(page, 0, sizeof(page_t));
+
+        if (!moved)
+        {
+            frame_mark_range_free(frame, 1);
+            zone->free++;
+        }
+    }
+
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+    return moved ? start : NO_FRAME;
+}
+
+// Compacts the zones of an allocation that have enough free frames, in the
+// order zones_alloc() tries them. Returns the first frame of the run.
+static uint32_t compact(size_t frames, unsigned gfp)
+{
+    unsigned first = __gfp_zone(gfp);
+    unsigned i = first + 1;
+    uint32_t frame = NO_FRAME;
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    if (compacting || !pages_mapped)
+    {
+        mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+        return NO_FRAME;
+    }
+
+    compacting = 1;
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+    while (i-- > 0 && frame == NO_FRAME)
+    {
+        if (__zone_watermark_ok(&zones[i], frames, gfp, i != first))
+        {
+            frame = compact_zone(&zones[i], frames);
+        }
+    }
+
+    compacting = 0;
+
+    return frame;
+}
+
+// Allocates an amount of contiguous frames from the zones gfp asks for.
+// Returns PMM_NO_FRAME if there are none.
+phys_addr_t pmm_alloc(size_t frames, unsigned gfp)
+{
+    uint32_t frame;
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    frame = zones_alloc(frames, gfp);
+
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+
+    // Caches give memory back under pressure, in batches.
+    if (frame == NO_FRAME && (gfp & GFP_ATOMIC) == 0 && reclaim &&
+        reclaim(frames < RECLAIM_BATCH ? RECLAIM_BATCH : frames))
+    {
+        eflags = mcs_lock_irqsave(&pmm_lock, &node);
+        frame = zones_alloc(frames, gfp);
+        mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+    }
+
+    // The free memory may only be fragmented.
+    if (frame == NO_FRAME && frames > 1 && (gfp & GFP_ATOMIC) == 0 && migrate)
+    {
+        frame = compact(frames, gfp);
+    }
+
+    if (frame == NO_FRAME)
+    {
+        return PMM_NO_FRAME;
+    }
+
+    TRACE(TRACE_ALLOC_FRAME, frame * FRAME_SIZE, frames);
+
+    return (phys_addr_t)frame * FRAME_SIZE;
+}
+
+// Allocates an amount of contiguous frames the kernel addresses directly,
+// returns their address in the direct map.
+void* alloc_frame(size_t frames)
+{
+    phys_addr_t addr = pmm_alloc(frames, GFP_KERNEL);
+
+    return addr == PMM_NO_FRAME ? PMM_NO_MEM : phys_to_virt(addr);
+}
+
+// Allocates a frame for memory the kernel only reaches through a temporary
+// mapping, e.g. user pages. The high zone is used first so the memory the
+// kernel addresses directly is left to it. Returns PMM_NO_FRAME if there
+// is none.
+phys_addr_t alloc_high_frame()
+{
+    return pmm_alloc(1, GFP_HIGHMEM);
+}
+
+// Sets the function alloc_frame() calls to free memory when it runs out.
+// It returns the number of frames it freed and must not wait for locks
+// that may be held while allocating.
+void pmm_set_reclaim(pmm_reclaim_t function)
+{
+    reclaim = function;
+}
+
+// Whether a frame has a descriptor.
+static inline int __has_page(phys_addr_t addr)
+{
+    return addr / FRAME_SIZE < bitmap_length * ELEMENT_SIZE;
+}
+
+// Sets the function compaction calls to move a PAGE_MOVABLE frame to the
+// frame at to. It copies the contents, changes the mapping at the owner and
+// index of the descriptor and moves them to the new descriptor. It returns
+// 0 on success and may only fail if the frame is not movable after all.
+void pmm_set_migrate(pmm_migrate_t function)
+{
+    migrate = function;
+}
+
+// Adds a reference to a frame, returns the new count or 0 if the frame is
+// not managed by the pmm and cannot be shared. A freshly allocated frame
+// has a count of 1, so the first share makes it 2.
+uint32_t pmm_frame_share(phys_addr_t addr)
+{
+    uint32_t count = 0;
+    page_t *page;
+    uint32_t eflags;
+
+    if (!__has_page(addr))
+    {
+        return 0;
+    }
+
+    page = pmm_page(addr);
+    eflags = spin_lock_irqsave(&refs_lock);
+
+    count = page->refs = (page->refs ? page->refs : 1) + 1;
+
+    spin_unlock_irqrestore(&refs_lock, eflags);
+
+    return count;
+}
+
+// Drops a reference to a frame, returns the remaining count. 0 means the
+// last one is gone and the frame can be freed.
+uint32_t pmm_frame_unshare(phys_addr_t addr)
+{
+    uint32_t count = 0;
+    page_t *page;
+    uint32_t eflags;
+
+    if (!__has_page(addr))
+    {
+        return 0;
+    }
+
+    page = pmm_page(addr);
+    eflags = spin_lock_irqsave(&refs_lock);
+
+    if (page->refs > 1)
+    {
+        count = --page->refs;
+    }
+    else
+    {
+        page->refs = 0;
+    }
+
+    spin_unlock_irqrestore(&refs_lock, eflags);
+
+    return count;
+}
+
+// Returns how many mappings refer to a frame.
+uint32_t pmm_frame_refs(phys_addr_t addr)
+{
+    uint32_t count;
+
+    if (!__has_page(addr))
+    {
+        return 1;
+    }
+
+    count = pmm_page(addr)->refs;
+
+    return count ? count : 1;
 }
 
 // Returns the address of the bitmap.
@@ -239,57 +746,155 @@ size_t pmm_get_bitmap_size()
     return bitmap_length * sizeof(uint_fast32_t);
 }
 
-// Initialises the physical memory manager.
-void pmm_init(multiboot_info_t *mb_info)
+// Returns the address of the frame descriptors.
+uintptr_t pmm_get_pages()
 {
+    return (uintptr_t)frame_pages;
+}
+
+// Returns the size of the frame descriptors in bytes, whole frames.
+size_t pmm_get_pages_size()
+{
+    size_t size = bitmap_length * ELEMENT_SIZE * sizeof(page_t);
+
+    return (size + ~FRAME_MASK) & FRAME_MASK;
+}
+
+// Clears the descriptors of the chunks that are set up already, called by
+// paging_init() once they are mapped.
+void pmm_init_pages()
+{
+    unsigned chunk;
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
+
+    for (chunk = 0; chunk * CHUNK_ELEMENTS < bitmap_length; chunk++)
+    {
+        if (__chunk_ready(chunk))
+        {
+            memset(&frame_pages[chunk * CHUNK_FRAMES], 0,
+                __chunk_frames(chunk) * sizeof(page_t));
+        }
+    }
+
+    pages_mapped = 1;
+
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+}
+
+// Counts the free frames of a block of memblock, see zones_init().
+static void zone_count_free(uint64_t base, uint64_t end)
+{
+    base = (base + ~FRAME_MASK) / FRAME_SIZE;
+    end /= FRAME_SIZE;
+
+    if (base < end)
+    {
+        zones_counted += end - base;
+    }
+}
+
+// Returns the frames between start and end that memblock left free.
+static uint32_t zone_count(uint32_t start, uint32_t end)
+{
+    zones_counted = 0;
+    memblock_for_each_free((uint64_t)start * FRAME_SIZE,
+        (uint64_t)end * FRAME_SIZE, zone_count_free);
+
+    return zones_counted;
+}
+
+// Splits the frames of the bitmap into zones at the end of the memory the
+// kernel addresses directly and counts their free frames. Frames that are
+// allocated already must stay in their zone.
+static void zones_init(uint32_t frames, uint32_t direct)
+{
+    uint32_t limits[ZONES] =
+    {
+        [ZONE_DMA] = ZONE_DMA_END / FRAME_SIZE < direct ? ZONE_DMA_END / FRAME_SIZE : direct,
+        [ZONE_NORMAL] = direct,
+        [ZONE_HIGH] = frames
+    };
+    uint32_t start = 0, used;
+    zone_t *zone;
     unsigned i;
-    multiboot_module_t *mod = (void *)mb_info->mods_addr;
-    size_t bitmap_size = required_bitmap_size(mb_info);
-    bitmap = find_free_mem(mb_info, bitmap_size);
-    bitmap_length = 8 * bitmap_size / ELEMENT_SIZE;
 
-    kprintf("&bitmap: 0x%x\n", (uintptr_t)bitmap);
-    kprintf("bitmap_size: %u\n", bitmap_size);
-    kprintf("&multiboot: 0x%x\n", (uintptr_t)mb_info);
-    kprintf("mods_count: %u\n", mb_info->mods_count);
+    for (i = 0; i < ZONES; i++)
+    {
+        zone = &zones[i];
+        used = zone_count(zone->start, zone->end) - zone->free;
+
+        zone->start = zone->next = start;
+        zone->end = limits[i] < frames ? limits[i] : frames;
+        zone->end = zone->end > start ? zone->end : start;
+        start = zone->end;
+
+        zone->free = zone_count(zone->start, zone->end) - used;
+
+        // A zone below another one keeps a share for its own allocations.
+        zone->min = zone->free / 64;
+        zone->reserve = i < ZONE_HIGH ? zone->free / 16 : 0;
+
+        kprintf("zone %s: %u frames free, min %u, reserve %u\n", zone->name,
+            zone->free, zone->min, zone->reserve);
+    }
+}
 
-    // Set everything as reserved.
-    memset(bitmap, 0xFF, bitmap_size);
+// Moves the end of the memory the kernel addresses directly to the end of
+// the direct map, called by paging_init() once it is set up.
+void pmm_init_direct(uint64_t end)
+{
+    mcs_node_t node;
+    uint32_t eflags = mcs_lock_irqsave(&pmm_lock, &node);
 
-    // Marks usable space as free.
-    process_memory_map(mb_info);
+    zones_init(bitmap_length * ELEMENT_SIZE, end / FRAME_SIZE);
 
-    // Reserve space for the bitmap.
-    frame_mark_range_used((uintptr_t)bitmap,
-        __get_frames((uintptr_t)bitmap, (uintptr_t)bitmap + bitmap_size));
+    mcs_unlock_irqrestore(&pmm_lock, &node, eflags);
+}
 
-    // Reserve space for the kernel.
-    frame_mark_range_used((uintptr_t)&kernel_start,
-        __get_frames((uintptr_t)&kernel_start, (uintptr_t)&kernel_end));
+// Initialises the physical memory manager with the free memory of memblock,
+// after which memblock_alloc() must not be used anymore.
+void pmm_init()
+{
+    uint64_t end = memblock_end();
+    size_t bitmap_size;
+    uint64_t pages;
 
-    // Reserve space for the multiboot_info.
-    frame_mark_range_used((uintptr_t)mb_info,
-        __get_frames((uintptr_t)mb_info, (uintptr_t)(mb_info + 1)));
+    // Frames above 64GB cannot be addressed.
+    if (end > MAX_FRAMES * (uint64_t)FRAME_SIZE)
+    {
+        end = MAX_FRAMES * (uint64_t)FRAME_SIZE;
+    }
+
+    // Whole elements, the frames of a partial one are never used.
+    bitmap_length = end / FRAME_SIZE / ELEMENT_SIZE;
+    bitmap_size = bitmap_length * sizeof(uint_fast32_t);
+    bitmap = memblock_alloc(bitmap_size, FRAME_SIZE);
 
-    // Reserve space for the multiboot modules.
-    for (i = 0; i < mb_info->mods_count; i++, mod++)
+    if (bitmap == NULL)
     {
-        // The Multiboot-info of the module.
-        frame_mark_range_used((uintptr_t)mod,
-            __get_frames((uintptr_t)mod, (uintptr_t)(mod + 1)));
+        PANIC("No memory for the frame bitmap!");
+    }
 
-        // The module itself.
-        frame_mark_range_used(mod->mod_start,
-            __get_frames(mod->mod_start, mod->mod_end));
+    // Right after the bitmap if there is room, reached once paging_init()
+    // has set up the direct map.
+    pages = memblock_alloc_phys(pmm_get_pages_size(), FRAME_SIZE, PAGES_LIMIT);
 
-        // The commandline of the module.
-        if (mod->cmdline)
-        {
-            frame_mark_range_used(
-                mod->cmdline,
-                __get_frames(
-                    mod->cmdline,
-                    mod->cmdline + strlen((char *)mod->cmdline)));
-        }
+    if (pages == 0)
+    {
+        PANIC("No memory for the frame descriptors!");
     }
+
+    frame_pages = phys_to_virt(pages);
+
+    kprintf("upper_end: %u MB\n", (uint32_t)(end >> 20));
+    kprintf("&bitmap: 0x%x\n", (uintptr_t)bitmap);
+    kprintf("bitmap_size: %u\n", bitmap_size);
+    kprintf("&pages: 0x%x\n", (uintptr_t)frame_pages);
+
+    zones_init(bitmap_length * ELEMENT_SIZE, BOOT_DIRECT_END / FRAME_SIZE);
+
+    // Only the chunk below 4MB is set up now, every other one when
+    // find_frames() first gets there.
+    chunk_setup(0);
 }
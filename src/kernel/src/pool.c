@@ -0,0 +1,56 @@
+#include "pool.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "pmm.h"
+
+// Returns a zeroed object, NULL if there is no memory left.
+void* pool_alloc(pool_t *pool)
+{
+    uint8_t *frame;
+    size_t i;
+    void *object;
+    uint32_t eflags = spin_lock_irqsave(&pool->lock);
+
+    object = pool->free;
+
+    if (object)
+    {
+        pool->free = *(void **)object;
+    }
+
+    spin_unlock_irqrestore(&pool->lock, eflags);
+
+    if (object == NULL)
+    {
+        // Not under the lock, alloc_frame() may reclaim memory and free
+        // objects of this pool.
+        frame = alloc_frame(1);
+
+        if ((void *)frame == PMM_NO_MEM)
+        {
+            return NULL;
+        }
+
+        object = frame;
+
+        for (i = pool->size; i + pool->size <= FRAME_SIZE; i += pool->size)
+        {
+            pool_free(pool, frame + i);
+        }
+    }
+
+    memset(object, 0, pool->size);
+
+    return object;
+}
+
+void pool_free(pool_t *pool, void *object)
+{
+    uint32_t eflags = spin_lock_irqsave(&pool->lock);
+
+    *(void **)object = pool->free;
+    pool->free = object;
+
+    spin_unlock_irqrestore(&pool->lock, eflags);
+}
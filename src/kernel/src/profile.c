@@ -0,0 +1,293 @@
+#include "profile.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "kernel.h"
+#include "apic.h"
+#include "atomic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "pmm.h"
+#include "sched.h"
+#include "serial.h"
+#include "smp.h"
+#include "thread.h"
+
+// Samples of a cpu, only written by that cpu.
+typedef struct profile_cpu
+{
+    uint32_t *buffer;
+    uint32_t used;          // dwords of the buffer in use
+    uint32_t samples;
+    uint32_t dropped;       // samples that did not fit anymore
+    volatile int busy;      // a sample is being written
+    int armed;              // the counter of the cpu is programmed
+} profile_cpu_t;
+
+volatile int profile_mode = PROFILE_OFF;
+static int last_mode = PROFILE_TIMER;
+static uint32_t profile_period;
+static profile_cpu_t cpus[MAX_CPUS];
+
+// Top of the stack the interrupted kernel code runs on.
+static uintptr_t stack_top()
+{
+    thread_t *thread = sched_current();
+
+    if (thread && thread->stack)
+    {
+        return thread->stack + THREAD_STACK_FRAMES * FRAME_SIZE;
+    }
+
+    // The boot thread of the bootstrap processor runs on the loader stack.
+    return (uintptr_t)&boot_stack;
+}
+
+// Appends a sample of the interrupted code to the buffer of this cpu.
+static void profile_sample(cpu_state_t *cpu)
+{
+    profile_cpu_t *pc = &cpus[cpu_id()];
+    uint32_t *record;
+    uint32_t depth = 0;
+    uintptr_t frame, top;
+
+    pc->busy = 1;
+    barrier();
+
+    if (profile_mode == PROFILE_OFF || pc->buffer == NULL)
+    {
+        goto out;
+    }
+
+    if (pc->used + 2 + PROFILE_DEPTH > PROFILE_BUFFER / sizeof(uint32_t))
+    {
+        pc->dropped++;
+        goto out;
+    }
+
+    record = pc->buffer + pc->used;
+    record[1] = cpu->eip;
+
+    if ((cpu->cs & GDT_RPL_USER) == 0)
+    {
+        // Every frame lies above the previous one on the same stack, stop at
+        // the first pointer that does not.
+        top = stack_top();
+        frame = cpu->ebp;
+
+        while (depth < PROFILE_DEPTH && frame > (uintptr_t)cpu &&
+            frame + 2 * sizeof(uint32_t) <= top && (frame & 3) == 0)
+        {
+            record[2 + depth++] = ((uint32_t *)frame)[1];
+
+            if (((uint32_t *)frame)[0] <= frame)
+            {
+                break;
+            }
+
+            frame = ((uint32_t *)frame)[0];
+        }
+
+        record[0] = depth;
+    }
+    else
+    {
+        record[0] = PROFILE_USER;
+    }
+
+    pc->used += 2 + depth;
+    pc->samples++;
+
+out:
+    barrier();
+    pc->busy = 0;
+}
+
+// Lets the first performance counter raise an NMI after period cycles.
+static void pmc_arm()
+{
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    // Only the low dword is written, sign extended to the counter width.
+    wrmsr(MSR_PMC0, (uint32_t)-profile_period);
+    wrmsr(MSR_PERFEVTSEL0, PERFEVTSEL_CYCLES | PERFEVTSEL_USR |
+        PERFEVTSEL_OS | PERFEVTSEL_INT | PERFEVTSEL_EN);
+    lapic_perf_nmi(1);
+}
+
+static void pmc_disarm()
+{
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    lapic_perf_nmi(0);
+}
+
+// Whether the cpu counts unhalted cycles with an architectural counter.
+static int pmc_supported()
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+
+    if (eax < CPUID_PMU)
+    {
+        return 0;
+    }
+
+    cpuid(CPUID_PMU, &eax, &ebx, &ecx, &edx);
+
+    return CPUID_PMU_VERSION(eax) >= 1 && CPUID_PMU_COUNTERS(eax) >= 1 &&
+        (eax >> 24) > 0 && (ebx & CPUID_PMU_NO_CYCLES) == 0;
+}
+
+static cpu_state_t* profile_nmi(cpu_state_t *cpu)
+{
+    profile_cpu_t *pc = &cpus[cpu_id()];
+
+    // The counter still counts up to the overflow, the NMI has another
+    // source.
+    if (!pc->armed || (rdmsr(MSR_PMC0) & (1u << 31)))
+    {
+        return cpu;
+    }
+
+    if (profile_mode != PROFILE_PMC)
+    {
+        pmc_disarm();
+        pc->armed = 0;
+        return cpu;
+    }
+
+    profile_sample(cpu);
+    pmc_arm();
+
+    return cpu;
+}
+
+// Samples in timer mode, arms the counter of the cpu in PMC mode.
+void __profile_tick(cpu_state_t *cpu)
+{
+    profile_cpu_t *pc = &cpus[cpu_id()];
+
+    if (profile_mode == PROFILE_TIMER)
+    {
+        profile_sample(cpu);
+    }
+    else if (profile_mode == PROFILE_PMC && !pc->armed)
+    {
+        pc->armed = 1;
+        pmc_arm();
+    }
+}
+
+// Starts sampling on every cpu, with PROFILE_PMC every period cycles or
+// PROFILE_PERIOD if it is 0. Samples of an earlier run are discarded.
+int profile_start(int mode, uint32_t period)
+{
+    unsigned i;
+
+    if (profile_mode != PROFILE_OFF)
+    {
+        return PROFILE_EBUSY;
+    }
+
+    if (mode == PROFILE_PMC && !pmc_supported())
+    {
+        return PROFILE_ENODEV;
+    }
+
+    for (i = 0; i < smp_cpu_count(); i++)
+    {
+        if (cpus[i].buffer == NULL)
+        {
+            cpus[i].buffer = alloc_frame(PROFILE_BUFFER / FRAME_SIZE);
+
+            if ((void *)cpus[i].buffer == PMM_NO_MEM)
+            {
+                cpus[i].buffer = NULL;
+                return PROFILE_ENOMEM;
+            }
+        }
+
+        cpus[i].used = 0;
+        cpus[i].samples = 0;
+        cpus[i].dropped = 0;
+    }
+
+    profile_period = period ? period : PROFILE_PERIOD;
+
+    if (mode == PROFILE_PMC)
+    {
+        register_interrupt_handler(INT_NONMASKABLE_INT, profile_nmi);
+    }
+
+    last_mode = mode;
+    barrier();
+    profile_mode = mode;
+
+    return 0;
+}
+
+// Stops sampling, returns once no cpu writes a sample anymore.
+void profile_stop()
+{
+    unsigned i;
+
+    profile_mode = PROFILE_OFF;
+    barrier();
+
+    for (i = 0; i < smp_cpu_count(); i++)
+    {
+        while (cpus[i].busy)
+        {
+            cpu_relax();
+        }
+    }
+}
+
+// Sends the samples of the last run over the serial port.
+void profile_dump()
+{
+    uint32_t samples = 0, dropped = 0;
+    uint32_t *record, *end;
+    unsigned i, j, depth;
+
+    serial_puts("profile begin ");
+    serial_puts(last_mode == PROFILE_PMC ? "pmc " : "timer ");
+    serial_put_hex(profile_period);
+    serial_putc('\n');
+
+    for (i = 0; i < smp_cpu_count(); i++)
+    {
+        if (cpus[i].buffer == NULL)
+        {
+            continue;
+        }
+
+        end = cpus[i].buffer + cpus[i].used;
+
+        for (record = cpus[i].buffer; record < end; record += 2 + depth)
+        {
+            depth = record[0] & PROFILE_USER ? 0 : record[0];
+
+            serial_put_hex(i);
+            serial_puts(record[0] & PROFILE_USER ? " u " : " k ");
+            serial_put_hex(record[1]);
+
+            for (j = 0; j < depth; j++)
+            {
+                serial_putc(' ');
+                serial_put_hex(record[2 + j]);
+            }
+
+            serial_putc('\n');
+        }
+
+        samples += cpus[i].samples;
+        dropped += cpus[i].dropped;
+    }
+
+    serial_puts("profile end ");
+    serial_put_hex(samples);
+    serial_putc(' ');
+    serial_put_hex(dropped);
+    serial_putc('\n');
+}
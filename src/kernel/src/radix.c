@@ -0,0 +1,166 @@
+#include "radix.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "pool.h"
+
+#define RADIX_MAX_HEIGHT ((32 + RADIX_SHIFT - 1) / RADIX_SHIFT)
+
+static pool_t node_pool = POOL_INIT("radix_node", sizeof(radix_node_t));
+
+// Largest index a tree of a height can hold.
+static inline uint32_t __max_index(unsigned height)
+{
+    if (height * RADIX_SHIFT >= 32)
+    {
+        return 0xFFFFFFFF;
+    }
+
+    return (1u << (height * RADIX_SHIFT)) - 1;
+}
+
+// Slot of an index in a node of a level, level 1 holds the items.
+static inline unsigned __slot(uint32_t index, unsigned level)
+{
+    return (index >> ((level - 1) * RADIX_SHIFT)) & (RADIX_SLOTS - 1);
+}
+
+// Returns the item at an index, NULL if there is none.
+void* radix_lookup(radix_root_t *root, uint32_t index)
+{
+    unsigned level = root->height;
+    radix_node_t *node = root->node;
+
+    if (node == NULL || index > __max_index(level))
+    {
+        return NULL;
+    }
+
+    for (; level > 1; level--)
+    {
+        node = node->slots[__slot(index, level)];
+
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    return node->slots[__slot(index, 1)];
+}
+
+// Stores an item at an index that is not in use yet.
+int radix_insert(radix_root_t *root, uint32_t index, void *item)
+{
+    unsigned level;
+    unsigned slot;
+    radix_node_t *node;
+    radix_node_t *child;
+
+    // Grow until the index fits, the old tree becomes the first child.
+    while (root->node == NULL || index > __max_index(root->height))
+    {
+        node = pool_alloc(&node_pool);
+
+        if (node == NULL)
+        {
+            return RADIX_ENOMEM;
+        }
+
+        if (root->node)
+        {
+            node->slots[0] = root->node;
+            node->count = 1;
+        }
+
+        root->node = node;
+        root->height++;
+    }
+
+    node = root->node;
+
+    for (level = root->height; level > 1; level--)
+    {
+        slot = __slot(index, level);
+        child = node->slots[slot];
+
+        if (child == NULL)
+        {
+            child = pool_alloc(&node_pool);
+
+            if (child == NULL)
+            {
+                return RADIX_ENOMEM;
+            }
+
+            node->slots[slot] = child;
+            node->count++;
+        }
+
+        node = child;
+    }
+
+    slot = __slot(index, 1);
+
+    if (node->slots[slot])
+    {
+        return RADIX_EEXIST;
+    }
+
+    node->slots[slot] = item;
+    node->count++;
+
+    return 0;
+}
+
+// Removes the item at an index and frees the nodes that became empty.
+// Returns the item, NULL if there was none.
+void* radix_delete(radix_root_t *root, uint32_t index)
+{
+    radix_node_t *path[RADIX_MAX_HEIGHT + 1];
+    unsigned level = root->height;
+    radix_node_t *node = root->node;
+    void *item;
+
+    if (node == NULL || index > __max_index(level))
+    {
+        return NULL;
+    }
+
+    for (; level > 1; level--)
+    {
+        path[level] = node;
+        node = node->slots[__slot(index, level)];
+
+        if (node == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    item = node->slots[__slot(index, 1)];
+
+    if (item == NULL)
+    {
+        return NULL;
+    }
+
+    node->slots[__slot(index, 1)] = NULL;
+
+    // Walk up as long as nodes become empty.
+    while (--node->count == 0)
+    {
+        pool_free(&node_pool, node);
+
+        if (++level > root->height)
+        {
+            root->node = NULL;
+            root->height = 0;
+            break;
+        }
+
+        node = path[level];
+        node->slots[__slot(index, level)] = NULL;
+    }
+
+    return item;
+}
@@ -0,0 +1,53 @@
+#include "rcu.h"
+#include <stdint.h>
+#include "atomic.h"
+#include "cpu.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "thread.h"
+
+// Serializes the start of grace periods.
+static spinlock_t rcu_lock = SPINLOCK_INIT("rcu");
+// One bit for every cpu that has to pass a quiescent state.
+static volatile uint32_t rcu_pending = 0;
+
+// Reports that the executing cpu holds no RCU protected pointers.
+void rcu_quiescent()
+{
+    uint32_t bit = 1u << cpu_id();
+
+    if (rcu_pending & bit)
+    {
+        atomic_and(&rcu_pending, ~bit);
+    }
+}
+
+// Waits until every reader that started before the call has finished.
+void synchronize_rcu()
+{
+    uint32_t eflags;
+
+    // Only one grace period at a time, wait for a running one to end.
+    while (1)
+    {
+        eflags = spin_lock_irqsave(&rcu_lock);
+
+        if (rcu_pending == 0)
+        {
+            break;
+        }
+
+        spin_unlock_irqrestore(&rcu_lock, eflags);
+        thread_yield();
+    }
+
+    // The caller is not inside a read-side section.
+    rcu_pending = ((1u << smp_cpu_count()) - 1) & ~(1u << cpu_id());
+
+    spin_unlock_irqrestore(&rcu_lock, eflags);
+
+    while (rcu_pending)
+    {
+        thread_yield();
+    }
+}
@@ -0,0 +1,439 @@
+#include "sched.h"
+#include <stdint.h>
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "pmm.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "thread.h"
+#include "trace.h"
+
+/*
+Multi-level feedback queue scheduler
+
+Every cpu owns a run queue with SCHED_LEVELS FIFO lists and a bitmap of the
+non-empty lists, so the next thread is found with a single bsf instruction
+no matter how many threads are ready.
+
+A thread that uses up its time slice is moved one level down and gets a
+longer slice there, a thread that blocks or yields early keeps its level and
+moves one level up if it used less than half of its slice. That way
+interactive threads stay at the top while cpu bound threads sink.
+To prevent starvation all lists are spliced onto level 0 every
+SCHED_BOOST_TICKS, the level of a thread is only updated when it is picked.
+*/
+
+static runqueue_t runqueues[MAX_CPUS];
+// Number of cpus that called sched_init_cpu().
+static unsigned cpus_online = 0;
+// Whether the idle threads sleep with monitor/mwait instead of hlt.
+static int use_mwait = 0;
+
+// Length of the time slice of a level in ticks.
+static inline uint32_t __slice(unsigned level)
+{
+    return 1 + (level >> 2);
+}
+
+// Index of the highest priority non-empty level.
+static inline unsigned __first_level(uint32_t bitmap)
+{
+    return __builtin_ctz(bitmap);
+}
+
+// Index of the lowest priority non-empty level.
+static inline unsigned __last_level(uint32_t bitmap)
+{
+    return 31 - __builtin_clz(bitmap);
+}
+
+static inline runqueue_t* __this_rq()
+{
+    return &runqueues[cpu_id()];
+}
+
+// Appends a thread to its level of a run queue.
+static void rq_push(runqueue_t *rq, thread_t *thread)
+{
+    unsigned level = thread->priority;
+
+    thread->state = THREAD_READY;
+    thread->next = NULL;
+
+    if (rq->tail[level])
+    {
+        rq->tail[level]->next = thread;
+    }
+    else
+    {
+        rq->head[level] = thread;
+    }
+
+    rq->tail[level] = thread;
+    rq->bitmap |= 1u << level;
+    rq->nr_ready++;
+}
+
+// Removes the first thread of a level, the level must not be empty.
+static thread_t* rq_pop(runqueue_t *rq, unsigned level)
+{
+    thread_t *thread = rq->head[level];
+
+    rq->head[level] = thread->next;
+
+    if (rq->head[level] == NULL)
+    {
+        rq->tail[level] = NULL;
+        rq->bitmap &= ~(1u << level);
+    }
+
+    thread->priority = level;
+    rq->nr_ready--;
+
+    return thread;
+}
+
+// Moves every ready thread to level 0.
+static void rq_boost(runqueue_t *rq)
+{
+    unsigned level;
+
+    for (level = 1; level < SCHED_LEVELS; level++)
+    {
+        if (rq->head[level] == NULL)
+        {
+            continue;
+        }
+
+        if (rq->tail[0])
+        {
+            rq->tail[0]->next = rq->head[level];
+        }
+        else
+        {
+            rq->head[0] = rq->head[level];
+        }
+
+        rq->tail[0] = rq->tail[level];
+        rq->head[level] = rq->tail[level] = NULL;
+    }
+
+    if (rq->bitmap)
+    {
+        rq->bitmap = 1;
+    }
+
+    if (rq->current)
+    {
+        rq->current->priority = 0;
+    }
+}
+
+// Pulls a thread from the busiest cpu if it has more work than this one.
+static void rq_balance(runqueue_t *rq)
+{
+    unsigned i;
+    thread_t *thread = NULL;
+    runqueue_t *busiest = rq;
+
+    for (i = 0; i < cpus_online; i++)
+    {
+        if (runqueues[i].nr_ready > busiest->nr_ready)
+        {
+            busiest = &runqueues[i];
+        }
+    }
+
+    if (busiest->nr_ready <= rq->nr_ready + 1)
+    {
+        return;
+    }
+
+    // Never wait for a remote lock here, try again next time.
+    if (!spin_trylock(&busiest->lock))
+    {
+        return;
+    }
+
+    // The lowest priority thread is the least likely to be cache hot. A
+    // thread whose cpu has not left its stack yet must stay.
+    if (busiest->bitmap)
+    {
+        i = __last_level(busiest->bitmap);
+
+        if (!busiest->head[i]->on_cpu)
+        {
+            thread = rq_pop(busiest, i);
+        }
+    }
+
+    spin_unlock(&busiest->lock);
+
+    if (thread)
+    {
+        thread->cpu = rq - runqueues;
+
+        spin_lock(&rq->lock);
+        rq_push(rq, thread);
+        spin_unlock(&rq->lock);
+    }
+}
+
+// Returns the thread that is executed at the moment.
+thread_t* sched_current()
+{
+    return __this_rq()->current;
+}
+
+// Returns whether the idle thread is running.
+int sched_is_idle()
+{
+    runqueue_t *rq = __this_rq();
+
+    return rq->current == rq->idle;
+}
+
+// Body of the idle threads, sleeps until there is work to do.
+void* sched_idle_loop(void *arg)
+{
+    runqueue_t *rq = __this_rq();
+    (void)arg;
+
+    while (1)
+    {
+        asm volatile("cli");
+
+        if (use_mwait)
+        {
+            // Armed before the check, a remote cpu enqueueing a thread
+            // writes the bitmap and wakes us up as well.
+            asm volatile("monitor" : : "a" (&rq->bitmap), "c" (0), "d" (0));
+        }
+
+        if (rq->bitmap)
+        {
+            thread_yield();
+            asm volatile("sti");
+            continue;
+        }
+
+        // sti delays interrupts by one instruction, so none can arrive
+        // between the check above and going to sleep.
+        if (use_mwait)
+        {
+            asm volatile("sti\n\t"
+                         "mwait" : : "a" (0), "c" (0) : "memory");
+        }
+        else
+        {
+            asm volatile("sti\n\t"
+                         "hlt" : : : "memory");
+        }
+    }
+
+    return NULL;
+}
+
+// Makes a thread ready, new threads go to the cpu with the least work.
+void sched_enqueue(thread_t *thread)
+{
+    unsigned i;
+    uint32_t eflags = irq_save();
+
+    if (thread->state == THREAD_NEW)
+    {
+        thread->cpu = cpu_id();
+
+        for (i = 0; i < cpus_online; i++)
+        {
+            if (runqueues[i].nr_ready < runqueues[thread->cpu].nr_ready)
+            {
+                thread->cpu = i;
+            }
+        }
+    }
+
+    spin_lock(&runqueues[thread->cpu].lock);
+    rq_push(&runqueues[thread->cpu], thread);
+    spin_unlock(&runqueues[thread->cpu].lock);
+
+    irq_restore(eflags);
+}
+
+// Saves the state of the current thread and returns the state of the next.
+cpu_state_t* sched_schedule(cpu_state_t *cpu)
+{
+    runqueue_t *rq = __this_rq();
+    thread_t *current = rq->current;
+    thread_t *next;
+
+    if (current == NULL)
+    {
+        return cpu;
+    }
+
+    current->cpu_state = cpu;
+
+    spin_lock(&rq->lock);
+
+    if (current != rq->idle)
+    {
+        if (rq->slice_left == 0)
+        {
+            // Used the whole slice, looks cpu bound.
+            if (current->priority < SCHED_LEVELS - 1)
+            {
+                current->priority++;
+            }
+        }
+        else if (rq->slice_left > __slice(current->priority) / 2)
+        {
+            // Gave up the cpu early, looks interactive.
+            if (current->priority > 0)
+            {
+                current->priority--;
+            }
+        }
+
+        if (current->state == THREAD_RUNNING)
+        {
+            rq_push(rq, current);
+        }
+    }
+
+    if (rq->bitmap)
+    {
+        next = rq_pop(rq, __first_level(rq->bitmap));
+    }
+    else
+    {
+        next = rq->idle;
+    }
+
+    spin_unlock(&rq->lock);
+
+    if (next != current)
+    {
+        TRACE(TRACE_SWITCH, current->tid, next->tid);
+        rq->prev = current;
+        fpu_switch(current);
+        vmm_activate(next->context);
+    }
+
+    next->state = THREAD_RUNNING;
+    next->on_cpu = 1;
+    rq->current = next;
+
+    // Entries from user mode start at the top of the thread's kernel stack.
+    if (next->stack)
+    {
+        gdt_set_kernel_stack(next->stack + THREAD_STACK_FRAMES * FRAME_SIZE);
+    }
+    rq->slice_left = __slice(next->priority);
+
+    return next->cpu_state;
+}
+
+// Called by intr_common_handler on the stack of the next thread after a
+// switch, the previous thread is no longer in use by this cpu.
+void sched_finish_switch()
+{
+    runqueue_t *rq = __this_rq();
+    thread_t *prev = rq->prev;
+    thread_t *joiner = NULL;
+
+    rq->prev = NULL;
+
+    spin_lock(&prev->lock);
+    prev->on_cpu = 0;
+
+    if (prev->state == THREAD_ZOMBIE)
+    {
+        prev->state = THREAD_DEAD;
+        joiner = prev->joiner;
+    }
+
+    // prev may be freed by thread_join() from here on.
+    spin_unlock(&prev->lock);
+
+    if (joiner)
+    {
+        sched_enqueue(joiner);
+    }
+}
+
+// Called on every timer tick, preempts the current thread after its slice.
+cpu_state_t* sched_tick(cpu_state_t *cpu)
+{
+    runqueue_t *rq = __this_rq();
+
+    if (rq->current == NULL)
+    {
+        return cpu;
+    }
+
+    if (--rq->boost_left == 0)
+    {
+        rq->boost_left = SCHED_BOOST_TICKS;
+
+        spin_lock(&rq->lock);
+        rq_boost(rq);
+        spin_unlock(&rq->lock);
+    }
+
+    if (--rq->balance_left == 0)
+    {
+        rq->balance_left = SCHED_BALANCE_TICKS;
+        rq_balance(rq);
+    }
+
+    if (rq->current == rq->idle)
+    {
+        // Do not let ready threads wait for the idle thread's slice.
+        return rq->bitmap ? sched_schedule(cpu) : cpu;
+    }
+
+    if (rq->slice_left > 0 && --rq->slice_left > 0)
+    {
+        return cpu;
+    }
+
+    // Preempted on the next tick after the read-side section ended.
+    if (this_cpu()->preempt_count)
+    {
+        return cpu;
+    }
+
+    return sched_schedule(cpu);
+}
+
+// Sets up the run queue of a cpu, current is the thread that is running on it.
+void sched_init_cpu(unsigned cpu, thread_t *current, thread_t *idle)
+{
+    runqueue_t *rq = &runqueues[cpu];
+
+    current->state = THREAD_RUNNING;
+    current->on_cpu = 1;
+    current->cpu = cpu;
+    idle->cpu = cpu;
+    idle->priority = SCHED_LEVELS - 1;
+
+    rq->lock.name = "runqueue";
+    rq->idle = idle;
+    rq->current = current;
+    rq->slice_left = __slice(current->priority);
+    rq->boost_left = SCHED_BOOST_TICKS;
+    rq->balance_left = SCHED_BALANCE_TICKS;
+
+    if (cpu == 0)
+    {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(1, &eax, &ebx, &ecx, &edx);
+        use_mwait = (ecx & CPUID_ECX_MONITOR) != 0;
+
+        register_interrupt_handler(INT_YIELD, sched_schedule);
+    }
+
+    cpus_online++;
+}
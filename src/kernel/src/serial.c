@@ -0,0 +1,80 @@
+#include "serial.h"
+#include <stdint.h>
+#include <stddef.h>
+#include "ports.h"
+
+static int present = 0;
+
+// Waits until the transmitter takes another byte and sends it.
+void serial_putc(char c)
+{
+    if (!present)
+    {
+        return;
+    }
+
+    while ((inb(SERIAL_COM1 + SERIAL_STATUS) & SERIAL_STATUS_EMPTY) == 0)
+    {
+        asm volatile("pause");
+    }
+
+    outb(SERIAL_COM1 + SERIAL_DATA, c);
+}
+
+void serial_write(const char *data, size_t size)
+{
+    while (size--)
+    {
+        serial_putc(*data++);
+    }
+}
+
+void serial_puts(const char *s)
+{
+    while (*s)
+    {
+        serial_putc(*s++);
+    }
+}
+
+// Sends a number as hexadecimal digits without leading zeros.
+void serial_put_hex(uint32_t value)
+{
+    const char digits[] = "0123456789abcdef";
+    char buf[8];
+    int i = 0;
+
+    do
+    {
+        buf[i++] = digits[value & 0xF];
+    } while (value >>= 4);
+
+    while (i--)
+    {
+        serial_putc(buf[i]);
+    }
+}
+
+// Sets up COM1 for 115200 baud 8N1 if there is a UART.
+void serial_init()
+{
+    uint16_t divisor = 115200 / SERIAL_BAUD;
+
+    // A missing UART does not keep what is written to the scratch register.
+    outb(SERIAL_COM1 + SERIAL_SCRATCH, 0x5A);
+
+    if (inb(SERIAL_COM1 + SERIAL_SCRATCH) != 0x5A)
+    {
+        return;
+    }
+
+    outb(SERIAL_COM1 + SERIAL_IRQ_ENABLE, 0);
+    outb(SERIAL_COM1 + SERIAL_LINE, SERIAL_LINE_DLAB);
+    outb(SERIAL_COM1 + SERIAL_DATA, divisor & 0xFF);
+    outb(SERIAL_COM1 + SERIAL_IRQ_ENABLE, divisor >> 8);
+    outb(SERIAL_COM1 + SERIAL_LINE, SERIAL_LINE_8N1);
+    outb(SERIAL_COM1 + SERIAL_FIFO, SERIAL_FIFO_ENABLE);
+    outb(SERIAL_COM1 + SERIAL_MODEM, SERIAL_MODEM_READY);
+
+    present = 1;
+}
@@ -0,0 +1,290 @@
+#include "smp.h"
+#include <stdint.h>
+#include <string.h>
+#include "apic.h"
+#include "console.h"
+#include "cpu.h"
+#include "fpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "paging.h"
+#include "perf.h"
+#include "pmm.h"
+#include "ports.h"
+#include "sched.h"
+#include "syscall.h"
+#include "thread.h"
+#include "timer.h"
+
+/*
+Application processor start up
+
+The MP floating pointer structure is searched in the first KB of the EBDA,
+the last KB of base memory and the BIOS ROM. Its configuration table lists a
+processor entry for every enabled cpu, each of them except the bootstrap
+processor is started with INIT-SIPI-SIPI. The processor starts in real mode
+in trampoline.S, which switches to protected mode with paging enabled and
+calls ap_main() on a stack allocated here.
+*/
+
+#define MP_FLOAT_SIG    0x5F504D5F  // "_MP_"
+#define MP_CONFIG_SIG   0x504D4350  // "PCMP"
+
+#define MP_PROCESSOR    0
+#define MP_CPU_ENABLED  0x01
+
+#define STARTUP_TIMEOUT 100         // timer ticks
+
+typedef struct mp_floating
+{
+    uint32_t signature;
+    uint32_t config;
+    uint8_t length;             // in 16 byte units
+    uint8_t revision;
+    uint8_t checksum;
+    uint8_t features[5];
+} __attribute__((packed)) mp_floating_t;
+
+typedef struct mp_config
+{
+    uint32_t signature;
+    uint16_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entries;
+    uint32_t lapic;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed)) mp_config_t;
+
+typedef struct mp_processor
+{
+    uint8_t type;
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed)) mp_processor_t;
+
+extern const void trampoline_start;
+extern const void trampoline_args;
+extern const void trampoline_end;
+
+static percpu_t cpus[MAX_CPUS];
+static unsigned cpu_count = 1;
+// Set by an application processor once it is up.
+static volatile int ap_started;
+
+// Sums up the bytes of a table, valid tables sum up to 0.
+static uint8_t checksum(const void *addr, size_t length)
+{
+    const uint8_t *ptr = addr;
+    uint8_t sum = 0;
+
+    while (length--)
+    {
+        sum += *ptr++;
+    }
+
+    return sum;
+}
+
+// Searches for the MP floating pointer structure in a memory range.
+static mp_floating_t* mp_search(uintptr_t start, size_t length)
+{
+    mp_floating_t *mp = (mp_floating_t *)start;
+    mp_floating_t *end = (mp_floating_t *)(start + length);
+
+    for (; mp < end; mp++)
+    {
+        if (mp->signature == MP_FLOAT_SIG &&
+            checksum(mp, mp->length * 16) == 0)
+        {
+            return mp;
+        }
+    }
+
+    return NULL;
+}
+
+static mp_floating_t* mp_find()
+{
+    mp_floating_t *mp = NULL;
+    uintptr_t ebda = *(uint16_t *)0x40E << 4;
+
+    if (ebda >= 0x80000 && ebda < 0xA0000)
+    {
+        mp = mp_search(ebda, 0x400);
+    }
+
+    if (mp == NULL)
+    {
+        mp = mp_search(0x9FC00, 0x400);
+    }
+
+    if (mp == NULL)
+    {
+        mp = mp_search(0xF0000, 0x10000);
+    }
+
+    return mp;
+}
+
+// Waits at least a number of microseconds.
+static void udelay(unsigned us)
+{
+    while (us--)
+    {
+        io_wait_cycle();
+    }
+}
+
+// Entry of the application processors, called by trampoline.S.
+static void ap_main(unsigned cpu)
+{
+    paging_init_cpu();
+    gdt_init_cpu(cpu);
+    idt_init_cpu();
+    lapic_init_cpu();
+    perf_init_cpu();
+    syscall_init_cpu();
+    fpu_init_cpu();
+    thread_init_cpu(cpu, cpus[cpu].stack);
+    lapic_timer_start();
+
+    ap_started = 1;
+
+    // The start up flow is the idle thread, which enables interrupts.
+    sched_idle_loop(NULL);
+}
+
+// Starts an application processor and waits until it is up.
+static int start_ap(unsigned cpu, uint32_t apic_id)
+{
+    uint32_t tick, cr3;
+    smp_trampoline_args_t *args = (smp_trampoline_args_t *)(SMP_TRAMPOLINE +
+        ((uintptr_t)&trampoline_args - (uintptr_t)&trampoline_start));
+    void *stack = alloc_frame(THREAD_STACK_FRAMES);
+
+    if (stack == PMM_NO_MEM)
+    {
+        return 0;
+    }
+
+    asm volatile("mov %%cr3, %0" : "=r" (cr3));
+
+    cpus[cpu].stack = (uintptr_t)stack;
+    args->cr3 = cr3;
+    args->stack = (uintptr_t)stack + THREAD_STACK_FRAMES * FRAME_SIZE;
+    args->entry = (uint32_t)ap_main;
+    args->cpu = cpu;
+    ap_started = 0;
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    udelay(10000);
+
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+    udelay(200);
+    lapic_send_ipi(apic_id, LAPIC_ICR_STARTUP | (SMP_TRAMPOLINE >> 12));
+
+    tick = timer_get_ticks();
+
+    while (!ap_started)
+    {
+        if (timer_get_ticks() - tick > STARTUP_TIMEOUT)
+        {
+            free_frame((uintptr_t)stack, THREAD_STACK_FRAMES);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Returns the per-cpu data of a cpu.
+percpu_t* smp_cpu(unsigned cpu)
+{
+    return &cpus[cpu];
+}
+
+// Returns the number of running cpus.
+unsigned smp_cpu_count()
+{
+    return cpu_count;
+}
+
+// Brings up every application processor listed in the MP configuration.
+void smp_init()
+{
+    unsigned i;
+    uint8_t *entry;
+    mp_config_t *config;
+    mp_processor_t *proc;
+    mp_floating_t *mp = mp_find();
+
+    lapic_init();
+
+    if (mp == NULL || mp->config == 0 || mp->config >= 0x00400000)
+    {
+        kprintf("smp: no MP configuration, 1 cpu\n");
+        return;
+    }
+
+    config = (mp_config_t *)mp->config;
+
+    if (config->signature != MP_CONFIG_SIG ||
+        checksum(config, config->length) != 0)
+    {
+        kprintf("smp: invalid MP configuration, 1 cpu\n");
+        return;
+    }
+
+    lapic_timer_calibrate();
+
+    memcpy((void *)SMP_TRAMPOLINE, &trampoline_start,
+        (uintptr_t)&trampoline_end - (uintptr_t)&trampoline_start);
+
+    entry = (uint8_t *)(config + 1);
+
+    for (i = 0; i < config->entries; i++)
+    {
+        if (*entry != MP_PROCESSOR)
+        {
+            // All other entries are 8 bytes long.
+            entry += 8;
+            continue;
+        }
+
+        proc = (mp_processor_t *)entry;
+        entry += sizeof(mp_processor_t);
+
+        if ((proc->flags & MP_CPU_ENABLED) == 0 ||
+            proc->apic_id == this_cpu()->apic_id)
+        {
+            continue;
+        }
+
+        if (cpu_count >= MAX_CPUS)
+        {
+            break;
+        }
+
+        if (start_ap(cpu_count, proc->apic_id))
+        {
+            cpu_count++;
+        }
+        else
+        {
+            kprintf("smp: cpu with APIC id %u did not start\n", proc->apic_id);
+        }
+    }
+
+    kprintf("smp: %u cpus online\n", cpu_count);
+}
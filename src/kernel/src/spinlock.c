@@ -0,0 +1,114 @@
+#include "spinlock.h"
+#include <stdint.h>
+#include "atomic.h"
+#include "console.h"
+
+// Locks that were contended at least once, for lockstat_print().
+static spinlock_t *volatile contended_locks = NULL;
+static mcs_lock_t *volatile contended_mcs_locks = NULL;
+
+// Pushes a lock onto a list of contended locks, lock free since the holders
+// of different locks may register them at the same time.
+static void lockstat_register(void *volatile *list, void *lock, void **next)
+{
+    void *head;
+
+    do
+    {
+        head = *list;
+        *next = head;
+    } while (cmpxchg((volatile uint32_t *)list,
+        (uint32_t)head, (uint32_t)lock) != (uint32_t)head);
+}
+
+// Slow path of spin_lock(), waits for a ticket and counts the contention.
+void __spin_lock_contended(spinlock_t *lock, uint16_t ticket)
+{
+    uint32_t spins = 0;
+
+    while (lock->owner != ticket)
+    {
+        cpu_relax();
+        spins++;
+    }
+
+    if (lock->contended++ == 0)
+    {
+        lockstat_register((void *volatile *)&contended_locks, lock,
+            (void **)&lock->stat_next);
+    }
+
+    lock->spins += spins;
+}
+
+// Takes an MCS lock, node has to stay valid until mcs_unlock().
+void mcs_lock(mcs_lock_t *lock, mcs_node_t *node)
+{
+    mcs_node_t *prev;
+
+    node->next = NULL;
+    node->locked = 1;
+
+    prev = (mcs_node_t *)xchg((volatile uint32_t *)&lock->tail, (uint32_t)node);
+
+    if (prev)
+    {
+        // Queue behind the previous waiter and spin on our own node.
+        prev->next = node;
+
+        while (node->locked)
+        {
+            cpu_relax();
+        }
+
+        if (lock->contended++ == 0)
+        {
+            lockstat_register((void *volatile *)&contended_mcs_locks, lock,
+                (void **)&lock->stat_next);
+        }
+    }
+
+    lock->acquired++;
+}
+
+// Releases an MCS lock and hands it to the next waiter.
+void mcs_unlock(mcs_lock_t *lock, mcs_node_t *node)
+{
+    if (node->next == NULL)
+    {
+        // No known successor, try to release the lock completely.
+        if (cmpxchg((volatile uint32_t *)&lock->tail,
+            (uint32_t)node, 0) == (uint32_t)node)
+        {
+            return;
+        }
+
+        // A waiter swapped the tail but did not link itself in yet.
+        while (node->next == NULL)
+        {
+            cpu_relax();
+        }
+    }
+
+    node->next->locked = 0;
+}
+
+// Prints the statistics of every lock that was contended.
+void lockstat_print()
+{
+    spinlock_t *lock;
+    mcs_lock_t *mcs;
+
+    for (lock = contended_locks; lock; lock = lock->stat_next)
+    {
+        kprintf("lock %s: acquired %u, contended %u, spins %u\n",
+            lock->name ? lock->name : "?",
+            lock->acquired, lock->contended, lock->spins);
+    }
+
+    for (mcs = contended_mcs_locks; mcs; mcs = mcs->stat_next)
+    {
+        kprintf("mcs lock %s: acquired %u, contended %u\n",
+            mcs->name ? mcs->name : "?", mcs->acquired, mcs->contended);
+    }
+}
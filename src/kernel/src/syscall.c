@@ -0,0 +1,215 @@
+#include "syscall.h"
+#include <stdint.h>
+#include "cpu.h"
+#include "cpustat.h"
+#include "gdt.h"
+#include "interrupt.h"
+#include "console.h"
+#include "paging.h"
+#include "pmm.h"
+#include "rcu.h"
+#include "sched.h"
+#include "smp.h"
+#include "thread.h"
+#include "uaccess.h"
+
+#define MSR_SYSENTER_CS     0x174
+#define MSR_SYSENTER_ESP    0x175
+#define MSR_SYSENTER_EIP    0x176
+
+#define WRITE_CHUNK         128
+
+extern void sysenter_entry();
+
+static syscall_t syscalls[SYSCALL_MAX];
+static int has_sysenter = 0;
+
+// Ends the calling thread, syscall_callback() switches away from it.
+static uint32_t sys_exit(uint32_t code, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+    (void)arg2, (void)arg3, (void)arg4;
+
+    thread_mark_exited((void *)code);
+
+    return 0;
+}
+
+static uint32_t sys_yield(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+    (void)arg1, (void)arg2, (void)arg3, (void)arg4;
+
+    thread_yield();
+
+    return 0;
+}
+
+static uint32_t sys_gettid(uint32_t arg1, uint32_t arg2, uint32_t arg3, uint32_t arg4)
+{
+    (void)arg1, (void)arg2, (void)arg3, (void)arg4;
+
+    return thread_current()->tid;
+}
+
+// Prints a user buffer to the console, returns the number of bytes written.
+static uint32_t sys_write(uint32_t buf, uint32_t length, uint32_t arg3, uint32_t arg4)
+{
+    char chunk[WRITE_CHUNK + 1];
+    uint32_t done = 0;
+    size_t size;
+    (void)arg3, (void)arg4;
+
+    if (!access_ok((void *)buf, length))
+    {
+        return SYSCALL_EFAULT;
+    }
+
+    while (done < length)
+    {
+        size = length - done < WRITE_CHUNK ? length - done : WRITE_CHUNK;
+
+        if (copy_from_user(chunk, (void *)(buf + done), size))
+        {
+            return done ? done : SYSCALL_EFAULT;
+        }
+
+        chunk[size] = '\0';
+        kprintf("%s", chunk);
+        done += size;
+    }
+
+    return done;
+}
+
+// Remaps pages of the caller into the address space of another thread.
+static uint32_t sys_vm_transfer(uint32_t tid, uint32_t src, uint32_t dst, uint32_t pages)
+{
+    vmm_context_t *src_context = thread_current()->context;
+    thread_t *target;
+    int result = VMM_EFAULT;
+
+    if (src_context == NULL)
+    {
+        return SYSCALL_EINVAL;
+    }
+
+    rcu_read_lock();
+
+    target = thread_find(tid);
+
+    if (target && target->context)
+    {
+        result = vmm_transfer(src_context, src, target->context,
+            dst & ~(FRAME_SIZE - 1), pages, dst & (FRAME_SIZE - 1));
+    }
+
+    rcu_read_unlock();
+
+    switch (result)
+    {
+        case 0:
+            return 0;
+        case VMM_EFAULT:
+            return SYSCALL_EFAULT;
+        case VMM_ENOMEM:
+            return SYSCALL_ENOMEM;
+        default:
+            return SYSCALL_EINVAL;
+    }
+}
+
+// Copies the idle, interrupt and thread times of a cpu to a user buffer.
+static uint32_t sys_cpustat(uint32_t cpu, uint32_t buf, uint32_t arg3, uint32_t arg4)
+{
+    cpustat_t stat;
+    (void)arg3, (void)arg4;
+
+    if (cpu >= smp_cpu_count())
+    {
+        return SYSCALL_EINVAL;
+    }
+
+    cpustat_get(cpu, &stat);
+
+    if (copy_to_user((void *)buf, &stat, sizeof(stat)))
+    {
+        return SYSCALL_EFAULT;
+    }
+
+    return 0;
+}
+
+// Dispatches int 0x30 and sysenter to the registered system call.
+static cpu_state_t* syscall_callback(cpu_state_t *cpu)
+{
+    syscall_t handler = cpu->eax < SYSCALL_MAX ? syscalls[cpu->eax] : NULL;
+
+    if (handler == NULL)
+    {
+        cpu->eax = SYSCALL_ENOSYS;
+        return cpu;
+    }
+
+    // System calls may take a while and can be preempted.
+    asm volatile("sti");
+    cpu->eax = handler(cpu->ebx, cpu->esi, cpu->edi, cpu->ebp);
+    asm volatile("cli");
+
+    if (thread_current()->state == THREAD_ZOMBIE)
+    {
+        return sched_schedule(cpu);
+    }
+
+    return cpu;
+}
+
+// Returns whether system calls can be made with sysenter.
+int syscall_has_sysenter()
+{
+    return has_sysenter;
+}
+
+void syscall_register(unsigned nr, syscall_t handler)
+{
+    syscalls[nr] = handler;
+}
+
+// Configures the sysenter MSRs of the executing cpu.
+void syscall_init_cpu()
+{
+    if (!has_sysenter)
+    {
+        return;
+    }
+
+    // sysenter loads cs and ss = cs + 8, sysexit cs + 16 and ss = cs + 24,
+    // which matches the layout of the gdt.
+    wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_CODE);
+    wrmsr(MSR_SYSENTER_ESP, (uint32_t)gdt_get_entry_stack(cpu_id()));
+    wrmsr(MSR_SYSENTER_EIP, (uint32_t)sysenter_entry);
+}
+
+void syscall_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint32_t family, model, stepping;
+
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    family = (eax >> 8) & 0xF;
+    model = (eax >> 4) & 0xF;
+    stepping = eax & 0xF;
+
+    // Early Pentium Pro report SEP without supporting it.
+    has_sysenter = (edx & CPUID_EDX_SEP) &&
+        !(family == 6 && model < 3 && stepping < 3);
+
+    syscall_register(SYS_EXIT, sys_exit);
+    syscall_register(SYS_YIELD, sys_yield);
+    syscall_register(SYS_GETTID, sys_gettid);
+    syscall_register(SYS_WRITE, sys_write);
+    syscall_register(SYS_VM_TRANSFER, sys_vm_transfer);
+    syscall_register(SYS_CPUSTAT, sys_cpustat);
+
+    register_interrupt_handler(INT_SYSCALL, syscall_callback);
+
+    syscall_init_cpu();
+}
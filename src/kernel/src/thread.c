@@ -0,0 +1,271 @@
+#include "thread.h"
+#include <stdint.h>
+#include <string.h>
+#include "kernel.h"
+#include "atomic.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "gdt.h"
+#include "pmm.h"
+#include "console.h"
+#include "fpu.h"
+#include "rcu.h"
+
+#define EFLAGS_IF 0x202
+
+// The flow of control that entered kmain().
+static thread_t boot_thread;
+
+static volatile uint32_t next_tid = 0;
+
+// Threads created with thread_create(), read under RCU.
+static thread_t *threads = NULL;
+static spinlock_t threads_lock = SPINLOCK_INIT("threads");
+
+// First function of every new thread, runs its entry and exits with its result.
+static void thread_entry()
+{
+    thread_t *current = sched_current();
+
+    thread_exit(current->entry(current->arg));
+}
+
+// Sets up a thread with its own kernel stack, the thread is not started.
+static thread_t* thread_alloc(thread_func_t entry, void *arg)
+{
+    thread_t *thread;
+    cpu_state_t *cpu;
+    uintptr_t stack = (uintptr_t)alloc_frame(THREAD_STACK_FRAMES);
+
+    if ((void *)stack == PMM_NO_MEM)
+    {
+        return NULL;
+    }
+
+    // The thread struct lives at the bottom of its stack and the initial
+    // cpu state at the top, ready to be popped by intr_common_handler.
+    thread = (thread_t *)stack;
+    cpu = (cpu_state_t *)(stack + THREAD_STACK_FRAMES * FRAME_SIZE) - 1;
+
+    memset(thread, 0, sizeof(thread_t));
+    memset(cpu, 0, sizeof(cpu_state_t));
+
+    cpu->ds = GDT_KERNEL_DATA;
+    cpu->gs = GDT_PERCPU;
+    cpu->eip = (uint32_t)thread_entry;
+    cpu->cs = GDT_KERNEL_CODE;
+    cpu->eflags = EFLAGS_IF;
+
+    thread->tid = xadd(&next_tid, 1);
+    thread->lock.name = "thread";
+    thread->state = THREAD_NEW;
+    thread->cpu_state = cpu;
+    thread->stack = stack;
+    thread->entry = entry;
+    thread->arg = arg;
+
+    return thread;
+}
+
+// Returns the thread that is executed at the moment.
+thread_t* thread_current()
+{
+    return sched_current();
+}
+
+// Adds a new thread to the thread list and makes it ready to run.
+static void thread_start(thread_t *thread)
+{
+    uint32_t eflags = spin_lock_irqsave(&threads_lock);
+
+    thread->all_next = threads;
+    rcu_assign_pointer(threads, thread);
+    spin_unlock_irqrestore(&threads_lock, eflags);
+
+    sched_enqueue(thread);
+}
+
+// Creates a kernel thread running entry(arg) and makes it ready to run.
+thread_t* thread_create(thread_func_t entry, void *arg)
+{
+    thread_t *thread = thread_alloc(entry, arg);
+
+    if (thread == NULL)
+    {
+        return NULL;
+    }
+
+    thread_start(thread);
+
+    return thread;
+}
+
+// Creates a thread that runs in user mode at eip with its stack pointer at
+// esp in an address space, which is destroyed together with the thread.
+thread_t* thread_create_user(vmm_context_t *context, uintptr_t eip, uintptr_t esp)
+{
+    thread_t *thread = thread_alloc(NULL, NULL);
+    cpu_state_t *cpu;
+
+    if (thread == NULL)
+    {
+        return NULL;
+    }
+
+    // iret pops useresp and ss as well when it returns to ring 3.
+    cpu = thread->cpu_state;
+    cpu->ds = GDT_USER_DATA | GDT_RPL_USER;
+    cpu->gs = GDT_USER_DATA | GDT_RPL_USER;
+    cpu->eip = eip;
+    cpu->cs = GDT_USER_CODE | GDT_RPL_USER;
+    cpu->useresp = esp;
+    cpu->ss = GDT_USER_DATA | GDT_RPL_USER;
+    thread->context = context;
+
+    thread_start(thread);
+
+    return thread;
+}
+
+// Looks up a thread by its id, must be called within rcu_read_lock().
+thread_t* thread_find(uint32_t tid)
+{
+    thread_t *thread = rcu_dereference(threads);
+
+    while (thread && thread->tid != tid)
+    {
+        thread = rcu_dereference(thread->all_next);
+    }
+
+    return thread;
+}
+
+// Removes a thread from the thread list.
+static void thread_unlink(thread_t *thread)
+{
+    thread_t **link;
+    uint32_t eflags = spin_lock_irqsave(&threads_lock);
+
+    for (link = &threads; *link; link = &(*link)->all_next)
+    {
+        if (*link == thread)
+        {
+            rcu_assign_pointer(*link, thread->all_next);
+            break;
+        }
+    }
+
+    spin_unlock_irqrestore(&threads_lock, eflags);
+}
+
+// Gives up the cpu to the next ready thread.
+void thread_yield()
+{
+    asm volatile("int %0" : : "i" (INT_YIELD) : "memory");
+}
+
+// Marks the current thread as exited and leaves interrupts off, it stops
+// running at the next switch. Interrupt handlers end a thread this way and
+// return sched_schedule() of their cpu state, so that interrupt_handler()
+// still finishes the entry.
+void thread_mark_exited(void *retval)
+{
+    thread_t *current;
+
+    irq_save();
+
+    current = sched_current();
+    current->retval = retval;
+    current->state = THREAD_ZOMBIE;
+}
+
+// Terminates the current thread, the result can be collected by thread_join().
+__attribute__((noreturn)) void thread_exit(void *retval)
+{
+    thread_mark_exited(retval);
+
+    // The joiner is woken up by sched_finish_switch() once we left the stack.
+    thread_yield();
+
+    PANIC("Zombie thread was scheduled!");
+}
+
+// Waits until a thread has exited, frees it and returns its result.
+void* thread_join(thread_t *thread)
+{
+    void *retval;
+    thread_t *current;
+    uint32_t eflags = irq_save();
+
+    spin_lock(&thread->lock);
+
+    if (thread->state != THREAD_DEAD)
+    {
+        current = sched_current();
+        thread->joiner = current;
+        current->state = THREAD_BLOCKED;
+        spin_unlock(&thread->lock);
+
+        thread_yield();
+    }
+    else
+    {
+        spin_unlock(&thread->lock);
+    }
+
+    irq_restore(eflags);
+
+    retval = thread->retval;
+
+    // Readers that found the thread in the list are done after the grace
+    // period.
+    thread_unlink(thread);
+    synchronize_rcu();
+
+    if (thread->context)
+    {
+        vmm_destroy_context(thread->context);
+    }
+
+    fpu_release(thread);
+
+    if (thread->stack)
+    {
+        free_frame(thread->stack, THREAD_STACK_FRAMES);
+    }
+
+    return retval;
+}
+
+// Turns the start up flow of an application processor into its idle thread,
+// which goes on with sched_idle_loop() and is never freed. The thread struct
+// lives at the bottom of the stack like for every other thread.
+void thread_init_cpu(unsigned cpu, uintptr_t stack)
+{
+    thread_t *idle_thread = (thread_t *)stack;
+
+    memset(idle_thread, 0, sizeof(thread_t));
+    idle_thread->tid = xadd(&next_tid, 1);
+    idle_thread->lock.name = "thread";
+    idle_thread->stack = stack;
+
+    sched_init_cpu(cpu, idle_thread, idle_thread);
+}
+
+// Turns the running flow of control into the boot thread and starts threading.
+void thread_init()
+{
+    thread_t *idle_thread = thread_alloc(sched_idle_loop, NULL);
+
+    if (idle_thread == NULL)
+    {
+        PANIC("No memory for the idle thread!");
+    }
+
+    boot_thread.tid = xadd(&next_tid, 1);
+    boot_thread.stack = 0;
+
+    sched_init_cpu(0, &boot_thread, idle_thread);
+
+    kprintf("threads initialized\n");
+}
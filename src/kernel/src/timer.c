@@ -2,14 +2,45 @@
 #include <stdint.h>
 #include "ports.h"
 #include "interrupt.h"
-#include "console.h"
+#include "profile.h"
+#include "sched.h"
+#include "seqlock.h"
 
-static uint32_t tick = 0;
+// Only written by the timer interrupt on the bootstrap processor.
+static volatile uint64_t tick = 0;
+static seqcount_t tick_seq = SEQCOUNT_INIT;
 
-static void timer_callback(cpu_state_t cpu)
+static cpu_state_t* timer_callback(cpu_state_t *cpu)
 {
+    write_seqcount_begin(&tick_seq);
     tick++;
-    kprintf("Timer (0x%x): %u\n", cpu.int_no, tick);
+    write_seqcount_end(&tick_seq);
+
+    profile_tick(cpu);
+
+    return sched_tick(cpu);
+}
+
+// Returns the number of timer ticks since timer_init(), wraps around.
+uint32_t timer_get_ticks()
+{
+    // The low dword is read atomically.
+    return (uint32_t)tick;
+}
+
+// Returns the number of timer ticks since timer_init().
+uint64_t timer_get_ticks64()
+{
+    uint32_t sequence;
+    uint64_t ticks;
+
+    do
+    {
+        sequence = read_seqcount_begin(&tick_seq);
+        ticks = tick;
+    } while (read_seqcount_retry(&tick_seq, sequence));
+
+    return ticks;
 }
 
 void timer_init(uint32_t frequency)
@@ -0,0 +1,183 @@
+#include "trace.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "atomic.h"
+#include "cpu.h"
+#include "pmm.h"
+#include "serial.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+
+#define TRACE_RECORDS (TRACE_BUFFER / sizeof(trace_record_t))
+
+// Defined in kernel.ld.
+extern const tracepoint_t tracepoints_start[];
+extern const tracepoint_t tracepoints_end[];
+
+static const uint8_t trace_nop[5] = { 0x0F, 0x1F, 0x44, 0x00, 0x00 };
+
+// Ring buffer of a cpu, head counts every record ever written.
+typedef struct trace_cpu
+{
+    trace_record_t *buffer;
+    volatile uint32_t head;
+} trace_cpu_t;
+
+static trace_cpu_t cpus[MAX_CPUS];
+static uint32_t trace_events = 0;
+// Serializes patching the tracepoints.
+static spinlock_t trace_lock = SPINLOCK_INIT("trace");
+// Time stamp and tick of trace_start() to convert the time stamps.
+static uint64_t start_tsc;
+static uint64_t start_tick;
+
+// Appends a record to the buffer of this cpu, reached through an enabled
+// tracepoint. Interrupts nesting on the cpu take the next slot.
+void __trace_record(uint32_t event, uint32_t a, uint32_t b)
+{
+    trace_cpu_t *tc = &cpus[cpu_id()];
+    trace_record_t *record;
+
+    if (tc->buffer == NULL)
+    {
+        return;
+    }
+
+    record = &tc->buffer[xadd(&tc->head, 1) & (TRACE_RECORDS - 1)];
+    record->stamp = (rdtsc() << 16) | event;
+    record->a = a;
+    record->b = b;
+}
+
+// Turns the nop of a tracepoint into a jump to its record code or back.
+// The instruction lies within one aligned qword and is replaced at once,
+// other cpus either execute the old or the new one.
+static void trace_patch(const tracepoint_t *tp, int enable)
+{
+    volatile uint64_t *qword = (volatile uint64_t *)tp->site;
+    int32_t rel = tp->target - (tp->site + 5);
+    uint64_t old, new;
+    uint8_t *bytes = (uint8_t *)&new;
+
+    do
+    {
+        old = *qword;
+        new = old;
+
+        if (enable)
+        {
+            bytes[0] = 0xE9;
+            memcpy(bytes + 1, &rel, sizeof(rel));
+        }
+        else
+        {
+            memcpy(bytes, trace_nop, sizeof(trace_nop));
+        }
+    } while (cmpxchg64(qword, old, new) != old);
+}
+
+// Patches every tracepoint whose event changes to the events of a mask.
+static void trace_set(uint32_t events)
+{
+    const tracepoint_t *tp;
+    uint32_t eax, ebx, ecx, edx;
+
+    for (tp = tracepoints_start; tp < tracepoints_end; tp++)
+    {
+        if (((events ^ trace_events) >> tp->event) & 1)
+        {
+            trace_patch(tp, (events >> tp->event) & 1);
+        }
+    }
+
+    trace_events = events;
+
+    // Serializes this cpu, it must not run stale prefetched code.
+    cpuid(0, &eax, &ebx, &ecx, &edx);
+}
+
+// Enables the tracepoints of a mask of events, the buffers are emptied
+// first.
+int trace_start(uint32_t events)
+{
+    unsigned i;
+    uint32_t eflags = spin_lock_irqsave(&trace_lock);
+
+    trace_set(0);
+
+    for (i = 0; i < smp_cpu_count(); i++)
+    {
+        if (cpus[i].buffer == NULL)
+        {
+            cpus[i].buffer = alloc_frame(TRACE_BUFFER / FRAME_SIZE);
+
+            if ((void *)cpus[i].buffer == PMM_NO_MEM)
+            {
+                cpus[i].buffer = NULL;
+                spin_unlock_irqrestore(&trace_lock, eflags);
+                return TRACE_ENOMEM;
+            }
+        }
+
+        cpus[i].head = 0;
+    }
+
+    start_tsc = rdtsc();
+    start_tick = timer_get_ticks64();
+
+    trace_set(events & TRACE_ALL);
+
+    spin_unlock_irqrestore(&trace_lock, eflags);
+
+    return 0;
+}
+
+// Disables every tracepoint, the buffers keep their records.
+void trace_stop()
+{
+    uint32_t eflags = spin_lock_irqsave(&trace_lock);
+
+    trace_set(0);
+
+    spin_unlock_irqrestore(&trace_lock, eflags);
+}
+
+// Sends the buffers over the serial port, oldest record first.
+void trace_dump()
+{
+    uint64_t ticks = timer_get_ticks64() - start_tick;
+    uint64_t cycles = rdtsc() - start_tsc;
+    uint32_t count, first, i;
+    unsigned cpu;
+
+    serial_puts("trace begin ");
+    serial_put_hex(smp_cpu_count());
+    serial_putc(' ');
+    serial_put_hex(ticks ? (uint32_t)div64(cycles, ticks) : 0);
+    serial_putc(' ');
+    serial_put_hex(TIMER_FREQUENCY);
+    serial_putc('\n');
+
+    for (cpu = 0; cpu < smp_cpu_count(); cpu++)
+    {
+        count = cpus[cpu].buffer ? cpus[cpu].head : 0;
+        first = count > TRACE_RECORDS ? count - TRACE_RECORDS : 0;
+        count -= first;
+
+        serial_puts("cpu ");
+        serial_put_hex(cpu);
+        serial_putc(' ');
+        serial_put_hex(count);
+        serial_putc('\n');
+
+        for (i = first; i < first + count; i++)
+        {
+            serial_write((const char *)&cpus[cpu].buffer[i & (TRACE_RECORDS - 1)],
+                sizeof(trace_record_t));
+        }
+    }
+
+    serial_puts("trace end\n");
+}
@@ -0,0 +1,48 @@
+#include "uaccess.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Defined in kernel.ld.
+extern const exception_entry_t ex_table_start[];
+extern const exception_entry_t ex_table_end[];
+
+// Defined in copy_user.S, returns the number of bytes that were not copied.
+extern size_t __copy_user(void *dst, const void *src, size_t size);
+
+// Returns the fixup address of a faulting instruction, 0 if it has none.
+uintptr_t search_exception_table(uintptr_t eip)
+{
+    const exception_entry_t *entry;
+
+    for (entry = ex_table_start; entry < ex_table_end; entry++)
+    {
+        if (entry->insn == eip)
+        {
+            return entry->fixup;
+        }
+    }
+
+    return 0;
+}
+
+// Copies from user space, returns the number of bytes that were not copied.
+size_t copy_from_user(void *dst, const void *src, size_t size)
+{
+    if (!access_ok(src, size))
+    {
+        return size;
+    }
+
+    return __copy_user(dst, src, size);
+}
+
+// Copies to user space, returns the number of bytes that were not copied.
+size_t copy_to_user(void *dst, const void *src, size_t size)
+{
+    if (!access_ok(dst, size))
+    {
+        return size;
+    }
+
+    return __copy_user(dst, src, size);
+}
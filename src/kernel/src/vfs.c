@@ -0,0 +1,129 @@
+#include "vfs.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "paging.h"
+#include "pmm.h"
+#include "pagecache.h"
+
+// Index of all files by path, only built at boot and never changed after.
+static vfs_file_t *buckets[VFS_HASH_BUCKETS];
+
+// FNV-1a hash of a path.
+static uint32_t vfs_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*path)
+    {
+        hash = (hash ^ (uint8_t)*path++) * 16777619u;
+    }
+
+    return hash;
+}
+
+// Adds files to the index.
+void vfs_register(vfs_file_t *files, size_t count)
+{
+    size_t i;
+    unsigned bucket;
+
+    for (i = 0; i < count; i++)
+    {
+        files[i].hash = vfs_hash(files[i].path);
+        bucket = files[i].hash % VFS_HASH_BUCKETS;
+        files[i].hash_next = buckets[bucket];
+        buckets[bucket] = &files[i];
+    }
+}
+
+// Looks up a file by its absolute path, returns NULL if there is none.
+vfs_file_t* vfs_open(const char *path)
+{
+    uint32_t hash;
+    vfs_file_t *file;
+
+    while (*path == '/')
+    {
+        path++;
+    }
+
+    hash = vfs_hash(path);
+
+    for (file = buckets[hash % VFS_HASH_BUCKETS]; file; file = file->hash_next)
+    {
+        if (file->hash == hash && strcmp(file->path, path) == 0)
+        {
+            return file;
+        }
+    }
+
+    return NULL;
+}
+
+// Points data at the contents of a file from offset on, nothing is copied.
+// Returns the number of bytes available there, at most size. Files that are
+// not in memory are read a page at a time, the page stays in memory until
+// vfs_release() is called with the same offset.
+size_t vfs_read(vfs_file_t *file, size_t offset, size_t size, const void **data)
+{
+    cache_page_t *page;
+    size_t length;
+
+    if (offset >= file->size)
+    {
+        return 0;
+    }
+
+    length = file->size - offset < size ? file->size - offset : size;
+
+    if (file->data)
+    {
+        *data = file->data + offset;
+        return length;
+    }
+
+    page = pagecache_get(file, offset / FRAME_SIZE);
+
+    if (page == NULL)
+    {
+        return 0;
+    }
+
+    *data = (const uint8_t *)page->frame + offset % FRAME_SIZE;
+
+    return length < FRAME_SIZE - offset % FRAME_SIZE ?
+        length : FRAME_SIZE - offset % FRAME_SIZE;
+}
+
+// Ends a vfs_read() with the same offset.
+void vfs_release(vfs_file_t *file, size_t offset)
+{
+    if (file->data == NULL)
+    {
+        pagecache_release(file, offset / FRAME_SIZE);
+    }
+}
+
+// Maps a part of a file into an address space. Pages are mapped from the
+// page cache when they are touched, writable mappings are private and
+// copy-on-write. The offset has to be at the same position within a page
+// as the address.
+int vfs_mmap(vfs_file_t *file, vmm_context_t *context, uintptr_t v_addr, size_t offset, size_t size, uint32_t flags)
+{
+    if (offset % FRAME_SIZE != v_addr % FRAME_SIZE || offset > file->size)
+    {
+        return VFS_EINVAL;
+    }
+
+    switch (vmm_add_file_region(context, v_addr, size, flags, file, offset,
+        file->size - offset))
+    {
+        case 0:
+            return 0;
+        case VMM_ENOMEM:
+            return VFS_ENOMEM;
+        default:
+            return VFS_EINVAL;
+    }
+}
@@ -0,0 +1,247 @@
+#include "virtio.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "atomic.h"
+#include "paging.h"
+#include "pmm.h"
+#include "ports.h"
+
+static inline size_t __align(size_t size)
+{
+    return (size + VIRTIO_QUEUE_ALIGN - 1) & ~(VIRTIO_QUEUE_ALIGN - 1);
+}
+
+// Resets a device and agrees on the features both sides support, returns
+// them.
+uint32_t virtio_negotiate(uint16_t iobase, uint32_t supported)
+{
+    uint32_t features;
+
+    outb(iobase + VIRTIO_REG_STATUS, 0);
+    outb(iobase + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    outb(iobase + VIRTIO_REG_STATUS,
+        VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    features = inl(iobase + VIRTIO_REG_DEVICE_FEATURES) & supported;
+    outl(iobase + VIRTIO_REG_DRIVER_FEATURES, features);
+
+    return features;
+}
+
+// Lets the device process its queues.
+void virtio_ready(uint16_t iobase)
+{
+    outb(iobase + VIRTIO_REG_STATUS,
+        inb(iobase + VIRTIO_REG_STATUS) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+// Tells the device that the driver gave up on it.
+void virtio_fail(uint16_t iobase)
+{
+    outb(iobase + VIRTIO_REG_STATUS,
+        inb(iobase + VIRTIO_REG_STATUS) | VIRTIO_STATUS_FAILED);
+}
+
+// Allocates the rings of a queue and hands them to the device.
+int virtq_init(virtqueue_t *vq, uint16_t iobase, uint16_t index, int event_idx)
+{
+    size_t avail_offset, used_offset, cookie_offset;
+    uint8_t *memory;
+    uint16_t size;
+    unsigned i;
+
+    outw(iobase + VIRTIO_REG_QUEUE_SELECT, index);
+    size = inw(iobase + VIRTIO_REG_QUEUE_SIZE);
+
+    if (size == 0 || inl(iobase + VIRTIO_REG_QUEUE_PFN))
+    {
+        return VIRTIO_EINVAL;
+    }
+
+    avail_offset = size * sizeof(virtq_desc_t);
+    used_offset = __align(avail_offset + sizeof(virtq_avail_t) + (size + 1) * sizeof(uint16_t));
+    cookie_offset = __align(used_offset + sizeof(virtq_used_t) +
+        size * sizeof(virtq_used_elem_t) + sizeof(uint16_t));
+
+    memset(vq, 0, sizeof(virtqueue_t));
+    vq->frames = (cookie_offset + size * sizeof(void *) + FRAME_SIZE - 1) / FRAME_SIZE;
+    memory = alloc_frame(vq->frames);
+
+    if ((void *)memory == PMM_NO_MEM)
+    {
+        return VIRTIO_ENOMEM;
+    }
+
+    memset(memory, 0, vq->frames * FRAME_SIZE);
+
+    vq->iobase = iobase;
+    vq->index = index;
+    vq->size = size;
+    vq->event_idx = event_idx;
+    vq->desc = (virtq_desc_t *)memory;
+    vq->avail = (virtq_avail_t *)(memory + avail_offset);
+    vq->used = (virtq_used_t *)(memory + used_offset);
+    vq->used_event = &vq->avail->ring[size];
+    vq->avail_event = (volatile uint16_t *)&vq->used->ring[size];
+    vq->cookies = (void **)(memory + cookie_offset);
+
+    for (i = 0; i < size; i++)
+    {
+        vq->desc[i].next = i + 1 < size ? i + 1 : VIRTQ_END;
+    }
+
+    vq->free_count = size;
+
+    outl(iobase + VIRTIO_REG_QUEUE_PFN, virt_to_phys(memory) / VIRTIO_QUEUE_ALIGN);
+
+    return 0;
+}
+
+// Chains out buffers read by the device and in buffers written by it and
+// puts them into the available ring. The device only sees them after
+// virtq_kick(), so several requests go out with one notification.
+int virtq_add(virtqueue_t *vq, const virtq_buffer_t *buffers, unsigned out, unsigned in, void *cookie)
+{
+    unsigned count = out + in;
+    virtq_desc_t *desc = NULL;
+    uint16_t head, index;
+    unsigned i;
+
+    if (count == 0)
+    {
+        return VIRTIO_EINVAL;
+    }
+
+    if (count > vq->free_count)
+    {
+        return VIRTIO_ENOSPC;
+    }
+
+    head = index = vq->free_head;
+
+    for (i = 0; i < count; i++)
+    {
+        desc = &vq->desc[index];
+        desc->addr = buffers[i].addr;
+        desc->len = buffers[i].len;
+        desc->flags = i >= out ? VIRTQ_DESC_F_WRITE : 0;
+
+        if (i + 1 < count)
+        {
+            desc->flags |= VIRTQ_DESC_F_NEXT;
+            index = desc->next;
+        }
+    }
+
+    // The last descriptor still links the free list.
+    vq->free_head = desc->next;
+    vq->free_count -= count;
+
+    vq->cookies[head] = cookie;
+    vq->avail->ring[vq->avail_idx % vq->size] = head;
+    vq->avail_idx++;
+    vq->in_flight++;
+
+    return 0;
+}
+
+// Publishes the chains added since the last kick and notifies the device,
+// unless it said it is still busy with earlier ones.
+void virtq_kick(virtqueue_t *vq)
+{
+    uint16_t old = vq->kicked_idx;
+    uint16_t new = vq->avail_idx;
+    int notify;
+
+    if (old == new)
+    {
+        return;
+    }
+
+    // The ring entries have to be visible before the index.
+    barrier();
+    vq->avail->idx = new;
+    vq->kicked_idx = new;
+
+    // And the index before the event is read, or both sides may wait.
+    mb();
+
+    if (vq->event_idx)
+    {
+        // Only notify if the device asked for an index of this batch.
+        notify = (uint16_t)(new - *vq->avail_event - 1) < (uint16_t)(new - old);
+    }
+    else
+    {
+        notify = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    if (notify)
+    {
+        outw(vq->iobase + VIRTIO_REG_QUEUE_NOTIFY, vq->index);
+    }
+}
+
+// Takes the next chain the device is done with and frees its descriptors,
+// returns its cookie or NULL if there is none.
+void* virtq_get_used(virtqueue_t *vq, uint32_t *len)
+{
+    virtq_used_elem_t *elem;
+    uint16_t head, index;
+    unsigned count = 1;
+    void *cookie;
+
+    if (vq->last_used == vq->used->idx)
+    {
+        return NULL;
+    }
+
+    // The entry is written before the index.
+    barrier();
+
+    elem = &vq->used->ring[vq->last_used % vq->size];
+    head = elem->id;
+
+    if (len)
+    {
+        *len = elem->len;
+    }
+
+    vq->last_used++;
+
+    for (index = head; vq->desc[index].flags & VIRTQ_DESC_F_NEXT; index = vq->desc[index].next)
+    {
+        count++;
+    }
+
+    vq->desc[index].next = vq->free_head;
+    vq->free_head = head;
+    vq->free_count += count;
+    vq->in_flight--;
+
+    cookie = vq->cookies[head];
+    vq->cookies[head] = NULL;
+
+    return cookie;
+}
+
+// Asks for the next interrupt after the device finished half of the
+// outstanding chains, at least one. Returns whether enough are already done,
+// the caller has to take them without waiting for an interrupt then.
+int virtq_arm(virtqueue_t *vq)
+{
+    uint16_t batch = vq->in_flight > 1 ? vq->in_flight / 2 : 1;
+
+    if (!vq->event_idx)
+    {
+        mb();
+        return vq->last_used != vq->used->idx;
+    }
+
+    // Every outstanding chain completes eventually, so the index is reached.
+    *vq->used_event = vq->last_used + batch - 1;
+    mb();
+
+    return (uint16_t)(vq->used->idx - vq->last_used) >= batch;
+}
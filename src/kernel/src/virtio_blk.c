@@ -0,0 +1,260 @@
+#include "virtio_blk.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "block.h"
+#include "console.h"
+#include "interrupt.h"
+#include "paging.h"
+#include "pci.h"
+#include "pmm.h"
+#include "ports.h"
+#include "spinlock.h"
+#include "virtio.h"
+
+typedef struct virtio_blk_header
+{
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_header_t;
+
+// Header and status of a request in flight, the device reads and writes
+// them while it owns the chain.
+typedef struct virtio_blk_slot
+{
+    virtio_blk_header_t header;
+    volatile uint8_t status;
+    block_request_t *request;   // NULL if the slot is free
+    struct virtio_blk_slot *next;
+} virtio_blk_slot_t;
+
+typedef struct virtio_blk
+{
+    uint16_t iobase;
+    spinlock_t lock;            // driver side of the virtqueue
+    virtqueue_t vq;
+    virtio_blk_slot_t *slots;   // one per request the queue lets in flight
+    block_queue_t queue;
+    block_device_t device;
+} virtio_blk_t;
+
+static virtio_blk_t disk = { .lock = SPINLOCK_INIT("virtio_blk") };
+
+static inline uint32_t __config_read(virtio_blk_t *blk, uint16_t offset)
+{
+    return inl(blk->iobase + VIRTIO_REG_CONFIG + offset);
+}
+
+// Adds a request to the available ring, the device sees it with the rest of
+// the batch on the next kick.
+static void virtio_blk_start(block_queue_t *queue, block_request_t *request)
+{
+    virtio_blk_t *blk = queue->private;
+    virtq_buffer_t buffers[VIRTIO_BLK_MAX_SEGMENTS + 2];
+    virtio_blk_slot_t *slot;
+    unsigned count = 0;
+    uint32_t eflags;
+    bio_t *bio;
+    int error;
+
+    eflags = spin_lock_irqsave(&blk->lock);
+
+    // The block queue never has more requests in flight than slots.
+    for (slot = blk->slots; slot->request; slot++)
+    {
+    }
+
+    slot->request = request;
+    slot->header.type = request->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->header.reserved = 0;
+    slot->header.sector = request->sector;
+    slot->status = 0xFF;
+
+    buffers[count].addr = virt_to_phys(&slot->header);
+    buffers[count++].len = sizeof(virtio_blk_header_t);
+
+    for (bio = request->head; bio; bio = bio->next)
+    {
+        buffers[count].addr = virt_to_phys(bio->buffer);
+        buffers[count++].len = bio->count * BLOCK_SECTOR_SIZE;
+    }
+
+    buffers[count].addr = virt_to_phys((void *)&slot->status);
+    buffers[count++].len = 1;
+
+    if (request->write)
+    {
+        error = virtq_add(&blk->vq, buffers, count - 1, 1, slot);
+    }
+    else
+    {
+        error = virtq_add(&blk->vq, buffers, 1, count - 1, slot);
+    }
+
+    if (error)
+    {
+        slot->request = NULL;
+    }
+
+    spin_unlock_irqrestore(&blk->lock, eflags);
+
+    // Cannot happen with the queue depth derived from the ring size, but
+    // fail the request rather than lose it.
+    if (error)
+    {
+        eflags = irq_save();
+        block_complete(queue, request, BLOCK_EIO);
+        irq_restore(eflags);
+    }
+}
+
+// Publishes the batch and notifies the device once for all of it.
+static void virtio_blk_kick(block_queue_t *queue)
+{
+    virtio_blk_t *blk = queue->private;
+    uint32_t eflags = spin_lock_irqsave(&blk->lock);
+
+    virtq_kick(&blk->vq);
+
+    spin_unlock_irqrestore(&blk->lock, eflags);
+}
+
+// Completes every request in the used ring, the interrupt is only raised
+// again after half of the remaining ones are done.
+static cpu_state_t* virtio_blk_callback(cpu_state_t *cpu)
+{
+    virtio_blk_t *blk = &disk;
+    virtio_blk_slot_t *done;
+    virtio_blk_slot_t **tail;
+    virtio_blk_slot_t *slot;
+    block_request_t *request;
+    int error;
+    int more;
+
+    // Reading the status acknowledges the interrupt.
+    if ((inb(blk->iobase + VIRTIO_REG_ISR) & VIRTIO_ISR_QUEUE) == 0)
+    {
+        return cpu;
+    }
+
+    do
+    {
+        done = NULL;
+        tail = &done;
+
+        spin_lock(&blk->lock);
+
+        while ((slot = virtq_get_used(&blk->vq, NULL)))
+        {
+            *tail = slot;
+            tail = &slot->next;
+        }
+
+        *tail = NULL;
+        more = virtq_arm(&blk->vq);
+
+        spin_unlock(&blk->lock);
+
+        // Completing may start new requests, which need the lock.
+        while (done)
+        {
+            slot = done;
+            done = slot->next;
+
+            request = slot->request;
+            error = slot->status == VIRTIO_BLK_S_OK ? 0 : BLOCK_EIO;
+            barrier();
+            slot->request = NULL;
+
+            block_complete(&blk->queue, request, error);
+        }
+    } while (more);
+
+    return cpu;
+}
+
+void virtio_blk_init()
+{
+    pci_device_t *pci = pci_find_device(VIRTIO_VENDOR, VIRTIO_BLK_DEVICE);
+    virtio_blk_t *blk = &disk;
+    uint32_t features;
+    uint32_t max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    unsigned segments = VIRTIO_BLK_MAX_SEGMENTS;
+    unsigned depth;
+    uint64_t capacity;
+
+    // Only the legacy interface in I/O space is supported.
+    if (pci == NULL || (pci->bar[0] & PCI_BAR_IO) == 0 || pci->irq == PCI_IRQ_NONE)
+    {
+        return;
+    }
+
+    blk->iobase = pci->bar[0] & PCI_BAR_IO_MASK;
+    pci_enable(pci, PCI_COMMAND_IO | PCI_COMMAND_MASTER);
+
+    features = virtio_negotiate(blk->iobase,
+        VIRTIO_F_EVENT_IDX | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX);
+
+    if (virtq_init(&blk->vq, blk->iobase, 0, (features & VIRTIO_F_EVENT_IDX) != 0))
+    {
+        virtio_fail(blk->iobase);
+        return;
+    }
+
+    if ((features & VIRTIO_BLK_F_SEG_MAX) &&
+        __config_read(blk, VIRTIO_BLK_SEG_MAX) < segments)
+    {
+        segments = __config_read(blk, VIRTIO_BLK_SEG_MAX);
+    }
+
+    // A bio is a single segment, it must not exceed the largest one.
+    if ((features & VIRTIO_BLK_F_SIZE_MAX) &&
+        __config_read(blk, VIRTIO_BLK_SIZE_MAX) / BLOCK_SECTOR_SIZE < max_sectors)
+    {
+        max_sectors = __config_read(blk, VIRTIO_BLK_SIZE_MAX) / BLOCK_SECTOR_SIZE;
+    }
+
+    // Every request needs a descriptor for each segment, the header and the
+    // status, so the ring never runs full.
+    if (segments == 0 || segments + 2 > blk->vq.size)
+    {
+        segments = blk->vq.size > 3 ? blk->vq.size - 2 : 1;
+    }
+
+    depth = blk->vq.size / (segments + 2);
+    depth = depth < VIRTIO_BLK_MAX_DEPTH ? depth : VIRTIO_BLK_MAX_DEPTH;
+
+    blk->slots = alloc_frame(1);
+
+    if (max_sectors == 0 || depth == 0 || (void *)blk->slots == PMM_NO_MEM)
+    {
+        virtio_fail(blk->iobase);
+        return;
+    }
+
+    memset(blk->slots, 0, FRAME_SIZE);
+
+    capacity = __config_read(blk, VIRTIO_BLK_CAPACITY) |
+        ((uint64_t)__config_read(blk, VIRTIO_BLK_CAPACITY + 4) << 32);
+
+    block_queue_init(&blk->queue, max_sectors, segments, depth,
+        virtio_blk_start, virtio_blk_kick, blk);
+
+    register_interrupt_handler(IRQ0 + pci->irq, virtio_blk_callback);
+    virtio_ready(blk->iobase);
+
+    blk->device.name = "vda";
+    blk->device.sectors = capacity > 0xFFFFFFFF ? 0xFFFFFFFF : capacity;
+    blk->device.queue = &blk->queue;
+    blk->device.private = blk;
+
+    kprintf("vda: %u descriptors, %u requests of %u segments in flight%s\n",
+        blk->vq.size, depth, segments,
+        blk->vq.event_idx ? ", event index" : "");
+
+    if (blk->device.sectors)
+    {
+        block_register(&blk->device);
+    }
+}
@@ -0,0 +1,37 @@
+/*
+FUNCTION
+    [int strcmp]
+    const char *s1
+    const char *s2
+
+INCLUDES
+    <string.h>
+
+DESCRIPTION
+    Compares the string pointed to by s1 to the string pointed to by s2. The
+    sign of a non-zero return value is determined by the sign of the
+    difference between the values of the first pair of bytes (both
+    interpreted as type unsigned char) that differ in the strings being
+    compared.
+
+RETURNS
+    Returns an integer greater than, equal to, or less than 0, if the string
+    pointed to by s1 is greater than, equal to, or less than the string
+    pointed to by s2, respectively.
+
+ERRORS
+    No errors are defined.
+*/
+
+#include <string.h>
+
+int strcmp(const char *s1, const char *s2)
+{
+    while (*s1 && *s1 == *s2)
+    {
+        s1++;
+        s2++;
+    }
+
+    return *(const unsigned char *)s1 - *(const unsigned char *)s2;
+}
@@ -0,0 +1,206 @@
+/*
+mkinitrd - packs a directory into an initrd image for the kernel
+
+usage: mkinitrd <image> <directory>
+
+Every regular file below the directory becomes an entry named by its path
+relative to the directory. The layout is described in initrd.h.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "initrd.h"
+
+#define MAX_FILES   4096
+#define MAX_PATH    1024
+
+typedef struct file
+{
+    char path[MAX_PATH];    // path on the host
+    const char *name;       // path within the image
+    uint32_t size;
+} file_t;
+
+static file_t files[MAX_FILES];
+static uint32_t file_count = 0;
+
+static uint32_t align_up(uint32_t value)
+{
+    return (value + INITRD_ALIGN - 1) & ~(INITRD_ALIGN - 1);
+}
+
+// Collects the regular files below a directory.
+static int collect(const char *dir, size_t root_length)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    struct stat st;
+    char path[MAX_PATH];
+
+    if (d == NULL)
+    {
+        perror(dir);
+        return -1;
+    }
+
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= sizeof(path) ||
+            stat(path, &st) != 0)
+        {
+            fprintf(stderr, "%s: cannot access\n", path);
+            closedir(d);
+            return -1;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (collect(path, root_length) != 0)
+            {
+                closedir(d);
+                return -1;
+            }
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            if (file_count == MAX_FILES || st.st_size > UINT32_MAX)
+            {
+                fprintf(stderr, "%s: too many or too large files\n", path);
+                closedir(d);
+                return -1;
+            }
+
+            strcpy(files[file_count].path, path);
+            files[file_count].name = files[file_count].path + root_length + 1;
+            files[file_count].size = st.st_size;
+            file_count++;
+        }
+    }
+
+    closedir(d);
+
+    return 0;
+}
+
+// Copies a file into the image at the current position.
+static int copy_file(FILE *out, const file_t *file)
+{
+    char buffer[INITRD_ALIGN];
+    size_t length;
+    FILE *in = fopen(file->path, "rb");
+
+    if (in == NULL)
+    {
+        perror(file->path);
+        return -1;
+    }
+
+    while ((length = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    {
+        fwrite(buffer, 1, length, out);
+    }
+
+    fclose(in);
+
+    return 0;
+}
+
+// Pads the image with zeros up to an offset.
+static void pad(FILE *out, uint32_t offset)
+{
+    while ((uint32_t)ftell(out) < offset)
+    {
+        fputc(0, out);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t i;
+    uint32_t name, data;
+    initrd_header_t header;
+    initrd_entry_t entry;
+    FILE *out;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <image> <directory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (collect(argv[2], strlen(argv[2])) != 0)
+    {
+        return EXIT_FAILURE;
+    }
+
+    out = fopen(argv[1], "wb");
+
+    if (out == NULL)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // Names follow the entries, the data of the first file the names.
+    name = sizeof(header) + file_count * sizeof(entry);
+    data = name;
+
+    for (i = 0; i < file_count; i++)
+    {
+        data += strlen(files[i].name) + 1;
+    }
+
+    data = align_up(data);
+
+    header.magic = INITRD_MAGIC;
+    header.count = file_count;
+    header.size = data;
+
+    for (i = 0; i < file_count; i++)
+    {
+        header.size = align_up(header.size + files[i].size);
+    }
+
+    fwrite(&header, sizeof(header), 1, out);
+
+    for (i = 0; i < file_count; i++)
+    {
+        entry.name = name;
+        entry.offset = data;
+        entry.size = files[i].size;
+        fwrite(&entry, sizeof(entry), 1, out);
+
+        name += strlen(files[i].name) + 1;
+        data = align_up(data + files[i].size);
+    }
+
+    for (i = 0; i < file_count; i++)
+    {
+        fwrite(files[i].name, 1, strlen(files[i].name) + 1, out);
+    }
+
+    for (i = 0; i < file_count; i++)
+    {
+        pad(out, align_up(ftell(out)));
+
+        if (copy_file(out, &files[i]) != 0)
+        {
+            fclose(out);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pad(out, header.size);
+    fclose(out);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# Symbolizes the samples a kernel built with -DPROFILE sends over the serial
+# port and prints them as folded stacks, one line per distinct stack:
+#
+#     kmain;start_modules;elf_load_file;memset 42
+#
+# which flamegraph.pl turns into a flame graph. A flat profile of the
+# functions the samples hit goes to stderr.
+#
+#     qemu-system-i386 -cdrom build/iso/bootable.iso -serial file:serial.log
+#     src/tools/profile.py build/kernel/kernel.bin serial.log > boot.folded
+#     flamegraph.pl boot.folded > boot.svg
+#
+# The symbols are read with nm, set NM to use another one than i386-elf-nm.
+
+import bisect
+import collections
+import os
+import shutil
+import subprocess
+import sys
+
+
+def load_symbols(kernel):
+    nm = os.environ.get("NM") or shutil.which("i386-elf-nm") or "nm"
+    output = subprocess.run([nm, "-n", kernel], check=True,
+                            capture_output=True, text=True).stdout
+    addresses = []
+    names = []
+
+    for line in output.splitlines():
+        fields = line.split()
+
+        if len(fields) == 3 and fields[1] in "tTwW":
+            addresses.append(int(fields[0], 16))
+            names.append(fields[2])
+
+    return addresses, names
+
+
+def symbolize(symbols, address):
+    addresses, names = symbols
+    index = bisect.bisect_right(addresses, address) - 1
+
+    return names[index] if index >= 0 else "0x%x" % address
+
+
+def read_samples(log):
+    samples = []
+    inside = False
+
+    with open(log, errors="replace") as f:
+        for line in f:
+            fields = line.split()
+
+            if fields[:2] == ["profile", "begin"]:
+                samples = []
+                inside = True
+            elif fields[:2] == ["profile", "end"]:
+                inside = False
+                sys.stderr.write("%d samples, %d dropped\n" %
+                                 (int(fields[2], 16), int(fields[3], 16)))
+            elif inside and len(fields) >= 3:
+                addresses = [int(field, 16) for field in fields[2:]]
+                samples.append((fields[1] == "u", addresses))
+
+    return samples
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write("usage: %s <kernel.bin> <serial log>\n" % sys.argv[0])
+        return 1
+
+    symbols = load_symbols(sys.argv[1])
+    stacks = collections.Counter()
+    functions = collections.Counter()
+
+    for user, addresses in read_samples(sys.argv[2]):
+        if user:
+            frames = ["[user]"]
+        else:
+            # Return addresses point after the call, which may be the first
+            # instruction of the next function.
+            frames = [symbolize(symbols, addresses[0])]
+            frames += [symbolize(symbols, a - 1) for a in addresses[1:]]
+
+        functions[frames[0]] += 1
+        stacks[";".join(reversed(frames))] += 1
+
+    for stack, count in sorted(stacks.items()):
+        print("%s %d" % (stack, count))
+
+    total = sum(functions.values())
+
+    for function, count in functions.most_common(20):
+        sys.stderr.write("%6.2f%% %6d  %s\n" %
+                         (100.0 * count / total, count, function))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+# Converts the records a kernel built with -DTRACE_BOOT sends over the
+# serial port into a Chrome trace, which chrome://tracing and Perfetto show
+# as a timeline with one row per cpu:
+#
+#     qemu-system-i386 -cdrom build/iso/bootable.iso -serial file:serial.log
+#     src/tools/trace.py serial.log > boot.json
+#
+# Interrupts become spans, the thread running on a cpu a second row of
+# spans and every other event an instant marker.
+
+import json
+import struct
+import sys
+
+IRQ_ENTRY = 0
+IRQ_EXIT = 1
+SWITCH = 6
+
+EVENTS = {
+    2: ("alloc_frame", "address", "frames"),
+    3: ("free_frame", "address", "frames"),
+    4: ("map_page", "virtual", "physical"),
+    5: ("page_fault", "address", "error"),
+}
+
+RECORD = struct.Struct("<QII")
+
+
+def read_line(data, offset):
+    end = data.index(b"\n", offset)
+    return data[offset:end].decode("ascii", "replace").split(), end + 1
+
+
+def read_trace(data):
+    offset = data.rindex(b"trace begin ")
+    fields, offset = read_line(data, offset)
+    cpus, cycles_per_tick, frequency = (int(field, 16) for field in fields[2:5])
+    records = []
+
+    for _ in range(cpus):
+        fields, offset = read_line(data, offset)
+        cpu, count = int(fields[1], 16), int(fields[2], 16)
+
+        for _ in range(count):
+            stamp, a, b = RECORD.unpack_from(data, offset)
+            offset += RECORD.size
+            records.append((stamp >> 16, cpu, stamp & 0xFFFF, a, b))
+
+    # The time stamp counters of the cpus are assumed to be in sync.
+    records.sort()
+    cycles_per_us = cycles_per_tick * frequency / 1e6 if cycles_per_tick else 1
+
+    return records, cycles_per_us
+
+
+def convert(records, cycles_per_us):
+    events = []
+    running = {}
+    start = records[0][0] if records else 0
+
+    for tsc, cpu, event, a, b in records:
+        ts = (tsc - start) / cycles_per_us
+        base = {"ts": ts, "pid": 0, "tid": cpu}
+
+        if event == IRQ_ENTRY:
+            events.append(dict(base, ph="B", name="irq 0x%x" % a,
+                               args={"eip": "0x%x" % b}))
+        elif event == IRQ_EXIT:
+            events.append(dict(base, ph="E"))
+        elif event == SWITCH:
+            if cpu in running:
+                events.append(dict(base, ph="E", pid=1))
+
+            events.append(dict(base, ph="B", pid=1, name="thread %u" % b))
+            running[cpu] = b
+        elif event in EVENTS:
+            name, first, second = EVENTS[event]
+            events.append(dict(base, ph="i", s="t", name=name,
+                               args={first: "0x%x" % a, second: "0x%x" % b}))
+
+    for pid, name in ((0, "cpus"), (1, "threads")):
+        events.append({"ph": "M", "pid": pid, "name": "process_name",
+                       "args": {"name": name}})
+
+    return {"traceEvents": events, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write("usage: %s <serial log>\n" % sys.argv[0])
+        return 1
+
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+
+    try:
+        records, cycles_per_us = read_trace(data)
+    except ValueError:
+        sys.stderr.write("%s: no trace found\n" % sys.argv[1])
+        return 1
+
+    sys.stderr.write("%d records\n" % len(records))
+    json.dump(convert(records, cycles_per_us), sys.stdout)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())